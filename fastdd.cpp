@@ -33,8 +33,10 @@
 //#include <linux/fcntl.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <string.h>
 #include <pthread.h>
@@ -45,18 +47,44 @@
 using namespace std;
 
 #ifndef TOT_BUFFERS
-#define TOT_BUFFERS 2
+#define TOT_BUFFERS 2       // default depth of the buffer ring (buffers=N)
+#endif
+
+#ifndef PARALLEL_THRESHOLD
+#define PARALLEL_THRESHOLD (4<<20)   // smaller inputs are copied without threads (parallel-threshold=BYTES)
+#endif
+
+#ifndef VERIFY_RANGES
+#define VERIFY_RANGES 8     // written ranges a verifier can be behind its writer
+#endif
+
+#ifndef MMAP_WINDOW
+#define MMAP_WINDOW (64<<20)         // engine=mmap maps the input this many bytes at time
 #endif
 
 #define MAX(X,Y)	(((X)>(Y)) ? (X) : (Y))
 #define MIN(X,Y)	(((X)<(Y)) ? (X) : (Y))
 
 #include "fastdd_t.hpp"
+#include "fastdd_uring.hpp"
+#include "fastdd_ring.hpp"
+#include "fastdd_zero.hpp"
+#include "fastdd_mmap.hpp"
+#include "fastdd_multihash.hpp"
+#include "fastdd_hash_pool.hpp"
+#include "fastdd_digest.hpp"
+#include "fastdd_tree.hpp"
+#include "fastdd_gzip_index.hpp"
+#include "fastdd_buffer_pool.hpp"
+#include "fastdd_stage.hpp"
 #include "partition_manager.hpp"
 #include "fastdd_module.hpp"
 #include "fastdd_module_regex.hpp"
 #include "fastdd_module_conv.hpp"
 #include "fastdd_module_gzip.hpp"
+#include "fastdd_module_zstd.hpp"
+#include "fastdd_module_lz4.hpp"
+#include "fastdd_decoder.hpp"
 
 // variables
 map<string,uint64_t> hum_str2int;   // change suffixes KB,MB ecc in int64_t
@@ -134,14 +162,30 @@ progress_bar pb;
 vector<fastdd_module *> modules;
 
 settings_t settings;   // configuration of the program
-buffer_t buffer[TOT_BUFFERS];
+buffer_t *buffer;       // ring of tot_buffers buffers
+int tot_buffers;
 fastdd_file_t *fi_common, *fo_common;
 int tot_output_file;
+fastdd_uring uring;     // used by engine=uring
+fastdd_mmap mapped;     // used by engine=mmap
+fastdd_block_hasher *block_hasher = NULL;   // block digests of the input on threads (NULL: inline)
+fastdd_tree *tree_hasher = NULL;    // hash-tree of the input
+fastdd_gzip_index input_index;      // if-gzip-index: decompresses the input
+fastdd_decoder decoder;     // decode=FORMAT: decompresses the input
+fastdd_buffer_pool buffer_pool;     // output buffers of the modules of API v2
+fastdd_stage stage;         // the modules, between the reader and the writers
+vector<fastdd_module *> stage_modules;  // the module of every step of the stage
+int stage_continue_on_error;    // as reader_state_t.continue_on_error, for the stage
+pthread_mutex_t module_error_mutex = PTHREAD_MUTEX_INITIALIZER;     // one question at time
+bool mmap_views = false;    // engine=mmap: the buffers can be views of the mapping
+int64_t mmap_copies = 0;    // engine=mmap: buffers copied because their view could not be locked
+fastdd_ring ring;       // lock-free handoff of the buffers (handoff=lockfree)
 //ofstream couttime;
 //uint64_t t_start;
 
 // variables
 const char *program_name;
+const char *engine_names[] = { "read", "uring", "zero-copy", "auto", "mmap" };
 
 #define PROGRAM_NAME "fastdd"
 #define VERSION_MAJOR "1"
@@ -151,6 +195,9 @@ const char *program_name;
 // function signatures
 void help(void);
 void version(void);
+void benchmark_handoff(void);
+void benchmark_digests(void);
+int verify_tree(void);
 
 void init_default_settings() {
     settings.bs=-1;
@@ -170,7 +217,21 @@ void init_default_settings() {
     settings.is_direct_o = O_DIRECT;
     settings.is_o_trunc = O_TRUNC;
     settings.full_block = false;
+    settings.is_sparse = false;
+    settings.is_clone = false;
     settings.is_parallel = true;
+    settings.parallel_threshold = PARALLEL_THRESHOLD;
+    settings.engine = ENGINE_AUTO;
+    settings.queue_depth = 8;
+    settings.block_hash_threads = 0;
+    settings.module_threads = 0;
+    settings.decode_threads = 0;
+    settings.tree_leaf = 1<<20;
+    settings.handoff = HANDOFF_LOCKFREE;
+    settings.is_benchmark_handoff = false;
+    settings.is_benchmark_digests = false;
+    settings.tot_buffers = TOT_BUFFERS;
+    settings.max_lag = -1;
     settings.is_progress_bar = true;
     settings.is_verbose = false;
     settings.is_debug = false;
@@ -261,6 +322,12 @@ void init_read_flag(string flag) {
         settings.reading_attempts=0;
         settings.bs = 1<<24;
     }
+    else if (!flag.compare("--sparse")) {
+        settings.is_sparse = true;
+    }
+    else if (!flag.compare("--clone")) {
+        settings.is_clone = true;
+    }
     else if (!flag.compare("--full-block")) {
         settings.full_block = true;
     }
@@ -272,6 +339,12 @@ void init_read_flag(string flag) {
         settings.is_get_partition=true;
         settings.is_print_partition=true;
     }
+    else if (!flag.compare("--benchmark-handoff")) {
+        settings.is_benchmark_handoff = true;
+    }
+    else if (!flag.compare("--benchmark-digests")) {
+        settings.is_benchmark_digests = true;
+    }
     else if (!flag.compare("--debug")) {
         settings.is_debug = settings.is_verbose = true;
     }
@@ -404,6 +477,45 @@ void init_read_operand(string op) {
         }
         settings.md_file_name = right;
     }
+    else if (!left.compare("hash-tree")) {
+        size_t comma = right.find(',');
+        settings.md_tree = right.substr(0, comma);
+        if (comma != string::npos) {
+            string leaf = right.substr(comma+1);
+            if (leaf.compare(0, 5, "leaf=")) {
+                cerr << program_name << ": error: unknown hash-tree parameter '" << leaf << "' (use leaf=SIZE)\n";
+                exit(1);
+            }
+            settings.tree_leaf = init_read_suffixed_number(leaf.substr(5));
+        }
+        if (!settings.md_tree.length() || settings.tree_leaf < 1) {
+            cerr << program_name << ": error: hash-tree needs an algorithm and a positive leaf size.\n";
+            exit(1);
+        }
+    }
+    else if (!left.compare("hash-tree-save")) {
+        settings.tree_file_name = right;
+    }
+    else if (!left.compare("hash-tree-verify")) {
+        settings.tree_verify_file_name = right;
+    }
+    else if (!left.compare("if-gzip-index")) {
+        settings.input_index_file_name = right;
+    }
+    else if (!left.compare("decode")) {
+        if (!fastdd_decoder::is_format(right)) {
+            cerr << program_name << ": error: unknown decode format '" << right << "' (use auto, gzip, zstd or lz4).\n";
+            exit(1);
+        }
+        settings.decode = right;
+    }
+    else if (!left.compare("decode-threads")) {
+        settings.decode_threads = atoi(right.c_str());
+        if (settings.decode_threads < 1 || settings.decode_threads > 1024) {
+            cerr << program_name << ": error: decode-threads must be between 1 and 1024.\n";
+            exit(1);
+        }
+    }
     else if (!left.compare("reread-bs")) {
         settings.reread_bs = init_read_suffixed_number(right);
         if (settings.reading_attempts < 0) {
@@ -411,6 +523,69 @@ void init_read_operand(string op) {
             exit(1);
         }
     }
+    else if (!left.compare("buffers")) {
+        settings.tot_buffers = atoi(right.c_str());
+        if (settings.tot_buffers < 2) {
+            cerr << program_name << ": error: buffers must be at least 2.\n";
+            exit(1);
+        }
+    }
+    else if (!left.compare("spill-dir")) {
+        settings.spill_dir = right;
+    }
+    else if (!left.compare("max-lag")) {
+        settings.max_lag = init_read_suffixed_number(right);
+    }
+    else if (!left.compare("engine")) {
+        if (!right.compare("read"))
+            settings.engine = ENGINE_READ;
+        else if (!right.compare("uring"))
+            settings.engine = ENGINE_URING;
+        else if (!right.compare("zero-copy"))
+            settings.engine = ENGINE_ZERO_COPY;
+        else if (!right.compare("auto"))
+            settings.engine = ENGINE_AUTO;
+        else if (!right.compare("mmap"))
+            settings.engine = ENGINE_MMAP;
+        else {
+            cerr << program_name << ": error: unknown engine '" << right << "' (use auto, read, uring, mmap or zero-copy)\n";
+            exit(1);
+        }
+    }
+    else if (!left.compare("queue-depth")) {
+        settings.queue_depth = atoi(right.c_str());
+        if (settings.queue_depth < 1 || settings.queue_depth > 4096) {
+            cerr << program_name << ": error: queue-depth must be between 1 and 4096.\n";
+            exit(1);
+        }
+    }
+    else if (!left.compare("block-hash-threads")) {
+        settings.block_hash_threads = atoi(right.c_str());
+        if (settings.block_hash_threads < 1 || settings.block_hash_threads > 1024) {
+            cerr << program_name << ": error: block-hash-threads must be between 1 and 1024.\n";
+            exit(1);
+        }
+    }
+    else if (!left.compare("module-threads")) {
+        settings.module_threads = atoi(right.c_str());
+        if (settings.module_threads < 1 || settings.module_threads > 1024) {
+            cerr << program_name << ": error: module-threads must be between 1 and 1024.\n";
+            exit(1);
+        }
+    }
+    else if (!left.compare("parallel-threshold")) {
+        settings.parallel_threshold = init_read_suffixed_number(right);
+    }
+    else if (!left.compare("handoff")) {
+        if (!right.compare("lockfree"))
+            settings.handoff = HANDOFF_LOCKFREE;
+        else if (!right.compare("mutex"))
+            settings.handoff = HANDOFF_MUTEX;
+        else {
+            cerr << program_name << ": error: unknown handoff '" << right << "' (use lockfree or mutex)\n";
+            exit(1);
+        }
+    }
     else if (!left.compare("hash-blocks")) {
         add_to_vector(settings.md_blocks, right);
     }
@@ -471,6 +646,8 @@ void init_read_arguments_settings(int argc, char *argv[]) {
         if (settings.obs==-1)
             settings.obs=512;
     }
+    else if (settings.is_benchmark_digests)
+        settings.ibs = settings.obs = settings.bs = 1<<20;
     else
         settings.ibs = settings.obs = settings.bs = 512;
 
@@ -491,7 +668,35 @@ void init_read_arguments_settings(int argc, char *argv[]) {
         exit(1);
     }
 
+    if (settings.input_index_file_name.length() && !settings.input_file_name.length()) {
+        cerr << program_name << ": if-gzip-index=FILE needs an input file (if=).\n";
+        exit(1);
+    }
+    
+    if (settings.input_index_file_name.length() && settings.decode.length()) {
+        cerr << program_name << ": if-gzip-index and decode can not be used together.\n";
+        exit(1);
+    }
+
+    if (settings.tree_file_name.length() && !settings.md_tree.length()) {
+        cerr << program_name << ": hash-tree-save=FILE needs hash-tree=ALGORITHM.\n";
+        exit(1);
+    }
+
+    if (settings.max_lag >= 0 && !settings.spill_dir.length()) {
+        cerr << program_name << ": max-lag=BYTES needs spill-dir=DIR.\n";
+        exit(1);
+    }
+
+    if (settings.spill_dir.length() && settings.handoff == HANDOFF_LOCKFREE) {
+        settings.handoff = HANDOFF_MUTEX;   // the reader must look inside the buffers to spill them
+        if (settings.is_verbose)
+            settings.ofstream_log_file << "spill-dir needs handoff=mutex, using it" << endl;
+    }
+
     /////// hash di default
+    if (settings.md_files.size() < 1 && settings.is_benchmark_digests)
+        add_to_vector(settings.md_files, "md5,sha1,sha256,sha512,blake2b512,blake3,xxh3-128,crc32c");
     if (settings.md_files.size() < 1) settings.md_files.push_back("md5");
     if (settings.md_blocks.size() < 1) settings.md_blocks.push_back("md5");
     
@@ -508,8 +713,20 @@ void init_read_arguments_settings(int argc, char *argv[]) {
         settings.ofstream_log_file << "\tskip: " << settings.skip << endl;
         settings.ofstream_log_file << "\tseek: " << settings.seek << endl;
         settings.ofstream_log_file << "\tcount: " << settings.count << endl;
+        settings.ofstream_log_file << "\tgzip index of input: " << settings.input_index_file_name << endl;
+        settings.ofstream_log_file << "\tdecode: " << settings.decode << " (" << settings.decode_threads << " threads)" << endl;
+        settings.ofstream_log_file << "\tengine: " << engine_names[settings.engine] << endl;
+        settings.ofstream_log_file << "\tqueue depth: " << settings.queue_depth << endl;
+        settings.ofstream_log_file << "\tblock hash threads: " << settings.block_hash_threads << endl;
+        settings.ofstream_log_file << "\tmodule threads: " << settings.module_threads << endl;
+        settings.ofstream_log_file << "\tbuffers: " << settings.tot_buffers << endl;
+        settings.ofstream_log_file << "\thandoff: " << ((settings.handoff==HANDOFF_MUTEX) ? "mutex" : "lockfree") << endl;
+        settings.ofstream_log_file << "\tspill dir: " << settings.spill_dir << endl;
+        settings.ofstream_log_file << "\tmax lag: " << settings.max_lag << endl;
         settings.ofstream_log_file << "\toutput file for md blocks: " << settings.md_file_name << endl;
         settings.ofstream_log_file << "\t\t is file ready: " << settings.ofstream_md.is_open() << endl;
+        settings.ofstream_log_file << "\thash tree: " << settings.md_tree << " (leaf " << settings.tree_leaf << ")" << endl;
+        settings.ofstream_log_file << "\toutput file for hash tree: " << settings.tree_file_name << endl;
         settings.ofstream_log_file << "\tlog file: "<< settings.log_file << endl;
         settings.ofstream_log_file << "\t\tis file ready: "<< settings.ofstream_log_file.is_open() << endl;
         
@@ -533,6 +750,9 @@ void init_read_arguments_settings(int argc, char *argv[]) {
         settings.ofstream_log_file << "\tdirect input: " << settings.is_direct_i << endl;
         settings.ofstream_log_file << "\tdirect output: " << settings.is_direct_o << endl;
         settings.ofstream_log_file << "\tparallel: " << settings.is_parallel << endl;
+        settings.ofstream_log_file << "\tsparse: " << settings.is_sparse << endl;
+        settings.ofstream_log_file << "\tclone: " << settings.is_clone << endl;
+        settings.ofstream_log_file << "\tparallel threshold: " << settings.parallel_threshold << endl;
         settings.ofstream_log_file << "\tprogress bar: " << settings.is_progress_bar << endl;
         settings.ofstream_log_file << "\tverbose: "<< settings.is_verbose << endl;
         settings.ofstream_log_file << "\tdebug: "<< settings.is_debug << endl;
@@ -549,15 +769,36 @@ void init_read_arguments_settings(int argc, char *argv[]) {
         settings.ofstream_log_file << "skip: " << settings.skip << endl;
         settings.ofstream_log_file << "seek: " << settings.seek << endl;
         settings.ofstream_log_file << "count: " << settings.count << endl;
+        settings.ofstream_log_file << "engine: " << engine_names[settings.engine] << endl;
     }
 }
 
 void init_buffers() {
     int tot;
     if (settings.is_parallel)
-        tot = TOT_BUFFERS;
+        tot = settings.tot_buffers;
     else
         tot = 1;
+    
+    // the whole ring must fit in memory
+    uint64_t ring_size = (uint64_t) settings.bs * tot;
+    uint64_t phys_mem = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    uint64_t free_mem = (uint64_t) sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (ring_size > phys_mem) {
+        cerr << program_name << ": error: " << tot << " buffers of " << settings.bs << " bytes need "
+            << ring_size << " bytes, but only " << phys_mem << " bytes of memory are installed" << endl;
+        exit(1);
+    }
+    if (ring_size > free_mem) {
+        if (settings.is_verbose)
+            settings.ofstream_log_file << "warning: buffer ring (" << ring_size << " bytes) is bigger than free memory ("
+                << free_mem << " bytes)" << endl;
+        cerr << program_name << ": warning: buffer ring (" << ring_size << " bytes) is bigger than free memory ("
+            << free_mem << " bytes)" << endl;
+    }
+    
+    buffer = (buffer_t *) malloc(tot * sizeof(buffer_t));
+    tot_buffers = tot;
 
     for (int i=0; i<tot; i++) {
         int t = posix_memalign( (void **) &(buffer[i].buffer), 512, settings.bs);
@@ -565,6 +806,8 @@ void init_buffers() {
             cerr << program_name << ": error: allocating buffer " << i << ": " << strerror(errno) << endl;
             exit(1);
         }
+        buffer[i].own_buffer = buffer[i].buffer;
+        buffer[i].capacity = settings.bs;
         buffer[i].length = 0;
         buffer[i].is_full = false;
         buffer[i].is_empty = true;
@@ -587,28 +830,33 @@ void init_buffers() {
         buffer[i].tot_digests = 0;
         if (settings.is_md_blocks_check || settings.is_md_blocks_save) {
             buffer[i].tot_digests = settings.md_blocks.size();
-            buffer[i].ctx = (EVP_MD_CTX *) malloc(sizeof(EVP_MD_CTX) * buffer[i].tot_digests);
-            buffer[i].digest_type = (const EVP_MD **) malloc(sizeof(const EVP_MD *) * buffer[i].tot_digests);
+            buffer[i].ctx = (fastdd_md_ctx_t *) malloc(sizeof(fastdd_md_ctx_t) * buffer[i].tot_digests);
+            buffer[i].digest_type = (const fastdd_md_t **) malloc(sizeof(const fastdd_md_t *) * buffer[i].tot_digests);
             buffer[i].hash = (unsigned char **) malloc(sizeof(unsigned char *) * buffer[i].tot_digests);
             buffer[i].hash_len = (unsigned int *) malloc(buffer[i].tot_digests * sizeof(unsigned int) );
             
             for (int j=0; j<buffer[i].tot_digests; j++) {
-                buffer[i].digest_type[j] = EVP_get_digestbyname(settings.md_blocks[j].c_str());
+                buffer[i].digest_type[j] = fastdd_digest::get_digestbyname(settings.md_blocks[j].c_str());
                         
                 if(!(buffer[i].digest_type[j])) {
                         cerr << program_name << ": unknown message digest "<< settings.md_blocks[j] << endl;
                         exit(1);
                 }
-                EVP_MD_CTX_init(&(buffer[i].ctx[j]));
-                EVP_DigestInit_ex(&(buffer[i].ctx[j]), buffer[i].digest_type[j], NULL);
+                fastdd_digest::ctx_init(&(buffer[i].ctx[j]));
+                fastdd_digest::digest_init(&(buffer[i].ctx[j]), buffer[i].digest_type[j]);
                 
                 buffer[i].hash[j] = (unsigned char *) malloc(EVP_MAX_MD_SIZE * sizeof(unsigned char));
                 memset(buffer[i].hash[j], 0, EVP_MAX_MD_SIZE);
             }
         }
         
-        buffer[i].the_other_buffer = &buffer[(i+1)%tot];
+        buffer[i].next_buffer = &buffer[(i+1)%tot];
     }
+    
+    buffer_pool.init(settings.bs);
+    
+    if (settings.is_verbose)
+        settings.ofstream_log_file << "buffer ring: " << tot << " buffers of " << settings.bs << " bytes (" << ring_size << " bytes)" << endl;
 }
 
 /** Determine if file is a character device */
@@ -678,10 +926,120 @@ bool is_block_device(int fd) {
     return false;
 }
 
+/** map the data extents of a sparse regular input (SEEK_DATA/SEEK_HOLE), so
+    the reader can make up the zeros of its holes instead of reading them */
+void init_extents(fastdd_file_t *fi) {
+    fi->has_holes = false;
+    fi->tot_extents = fi->cur_extent = 0;
+    fi->extent_start = fi->extent_end = NULL;
+    
+    struct stat st;
+    if (fstat(fi->file_descriptor, &st) || !S_ISREG(st.st_mode))
+        return;
+    
+    off_t saved = lseek(fi->file_descriptor, 0, SEEK_CUR);
+    int64_t size = st.st_size, holes = size;
+    int max_extents = 0;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fi->file_descriptor, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;      // only a hole till the end
+            fi->tot_extents = 0;            // not supported: read everything
+            holes = 0;
+            break;
+        }
+        off_t hole = lseek(fi->file_descriptor, data, SEEK_HOLE);
+        if (hole < 0) {
+            fi->tot_extents = 0;
+            holes = 0;
+            break;
+        }
+        
+        if (fi->tot_extents == max_extents) {
+            max_extents = MAX(16, 2*max_extents);
+            fi->extent_start = (int64_t *) realloc(fi->extent_start, max_extents*sizeof(int64_t));
+            fi->extent_end = (int64_t *) realloc(fi->extent_end, max_extents*sizeof(int64_t));
+        }
+        fi->extent_start[fi->tot_extents] = data;
+        fi->extent_end[fi->tot_extents] = hole;
+        fi->tot_extents++;
+        holes -= hole-data;
+        pos = hole;
+    }
+    lseek(fi->file_descriptor, saved, SEEK_SET);
+    
+    fi->has_holes = (holes > 0);
+    if (settings.is_verbose && fi->has_holes)
+        settings.ofstream_log_file << "input has " << fi->tot_extents << " data extents and " << holes << " bytes of holes" << endl;
+}
+
+/** bytes of hole from offset off of the input on (0 if off is in a data extent).
+    The offsets must come in increasing order */
+int64_t hole_length(fastdd_file_t *fi, int64_t off) {
+    if (!fi->has_holes)
+        return 0;
+    
+    while (fi->cur_extent < fi->tot_extents && fi->extent_end[fi->cur_extent] <= off)
+        fi->cur_extent++;
+    
+    if (fi->cur_extent == fi->tot_extents)          // last hole, up to the end of the file
+        return MAX(fi->total_size_in_byte - off, 0);
+    if (fi->extent_start[fi->cur_extent] <= off)
+        return 0;
+    return fi->extent_start[fi->cur_extent] - off;
+}
+
 fastdd_file_t *init_input_file() {
     fastdd_file_t *ris = (fastdd_file_t *) malloc(sizeof(fastdd_file_t));
 
-    if (settings.input_file_name.length() > 0) {                  // apertura del file di input
+    if (settings.input_index_file_name.length() || settings.decode.length()) {    // a compressed image
+        ris->file_name = (settings.input_file_name.length()) ? settings.input_file_name.c_str() : "stdin";
+        
+        if (settings.input_index_file_name.length() && !input_index.load(settings.input_index_file_name.c_str())) {
+            cerr << program_name << ": error: if-gzip-index: " << input_index.get_error() << endl;
+            exit(1);
+        }
+        int fd = (settings.input_file_name.length()) ? open(ris->file_name, O_RDONLY|O_LARGEFILE) : 0;
+        if (fd == -1) {
+            cerr <<  program_name << ": error while opening \""<< ris->file_name <<"\"\n(" << strerror(errno) << ")\n";
+            exit(1);
+        }
+        
+        ris->skip_in_byte = (uint64_t)settings.ibs*settings.skip;
+        ris->byte_to_read = (settings.count < 0) ? -1 : ((uint64_t)settings.count)*settings.ibs;
+        if (settings.decode.length()) {
+            int threads = settings.decode_threads;
+            if (!threads)
+                threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+            if (!settings.is_parallel)
+                threads = 1;
+            if (!decoder.open(fd, settings.decode, ris->skip_in_byte, ris->byte_to_read, threads, &ris->file_descriptor)) {
+                cerr << program_name << ": error: decode: " << decoder.get_error() << endl;
+                exit(1);
+            }
+        }
+        else if (!input_index.open_range(fd, ris->skip_in_byte, ris->byte_to_read, &ris->file_descriptor)) {
+            cerr << program_name << ": error: if-gzip-index: " << input_index.get_error() << " (skipping "
+                << ris->skip_in_byte << " bytes of " << input_index.get_length() << ")" << endl;
+            exit(1);
+        }
+        
+        // read as a stream, what is skipped is never decompressed
+        ris->total_size_in_byte = -1;
+        ris->current_position = ris->skip_in_byte;
+        ris->byte_read = 0;
+        if (settings.count < 0)
+            settings.is_progress_bar = false;
+        
+        if (settings.is_verbose && settings.decode.length())
+            settings.ofstream_log_file << "input file '" << ris->file_name << "' decoded as " << settings.decode << " from byte " << ris->skip_in_byte << endl;
+        else if (settings.is_verbose) {
+            settings.ofstream_log_file << "input file '" << ris->file_name << "' is a gzip image of " << input_index.get_length()
+                << " bytes in " << input_index.get_tot_members() << " members, decompressed from byte " << ris->skip_in_byte << endl;
+        }
+    }
+    else if (settings.input_file_name.length() > 0) {                  // apertura del file di input
         ris->file_name = settings.input_file_name.c_str();
         
         if (settings.is_direct_i && is_char_dev(ris->file_name))
@@ -719,7 +1077,7 @@ fastdd_file_t *init_input_file() {
         else {  // altrimenti read successivi
             ris->current_position = 0;
             for (int i=0; i<settings.skip; i++) {
-                ris->current_position += read(ris->file_descriptor, (void *) (buffer[i].buffer), settings.ibs);
+                ris->current_position += read(ris->file_descriptor, (void *) (buffer[0].buffer), settings.ibs);
             }
         }
     
@@ -748,10 +1106,12 @@ fastdd_file_t *init_input_file() {
     else {
         ris->file_name = "stdin";
         ris->file_descriptor = 0;	// stdin
+        ris->total_size_in_byte = -1;
+        ris->skip_in_byte = (uint64_t)settings.ibs*settings.skip;
         
         ris->current_position = 0;
         for (int i=0; i<settings.skip; i++) {
-            ris->current_position += read(ris->file_descriptor, (void *) (buffer[i].buffer), settings.ibs);
+            ris->current_position += read(ris->file_descriptor, (void *) (buffer[0].buffer), settings.ibs);
         }
     
         if (errno!=0) {
@@ -775,24 +1135,58 @@ fastdd_file_t *init_input_file() {
     }
     ris->b_compl = ris->b_part = 0;
     
+    init_extents(ris);
+    
+    // io_uring reads are positioned, so they need a seekable input
+    if (settings.engine == ENGINE_URING) {
+        if (ris->file_descriptor == 0 || ris->total_size_in_byte < 0) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "engine=uring needs a regular file or a block device as input, using read()" << endl;
+            settings.engine = ENGINE_READ;
+        }
+        else if (!uring.init(settings.queue_depth)) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "unable to set up io_uring: " << uring.get_error() << ", using read()" << endl;
+            cerr << program_name << ": unable to set up io_uring (" << uring.get_error() << "), using read()" << endl;
+            settings.engine = ENGINE_READ;
+        }
+        else if (settings.is_verbose)
+            settings.ofstream_log_file << "io_uring ready, " << uring.get_depth() << " reads in flight" << endl;
+    }
+    
+    // only what has a size can be mapped
+    if (settings.engine == ENGINE_MMAP) {
+        if (ris->file_descriptor == 0 || ris->total_size_in_byte <= 0) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "engine=mmap needs a regular file or a block device as input, using read()" << endl;
+            settings.engine = ENGINE_READ;
+        }
+        else if (!mapped.init(ris->file_descriptor, ris->total_size_in_byte, MMAP_WINDOW, settings.bs)) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "unable to set up engine=mmap: " << mapped.get_error() << ", using read()" << endl;
+            settings.engine = ENGINE_READ;
+        }
+    }
+    
     ris->tot_digests = 0;
+    ris->hash_pool = NULL;
     if (settings.is_md_file_in) {
         ris->tot_digests = settings.md_files.size();
         
-        ris->ctx = (EVP_MD_CTX *) malloc(ris->tot_digests * sizeof(EVP_MD_CTX) );
-        ris->digest_type = (const EVP_MD **) malloc(ris->tot_digests * sizeof(const EVP_MD *) );
+        ris->ctx = (fastdd_md_ctx_t *) malloc(ris->tot_digests * sizeof(fastdd_md_ctx_t) );
+        ris->digest_type = (const fastdd_md_t **) malloc(ris->tot_digests * sizeof(const fastdd_md_t *) );
         ris->hash = (unsigned char **) malloc(ris->tot_digests * sizeof(unsigned char *) );
         ris->hash_len = (unsigned int *) malloc(ris->tot_digests * sizeof(unsigned int) );
         
         for (int i=0; i<ris->tot_digests; i++) {
-            ris->digest_type[i] = EVP_get_digestbyname(settings.md_files[i].c_str());
+            ris->digest_type[i] = fastdd_digest::get_digestbyname(settings.md_files[i].c_str());
             
             if(!(ris->digest_type[i])) {
                     cerr << program_name << ": unknown message digest "<< settings.md_files[i] << endl;
                     exit(1);
             }
-            EVP_MD_CTX_init(&(ris->ctx[i]));
-            EVP_DigestInit_ex(&(ris->ctx[i]), ris->digest_type[i], NULL);
+            fastdd_digest::ctx_init(&(ris->ctx[i]));
+            fastdd_digest::digest_init(&(ris->ctx[i]), ris->digest_type[i]);
             
             ris->hash[i] = (unsigned char *) malloc(EVP_MAX_MD_SIZE * sizeof( unsigned char));
             memset(ris->hash[i], 0, EVP_MAX_MD_SIZE);
@@ -802,6 +1196,49 @@ fastdd_file_t *init_input_file() {
     return ris;
 }
 
+/** set up the fan-out state of an output: when spill-dir is given, the
+    buffers the output can not take from the ring in time go in a scratch file */
+void init_spill(fastdd_file_t *fo) {
+    fo->next_seq = 0;
+    fo->ring_seq = -1;
+    fo->byte_written = 0;
+    fo->byte_elided = 0;
+    fo->is_sparse = false;
+    fo->clone_of = CLONE_NONE;
+    fo->t_end = 0;
+    fo->spill_fd = -1;
+    fo->spill_head = fo->spill_tail = NULL;
+    fo->spill_bytes = fo->spill_max = 0;
+    fo->spill_end = 0;
+    fo->spill_buffer = NULL;
+    pthread_mutex_init(&fo->spill_mutex, NULL);
+    fo->verify_fd = -1;
+    fo->verify_failed = false;
+    fo->hash_pool = NULL;
+    
+    if (!settings.spill_dir.length() || !settings.is_parallel)
+        return;
+    
+    string name = settings.spill_dir + "/fastdd-spill-XXXXXX";
+    char *temp = strdup(name.c_str());
+    fo->spill_fd = mkstemp(temp);
+    if (fo->spill_fd == -1) {
+        cerr << program_name << ": error: creating spill file in '" << settings.spill_dir << "' (" << strerror(errno) << ")" << endl;
+        exit(1);
+    }
+    unlink(temp);       // scratch file, it disappears with fastdd
+    free(temp);
+    
+    if (posix_memalign( (void **) &(fo->spill_buffer), 512, settings.bs)) {
+        cerr << program_name << ": error: allocating spill buffer for " << fo->file_name << endl;
+        exit(1);
+    }
+    fo->spill_capacity = settings.bs;
+    
+    if (settings.is_verbose)
+        settings.ofstream_log_file << "fan-out enabled for " << fo->file_name << endl;
+}
+
 fastdd_file_t *init_output_file() {
     fastdd_file_t *ris;
 
@@ -820,13 +1257,11 @@ fastdd_file_t *init_output_file() {
         ris[0].current_position = 0;
         ris[0].byte_read = 0;
         ris[0].is_direct_o = 0;
+        ris[0].b_compl = ris[0].b_part = 0;
+        init_spill(&ris[0]);
         
-        if (settings.is_parallel) {
-            for (int j=0; j<TOT_BUFFERS; j++)
-                buffer[j].active[0] = true;
-        }
-        else
-            buffer[0].active[0] = true;
+        for (int j=0; j<tot_buffers; j++)
+            buffer[j].active[0] = true;
             
         if (settings.is_verbose)
             settings.ofstream_log_file << "stdout setted as output file, possible seek options have been ignored." << endl;
@@ -885,20 +1320,20 @@ fastdd_file_t *init_output_file() {
             if (settings.is_md_files_out) {
                 ris[i].tot_digests = settings.md_files.size();
                 
-                ris[i].ctx = (EVP_MD_CTX *) malloc(ris[i].tot_digests * sizeof(EVP_MD_CTX) );
-                ris[i].digest_type = (const EVP_MD **) malloc(ris[i].tot_digests * sizeof(const EVP_MD *) );
+                ris[i].ctx = (fastdd_md_ctx_t *) malloc(ris[i].tot_digests * sizeof(fastdd_md_ctx_t) );
+                ris[i].digest_type = (const fastdd_md_t **) malloc(ris[i].tot_digests * sizeof(const fastdd_md_t *) );
                 ris[i].hash = (unsigned char **) malloc(ris[i].tot_digests * sizeof(unsigned char *) );
                 ris[i].hash_len = (unsigned int *) malloc(ris[i].tot_digests * sizeof(unsigned int) );
                 
                 for (int j=0; j<ris[i].tot_digests; j++) {
-                    ris[i].digest_type[j] = EVP_get_digestbyname(settings.md_files[j].c_str());
+                    ris[i].digest_type[j] = fastdd_digest::get_digestbyname(settings.md_files[j].c_str());
                     
                     if(!(ris[i].digest_type[j])) {
                             cerr << program_name << ": unknown message digest "<< settings.md_files[j] << endl;
                             exit(1);
                     }
-                    EVP_MD_CTX_init(&(ris[i].ctx[j]));
-                    EVP_DigestInit_ex(&(ris[i].ctx[j]), ris[i].digest_type[j], NULL);
+                    fastdd_digest::ctx_init(&(ris[i].ctx[j]));
+                    fastdd_digest::digest_init(&(ris[i].ctx[j]), ris[i].digest_type[j]);
                     
                     ris[i].hash[j] = (unsigned char *) malloc(EVP_MAX_MD_SIZE * sizeof(unsigned char));
                     memset(ris[i].hash[j], 0, EVP_MAX_MD_SIZE);
@@ -907,12 +1342,17 @@ fastdd_file_t *init_output_file() {
             //////////////////////////////////
             
             ris[i].b_compl = ris[i].b_part = 0;
-            if (settings.is_parallel) {
-                for (int j=0; j<TOT_BUFFERS; j++)
-                    buffer[j].active[i] = true;
-            }
-            else
-                buffer[0].active[i] = true;
+            init_spill(&ris[i]);
+            
+            // only regular files can have holes; the zeros that fall over old
+            // data (seek= without truncation) are written anyway
+            struct stat st;
+            if (settings.is_sparse && !fstat(ris[i].file_descriptor, &st) && S_ISREG(st.st_mode))
+                ris[i].is_sparse = true;
+            else if (settings.is_sparse && settings.is_verbose)
+                settings.ofstream_log_file << "'" << ris[i].file_name << "' is not a regular file, --sparse ignored for it" << endl;
+            for (int j=0; j<tot_buffers; j++)
+                buffer[j].active[i] = true;
         }
     }
     
@@ -1038,264 +1478,822 @@ int64_t read_slow(int file_descriptor, uint64_t pos_file, buffer_t *buff, uint64
     return bytes_read;
 }
 
-void *thread_read(void *arg) {
-    fastdd_file_t *fi = (fastdd_file_t *) arg;
-    
-    buffer_t *buff = buffer;
-    
-    int64_t bs= settings.bs;
-    int64_t ibs= settings.ibs;
-    int64_t count= settings.count;    
-    
-    pb = progress_bar(fi->skip_in_byte,
-        ( (fi->byte_to_read > 0) ? (fi->skip_in_byte+fi->byte_to_read) : fi->total_size_in_byte ) );
-    int64_t last_update=-100000000;
+/** a read of 'da_leggere' bytes at offset 'j' of the buffer failed: re-read the
+    range with read_slow/read_blocks, or pad it with \0 if reading-attempts=0 */
+int64_t read_damaged(fastdd_file_t *fi, buffer_t *buff, int64_t j, int64_t da_leggere) {
+    int64_t bytes_read;
     
- //   struct timeval t_1;
-    int64_t next_needed;
-    pm = partition_manager(fi->file_name);
+    if (settings.is_verbose) {
+        settings.ofstream_log_file << program_name << ": error reading block " <<
+            num2str(fi->current_position+j, 16, 16, '0') << "-" <<
+            num2str(fi->current_position+j+da_leggere, 16, 16, '0') << "-" <<
+            "(" << strerror(errno) << ")" << endl;
+    }
     
-    int continue_on_error=-1;   // -1=not set, 0=no, 1=yes
-    if (settings.ignore_module_error) continue_on_error=1;
- //   int64_t t1=t_start, t2, t3;
-    do {
-   //     cerr << "read: blocco buffer" << endl;
-        pthread_mutex_lock(&buff->buffer_mutex);
-        while (buff->is_full && !buff->is_last) {
- //           cerr << "read: aspetto sia vuoto" << endl;
-            pthread_cond_wait (&buff->is_not_full, &buff->buffer_mutex);
-        }
-        
-        if (buff->is_last) {
-            pthread_mutex_unlock(&buff->buffer_mutex);
-            break;
-        }
-      //  cerr << "read: dentro" << endl;
-
-        int64_t tot_read = 0;
-        int64_t bytes_read, temp=1;
-        
-        //memset((void *) buff->buffer, 0, bs);
-        
-        int64_t current_blocks = fi->b_part+fi->b_compl;
-        
-        for (int j=0; (count<0 || (count>=0 && fi->b_compl+fi->b_part<count)) && j<bs; j+=bytes_read) {
-            int64_t da_leggere = MIN(ibs,bs-tot_read);
-       //     gettimeofday(&t_1, NULL);
-        //    t2 = t_1.tv_sec*1000000+t_1.tv_usec;
-            temp = bytes_read = read(fi->file_descriptor, buff->buffer+j, da_leggere);
-        //    gettimeofday(&t_1, NULL);
-        //    t3 = t_1.tv_sec*1000000+t_1.tv_usec;
-        //    couttime << "read "<< (t2-t1) << " " << (t3-t2) << " " << endl;
-        //    t1 = t3;
-            while (temp>0 && bytes_read<da_leggere) {
-                temp = read(fi->file_descriptor, buff->buffer+j+bytes_read, da_leggere-bytes_read);
-                if (temp==0) {
-                    buff->is_last = true;
-                    break;
-                }
-                bytes_read += temp;
-            }
-            
-            if (temp==-1) {
-                if (settings.is_verbose) {
-                    settings.ofstream_log_file << program_name << ": error reading block " <<
-                        num2str(fi->current_position, 16, 16, '0') << "-" <<
-                        num2str(fi->current_position+da_leggere, 16, 16, '0') << "-" <<
-                        "(" << strerror(errno) << ")" << endl;
-                //    cerr << program_name << ": error reading block " <<
-                //        num2str(fi->current_position, 16, 16, '0') << "-" <<
-                //        num2str(fi->current_position+da_leggere, 16, 16, '0') << "-" <<
-                //        "(" << strerror(errno) << ")" << endl;
-                }
-                temp=0;
-                if (settings.reading_attempts) {
-                    if (settings.reread_bs > 512 && settings.bs > settings.reread_bs)
-                        bytes_read = read_slow(fi->file_descriptor, fi->current_position+j, buff, j, da_leggere);
-                    else
-                        bytes_read = read_blocks(fi->file_descriptor, fi->current_position+j, buff, j, da_leggere);
-                                    
-                    if (settings.is_verbose)
-                        settings.ofstream_log_file << "returning to normal buffer size" <<  endl;
-                }
-                else {
-                    lseek(fi->file_descriptor, fi->current_position+j+da_leggere, SEEK_SET);
-                    memset(buff->buffer+j, 0, da_leggere);
-                    
-                    bytes_read=da_leggere;
-                    pb.add_err(fi->current_position+j);
-                    if (settings.is_verbose) {
-                        settings.ofstream_log_file << "unable to read block " << num2str(fi->current_position+j,16,16,'0') << "-"
-                            << num2str(fi->current_position+j+da_leggere,16,16,'0') << " (" << strerror(errno) << ")" << endl;
-                    }
-                    cerr << '\r' << "                                                                                "
-                        << '\r' << "unable to read block " << num2str(fi->current_position+j,16,16,'0') << "-"
-                            << num2str(fi->current_position+j+da_leggere,16,16,'0') << " (" << strerror(errno) << ")" << endl;
-                }
-                
-                if (bytes_read) {
-                    if (!buff->is_last) 
-                        temp=1;
-                }
-                else buff->is_last = true;
-            }
-                
-            if (bytes_read==ibs)
-                fi->b_compl++;
-            else if (bytes_read)
-                fi->b_part++;
-                
-            tot_read+=bytes_read;
-            
-            if ((count>0 && fi->b_compl+fi->b_part >= count) || !bytes_read) {
-                buff->is_last = true;
-            }
-            
-            if (buff->is_last)
-                break;
-        }
-        
-        buff->length = tot_read;
-        buff->is_full = true;
-        buff->is_empty = false;
-        //cerr << "read: letti " << buff->length << endl;
-        
-        ///////////////////////////////////////// MD
-        if (settings.is_md_blocks_save) {           // calcolo e scrivo su file i digest dei blocchi
-            EVP_MD_CTX mdctx;
-            unsigned char md_value[EVP_MAX_MD_SIZE];
-            unsigned int md_len;
-            
-            for (int i=0; i<tot_read; i+=ibs) {
-                for (int i1=0; i1<buff->tot_digests; i1++) {
-                    EVP_MD_CTX_init(&mdctx);
-                    EVP_DigestInit_ex(&mdctx, buff->digest_type[i1], NULL);
-                    EVP_DigestUpdate(&mdctx, buff->buffer+i, MIN(ibs,tot_read-i));
-                    EVP_DigestFinal_ex(&mdctx, md_value, &md_len);
-                    stringstream ss;
-                    for (int i2=0; i2<md_len; i2++) {
-                        ss << setfill('0') << setw(2) << setbase(16) << (unsigned int) md_value[i2];
-                    }
-
-                    settings.ofstream_md << "block " << num2str(current_blocks+i/ibs,10,8,' ')<<": "
-                        <<num2str(fi->current_position,16,16,'0')<<"-"<<num2str(fi->current_position+MIN(ibs,tot_read-i),16,16,'0')<<": "
-                        << settings.md_blocks[i1] << " - " << ss.str() << endl;
-                }
-            }
-        }
-
-        // digest complessivo del file
-        for (int i1=0; i1<fi->tot_digests; i1++) {
-            if (settings.is_md_file_in) {
-                EVP_DigestUpdate(&(fi->ctx[i1]), buff->buffer, tot_read);
-            }
-        }
-        
-        // digest per il confronto
-        for (int i1=0; i1<buff->tot_digests; i1++) {
-            if (settings.is_md_blocks_check) {
-                EVP_MD_CTX_init(&buff->ctx[i1]);
-                EVP_DigestInit_ex(&buff->ctx[i1], buff->digest_type[i1], NULL);
-                EVP_DigestUpdate(&buff->ctx[i1], buff->buffer, tot_read);
-                EVP_DigestFinal_ex(&buff->ctx[i1], buff->hash[i1], &buff->hash_len[i1]);
-            }
-        }
+    if (settings.reading_attempts) {
+        if (settings.reread_bs > 512 && settings.bs > settings.reread_bs)
+            bytes_read = read_slow(fi->file_descriptor, fi->current_position+j, buff, j, da_leggere);
+        else
+            bytes_read = read_blocks(fi->file_descriptor, fi->current_position+j, buff, j, da_leggere);
+                        
+        if (settings.is_verbose)
+            settings.ofstream_log_file << "returning to normal buffer size" <<  endl;
+    }
+    else {
+        lseek(fi->file_descriptor, fi->current_position+j+da_leggere, SEEK_SET);
+        memset(buff->buffer+j, 0, da_leggere);
         
-        //////////////////////////////// partition table
-        if (settings.is_get_partition) {
-            if (current_blocks==0)
-                next_needed = pm.update(buff->buffer, 0);
-            else if (fi->current_position <= next_needed && next_needed < fi->current_position + buff->length)  {
-               // cout << fi->current_position << " " << next_needed << " " << fi->current_position + buff->length;
-                next_needed = pm.update(buff->buffer+(next_needed - fi->current_position), next_needed);
-            }
-            if (pm.is_error()) settings.is_get_partition=false;
+        bytes_read=da_leggere;
+        pb.add_err(fi->current_position+j);
+        if (settings.is_verbose) {
+            settings.ofstream_log_file << "unable to read block " << num2str(fi->current_position+j,16,16,'0') << "-"
+                << num2str(fi->current_position+j+da_leggere,16,16,'0') << " (" << strerror(errno) << ")" << endl;
         }
-        
-        // -------------------------------- use modules
-        for (int i_mod=0; i_mod<modules.size(); i_mod++) {
-            if (!modules[i_mod]->is_active()) continue;
+        cerr << '\r' << "                                                                                "
+            << '\r' << "unable to read block " << num2str(fi->current_position+j,16,16,'0') << "-"
+                << num2str(fi->current_position+j+da_leggere,16,16,'0') << " (" << strerror(errno) << ")" << endl;
+    }
+    
+    return bytes_read;
+}
 
-            bool ok = modules[i_mod]->transform(buff);
-            
-            if (!ok && continue_on_error<0) {
-                if (settings.is_verbose)
-                    settings.ofstream_log_file << modules[i_mod]->get_name() << ": " << modules[i_mod]->get_error() << endl;
-                cerr << "\r" << flush;
-                cerr << modules[i_mod]->get_name() << ": " << modules[i_mod]->get_error() << endl;
-                continue_on_error=-2;
-                while (continue_on_error<-1) {
-                    cerr << "Do you want to continue with the execution? (y=yes/n=no/a=ignore all): " << flush;
-                    string risp;
-                    cin >> risp;
-                    if (risp=="n" || risp=="N") {
-                        buff->is_last=true;
-                        continue_on_error=0;
-                    }
-                    else if (risp=="y" || risp=="Y") {
-                        continue_on_error=-1;
-                    }
-                    else if (risp=="a" || risp=="A") {
-                        continue_on_error=1;
-                    }
-                }
-                if (!continue_on_error) break;
-            }
+/** fill buff with io_uring: the buffer is split in chunks of ibs bytes (or
+    bs/queue-depth if ibs==bs) and up to queue-depth of them are kept in flight.
+    A short read is queued again for the rest of its chunk, only a read of 0
+    bytes means end of input. Only the chunks whose read fails are passed to read_damaged() */
+int64_t read_buffer_uring(fastdd_file_t *fi, buffer_t *buff) {
+    int64_t bs = settings.bs;
+    int64_t ibs = settings.ibs;
+    
+    int64_t chunk = ibs;
+    if (chunk >= bs && bs > 4096) {
+        chunk = ((bs/uring.get_depth() + 4095) / 4096) * 4096;
+        if (chunk > bs) chunk = bs;
+    }
+    
+    int64_t da_leggere = bs;
+    if (fi->byte_to_read >= 0)
+        da_leggere = MIN(da_leggere, fi->byte_to_read - (int64_t) fi->byte_read);
+    
+    int tot_chunks = (da_leggere + chunk - 1) / chunk;
+    vector<int> errors(tot_chunks, 0);
+    vector<int64_t> got(tot_chunks, 0);     // bytes of each chunk already read
+    int64_t end_of_input = da_leggere;      // first byte of the buffer not available
+    
+    int next = 0, done = 0;
+    while (done < tot_chunks) {
+        // the chunks in a hole are made up, not read
+        while (next < tot_chunks && hole_length(fi, fi->current_position+next*chunk) >= MIN(chunk, da_leggere-next*chunk)) {
+            memset(buff->buffer+next*chunk, 0, MIN(chunk, da_leggere-next*chunk));
+            next++;
+            done++;
+        }
+        if (done == tot_chunks) break;
+        
+        while (next < tot_chunks && uring.queue_read(fi->file_descriptor, buff->buffer+next*chunk,
+                MIN(chunk, da_leggere-next*chunk), fi->current_position+next*chunk, next))
+            next++;
+        
+        uint64_t k;
+        int res;
+        if (!uring.wait(&k, &res)) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << program_name << ": error: " << uring.get_error() << endl;
+            cerr << program_name << ": error: " << uring.get_error() << endl;
+            exit(1);
         }
         
-        // -------------------------------- fatto
-        fi->current_position+=tot_read;
-        fi->byte_read+=tot_read;
-        
-        if (settings.is_progress_bar) {
-            pb.add_pos(tot_read);
-            if (fi->current_position - last_update >= 1048576) {
-                cerr << '\r';
-                cerr << pb.get_barra() << flush;
-                last_update = fi->current_position;
-            }
+        int64_t len = MIN(chunk, da_leggere-(int64_t)k*chunk);
+        if (res < 0) {
+            errors[k] = -res;
         }
-
-        for (int j=0; j<tot_output_file; j++) {
-            pthread_cond_signal(&buff->is_not_empty[j]);
+        else if (res == 0) {        // nothing more: end of input
+            end_of_input = MIN(end_of_input, (int64_t)k*chunk+got[k]);
         }
-
-        pthread_mutex_unlock(&buff->buffer_mutex);
-        
-        if (buff->is_last) {
-    //        cerr << "read: ----------------- LAST" << endl;
-            break;
+        else if (got[k]+res < len) {    // short read: ask for the rest of the chunk
+            got[k] += res;
+            uring.queue_read(fi->file_descriptor, buff->buffer+k*chunk+got[k],
+                len-got[k], fi->current_position+k*chunk+got[k], k);
+            continue;
         }
+        done++;
+    }
+    
+    // re-read the damaged chunks, in offset order
+    for (int k=0; k<tot_chunks && (int64_t)k*chunk<end_of_input; k++) {
+        if (!errors[k]) continue;
         
-   //     cerr << "read: " << (fi->b_compl + fi->b_part) << endl;
-        buff = buff->the_other_buffer;
-    } while(true);
+        int64_t len = MIN(chunk, da_leggere-(int64_t)k*chunk);
+        errno = errors[k];
+        int64_t bytes_read = read_damaged(fi, buff, k*chunk, len);
+        if (bytes_read < len)
+            end_of_input = MIN(end_of_input, (int64_t)k*chunk+bytes_read);
+    }
     
-  //  cerr << "read: esco" << endl;
+    int64_t tot_read = end_of_input;
+    fi->b_compl += tot_read / ibs;
+    if (tot_read % ibs)
+        fi->b_part++;
     
-    pthread_exit(NULL);
+    if (tot_read < bs || (fi->byte_to_read >= 0 && (int64_t) fi->byte_read+tot_read >= fi->byte_to_read))
+        buff->is_last = true;
+    
+    return tot_read;
 }
 
-bool secure_next_buffer(buffer_t *buff, int id, bool close_thread) {
-    int ret = 0;
-    pthread_mutex_lock(&buff->buffer_mutex);
-    if (close_thread) {
-        buff->active[id] = false;
-        buff->writer_active--;
-        buff = buff->the_other_buffer;
-
-        while (buff->active[id]) {
-            pthread_mutex_lock(&buff->buffer_mutex);
-            buff->active[id]=false;
-            buff->writer_active--;
-            pthread_mutex_unlock(&buff->buffer_mutex);
-            buff = buff->the_other_buffer;
+/** engine=mmap: buff becomes a view of the mapped input, or the mapped data is
+    copied in it when a module changes the data, the view does not start at a
+    page or its pages can not be locked in memory. Returns -1 if the pages can
+    not be read (SIGBUS) or mapped: the buffer is then read as usual, with the
+    bad blocks recovery */
+int64_t read_buffer_mmap(fastdd_file_t *fi, buffer_t *buff, reader_state_t *rs) {
+    int64_t bs = settings.bs;
+    int64_t ibs = settings.ibs;
+    
+    buff->buffer = buff->own_buffer;
+    
+    // the buffers before the one we are filling have been written
+    if (rs->seq+1 >= (uint64_t) tot_buffers)
+        mapped.retire(rs->seq+1-tot_buffers);
+    
+    int64_t da_leggere = MIN(bs, fi->total_size_in_byte - (int64_t) fi->current_position);
+    if (fi->byte_to_read >= 0)
+        da_leggere = MIN(da_leggere, fi->byte_to_read - (int64_t) fi->byte_read);
+    
+    int64_t tot_read = MAX(da_leggere, 0);
+    if (tot_read) {
+        // the buffer is the view only while its pages are locked in memory:
+        // the other threads can not fault them again (and get SIGBUS)
+        unsigned char *view = mapped.view(fi->current_position, tot_read, rs->seq);
+        bool pinned = false;
+        if (view && mmap_views) {
+            pinned = mapped.pin(view, tot_read, rs->seq);
+            if (!pinned && !mmap_copies++ && settings.is_verbose)
+                settings.ofstream_log_file << "engine=mmap: " << mapped.get_error() << " at " <<
+                    num2str(fi->current_position, 16, 16, '0') << ", copying the views that can not be locked" << endl;
+        }
+        if (pinned)
+            buff->buffer = view;
+        else if (!view || !mapped.copy(buff->buffer, view, tot_read)) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "engine=mmap: " << mapped.get_error() << " at " <<
+                    num2str(fi->current_position, 16, 16, '0') << ", reading the buffer" << endl;
+            return -1;
         }
     }
     
-    buff->already_write[id] = true;
+    fi->b_compl += tot_read / ibs;
+    if (tot_read % ibs)
+        fi->b_part++;
     
-    // attenzione, qui non prendo il lock dell'altro buffer
+    if (tot_read < bs || (fi->byte_to_read >= 0 && (int64_t) fi->byte_read+tot_read >= fi->byte_to_read))
+        buff->is_last = true;
+    
+    return tot_read;
+}
+
+/** fan-out mode: copy buff in the spill file of output j, as if j had written
+    it. Called with buff->buffer_mutex locked, false if max-lag would be exceeded
+    or on error */
+bool spill_to(buffer_t *buff, int j) {
+    fastdd_file_t *fo = &fo_common[j];
+    
+    pthread_mutex_lock(&fo->spill_mutex);
+    if (fo->spill_fd < 0 || (settings.max_lag >= 0 && fo->spill_bytes+(int64_t)buff->length > settings.max_lag)) {
+        pthread_mutex_unlock(&fo->spill_mutex);
+        return false;
+    }
+    if (!fo->spill_head)
+        fo->spill_end = 0;      // the writer has drained the file, start again
+    pthread_mutex_unlock(&fo->spill_mutex);
+    
+    int64_t written = 0, temp = 0;
+    while (written < (int64_t)buff->length) {
+        temp = pwrite(fo->spill_fd, buff->buffer+written, buff->length-written, fo->spill_end+written);
+        if (temp <= 0) break;
+        written += temp;
+    }
+    if (written < (int64_t)buff->length) {
+        if (settings.is_verbose)
+            settings.ofstream_log_file << program_name << ": error: writing spill file of " << fo->file_name
+                << " (" << strerror(errno) << ")" << endl;
+        return false;
+    }
+    
+    spill_t *rec = (spill_t *) malloc(sizeof(spill_t));
+    rec->seq = buff->seq;
+    rec->offset = fo->spill_end;
+    rec->length = buff->length;
+    rec->is_last = buff->is_last;
+    rec->next = NULL;
+    rec->hash = (unsigned char **) malloc(MAX(buff->tot_digests, 1) * sizeof(unsigned char *));
+    rec->hash_len = (unsigned int *) malloc(MAX(buff->tot_digests, 1) * sizeof(unsigned int));
+    for (int i1=0; i1<buff->tot_digests; i1++) {
+        rec->hash[i1] = (unsigned char *) malloc(EVP_MAX_MD_SIZE * sizeof(unsigned char));
+        memcpy(rec->hash[i1], buff->hash[i1], EVP_MAX_MD_SIZE);
+        rec->hash_len[i1] = buff->hash_len[i1];
+    }
+    
+    pthread_mutex_lock(&fo->spill_mutex);
+    if (fo->spill_tail)
+        fo->spill_tail->next = rec;
+    else
+        fo->spill_head = rec;
+    fo->spill_tail = rec;
+    fo->spill_end += buff->length;
+    fo->spill_bytes += buff->length;
+    fo->spill_max = MAX(fo->spill_max, fo->spill_bytes);
+    pthread_mutex_unlock(&fo->spill_mutex);
+    
+    buff->already_write[j] = true;
+    
+    return true;
+}
+
+/** empty buff if every active output has written it (buff locked) */
+bool release_if_done(buffer_t *buff) {
+    for (int j=0; j<tot_output_file; j++)
+        if (buff->active[j] && !buff->already_write[j]) return false;
+    
+    buff->length = 0;
+    buff->is_empty = true;
+    buff->is_full = false;
+    for (int j=0; j<tot_output_file; j++)
+        buff->already_write[j] = false;
+    
+    return true;
+}
+
+/** output j is busy writing buff (the oldest buffer of the ring): spill the
+    buffers after it, so that when it is done the ring is free of it */
+void spill_ahead(buffer_t *buff, int j) {
+    for (buffer_t *b = buff->next_buffer; b != buff; b = b->next_buffer) {
+        if (pthread_mutex_trylock(&b->buffer_mutex))
+            break;
+        
+        bool ok = b->is_full && !b->is_empty && b->seq > buff->seq && b->active[j];
+        if (ok && !b->already_write[j])
+            ok = spill_to(b, j);
+        if (ok)
+            release_if_done(b);
+        
+        pthread_mutex_unlock(&b->buffer_mutex);
+        if (!ok) break;
+    }
+}
+
+/** fan-out mode: move buff into the spill file of every output that has not
+    written it yet, so the reader can recycle it without waiting for the slowest
+    output. Called by the reader with buff->buffer_mutex locked, it returns true
+    if the buffer is free. Nothing is spilled if no output has written buff yet
+    (there is no faster output to unblock) or if max-lag would be exceeded */
+bool spill_buffer(buffer_t *buff) {
+    bool someone_done = false;
+    for (int j=0; j<tot_output_file; j++)
+        if (buff->active[j] && buff->already_write[j]) someone_done = true;
+    if (!someone_done)
+        return false;
+    
+    for (int j=0; j<tot_output_file; j++) {
+        if (!buff->active[j] || buff->already_write[j]) continue;
+        
+        if (fo_common[j].ring_seq == (int64_t) buff->seq)     // it is writing it right now
+            spill_ahead(buff, j);
+        else
+            spill_to(buff, j);
+    }
+    
+    return release_if_done(buff);
+}
+
+/** true if the next buffer of fo is waiting in its spill file */
+bool is_spilled(fastdd_file_t *fo) {
+    if (fo->spill_fd < 0)
+        return false;
+    
+    pthread_mutex_lock(&fo->spill_mutex);
+    bool ris = (fo->spill_head && fo->spill_head->seq == fo->next_seq);
+    pthread_mutex_unlock(&fo->spill_mutex);
+    
+    return ris;
+}
+
+/** load the first spilled buffer of fo in view, false on error */
+bool load_spilled(fastdd_file_t *fo, buffer_t *view) {
+    pthread_mutex_lock(&fo->spill_mutex);
+    spill_t *rec = fo->spill_head;
+    pthread_mutex_unlock(&fo->spill_mutex);
+    
+    // the modules can make buffers bigger than bs
+    if (rec->length > fo->spill_capacity) {
+        free(fo->spill_buffer);
+        if (posix_memalign( (void **) &(fo->spill_buffer), 512, rec->length)) {
+            cerr << program_name << ": error: allocating spill buffer for " << fo->file_name << endl;
+            exit(1);
+        }
+        fo->spill_capacity = rec->length;
+    }
+    
+    int64_t letti = 0, temp = 0;
+    while (letti < (int64_t)rec->length) {
+        temp = pread(fo->spill_fd, fo->spill_buffer+letti, rec->length-letti, rec->offset+letti);
+        if (temp <= 0) break;
+        letti += temp;
+    }
+    if (letti < (int64_t)rec->length)
+        return false;
+    
+    view->buffer = fo->spill_buffer;
+    view->length = rec->length;
+    view->seq = rec->seq;
+    view->is_last = rec->is_last;
+    view->tot_digests = buffer[0].tot_digests;
+    view->digest_type = buffer[0].digest_type;
+    view->hash = rec->hash;
+    view->hash_len = rec->hash_len;
+    
+    return true;
+}
+
+/** the first spilled buffer of fo has been written, forget it */
+void pop_spilled(fastdd_file_t *fo) {
+    pthread_mutex_lock(&fo->spill_mutex);
+    spill_t *rec = fo->spill_head;
+    fo->spill_head = rec->next;
+    if (!fo->spill_head)
+        fo->spill_tail = NULL;
+    fo->spill_bytes -= rec->length;
+    pthread_mutex_unlock(&fo->spill_mutex);
+    
+    for (int i1=0; i1<buffer[0].tot_digests; i1++)
+        free(rec->hash[i1]);
+    free(rec->hash);
+    free(rec->hash_len);
+    free(rec);
+}
+
+/** record when the writer of fo stopped, for the final statistics */
+void writer_done(fastdd_file_t *fo) {
+    struct timeval t_2;
+    gettimeofday(&t_2, NULL);
+    fo->t_end = t_2.tv_sec*1000000+t_2.tv_usec;
+}
+
+/** set up what the reader keeps from one buffer to the next */
+void init_reader(fastdd_file_t *fi, reader_state_t *rs) {
+    pb = progress_bar(fi->skip_in_byte,
+        ( (fi->byte_to_read > 0) ? (fi->skip_in_byte+fi->byte_to_read) : fi->total_size_in_byte ) );
+    pm = partition_manager(fi->file_name);
+    
+    rs->last_update = -100000000;
+    rs->next_needed = 0;
+    rs->current_blocks = 0;
+    rs->seq = 0;
+    rs->continue_on_error = -1;     // -1=not set, 0=no, 1=yes
+    if (settings.ignore_module_error) rs->continue_on_error=1;
+}
+
+/** module API v2: the module writes the data of buff in a buffer of the pool,
+    that takes the place of the one of buff (given back to the pool) */
+bool transform_out_of_place(fastdd_module *module, buffer_t *buff) {
+    uint64_t capacity;
+    unsigned char *out = buffer_pool.get(module->get_max_output(buff), &capacity);
+    if (!out) {
+        cerr << program_name << ": error: allocating an output buffer for " << module->get_name() << endl;
+        exit(1);
+    }
+    
+    uint64_t length = 0;
+    if (!module->transform_to(buff, out, capacity, &length)) {
+        buffer_pool.put(out, capacity);
+        return false;
+    }
+    
+    buffer_pool.put(buff->own_buffer, buff->capacity);
+    buff->buffer = buff->own_buffer = out;
+    buff->capacity = capacity;
+    buff->length = length;
+    return true;
+}
+
+/** transform buff with module (if active); on error ask whether to go on,
+    unless *continue_on_error already says it. False if the copy must stop */
+bool run_module(fastdd_module *module, buffer_t *buff, int *continue_on_error) {
+    if (!module->is_active()) return true;
+    
+    bool ok;
+    if (module->get_api_version() >= 2)
+        ok = transform_out_of_place(module, buff);
+    else
+        ok = module->transform(buff);
+    if (ok) return true;
+    
+    pthread_mutex_lock(&module_error_mutex);
+    if (*continue_on_error<0) {
+        if (settings.is_verbose)
+            settings.ofstream_log_file << module->get_name() << ": " << module->get_error() << endl;
+        cerr << "\r" << flush;
+        cerr << module->get_name() << ": " << module->get_error() << endl;
+        *continue_on_error=-2;
+        while (*continue_on_error<-1) {
+            cerr << "Do you want to continue with the execution? (y=yes/n=no/a=ignore all): " << flush;
+            string risp;
+            cin >> risp;
+            if (risp=="n" || risp=="N") {
+                *continue_on_error=0;
+            }
+            else if (risp=="y" || risp=="Y") {
+                *continue_on_error=-1;
+            }
+            else if (risp=="a" || risp=="A") {
+                *continue_on_error=1;
+            }
+        }
+    }
+    bool ris = (*continue_on_error != 0);
+    pthread_mutex_unlock(&module_error_mutex);
+    
+    return ris;
+}
+
+/** module stage: step 'step' runs its module on buff */
+bool stage_step(buffer_t *buff, int step) {
+    return run_module(stage_modules[step], buff, &stage_continue_on_error);
+}
+
+/** module stage: buff has been through all the modules, it goes to the writers */
+void stage_publish(buffer_t *buff) {
+    if (ring.is_ready()) {
+        ring.publish(buff->seq);
+        return;
+    }
+    
+    pthread_mutex_lock(&buff->buffer_mutex);
+    buff->is_empty = false;
+    for (int j=0; j<tot_output_file; j++) {
+        pthread_cond_signal(&buff->is_not_empty[j]);
+    }
+    pthread_mutex_unlock(&buff->buffer_mutex);
+}
+
+/** run the active modules on their own threads, between the reader and the
+    writers: the ones without a state (is_stateless) on more buffers at the
+    same time, the others on a buffer at time, in order. The modules that only
+    read the data, after the last one that changes it, run next to the writers */
+void init_stage() {
+    vector<bool> ordered;
+    int side = 0;
+    for (int i=0; i<modules.size(); i++) {
+        if (!modules[i]->is_active()) continue;
+        stage_modules.push_back(modules[i]);
+        ordered.push_back(!modules[i]->is_stateless());
+        side = (modules[i]->is_inspect_only()) ? side+1 : 0;
+    }
+    if (!stage_modules.size())
+        return;
+    
+    stage_continue_on_error = (settings.ignore_module_error) ? 1 : -1;
+    int threads = settings.module_threads;
+    if (!threads)
+        threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+    if (!stage.init(ordered, side, threads, stage_step, stage_publish)) {
+        stage_modules.clear();
+        if (settings.is_verbose)
+            settings.ofstream_log_file << "unable to start the module stage, modules run by the reader" << endl;
+        return;
+    }
+    
+    if (settings.is_verbose)
+        settings.ofstream_log_file << "module stage: " << stage_modules.size() << " modules (" << side
+            << " next to the writers) on " << threads << " threads" << endl;
+}
+
+/** true if an active module changes the data of the buffers */
+bool modules_change_data() {
+    for (int i=0; i<modules.size(); i++)
+        if (modules[i]->is_active() && !modules[i]->is_inspect_only())
+            return true;
+    
+    return false;
+}
+
+/** read the next bs bytes of the input in buff, recovering damaged blocks;
+    it sets buff->is_last at the end of the input */
+void fill_buffer(fastdd_file_t *fi, buffer_t *buff, reader_state_t *rs) {
+    int64_t bs= settings.bs;
+    int64_t ibs= settings.ibs;
+    int64_t count= settings.count;
+    
+    int64_t tot_read = 0;
+    int64_t bytes_read, temp=1;
+    
+    //memset((void *) buff->buffer, 0, bs);
+    
+    rs->current_blocks = fi->b_part+fi->b_compl;
+    
+    // the digests may still be reading what was in this buffer
+    if (fi->hash_pool && rs->seq >= (uint64_t) tot_buffers)
+        fi->hash_pool->wait(rs->seq - tot_buffers);
+    if (block_hasher && rs->seq >= (uint64_t) tot_buffers)
+        block_hasher->wait(rs->seq - tot_buffers);
+    if (tree_hasher && rs->seq >= (uint64_t) tot_buffers)
+        tree_hasher->wait(rs->seq - tot_buffers);
+    if (stage.is_ready() && rs->seq >= (uint64_t) tot_buffers)     // the same for the modules next to the writers
+        stage.wait(rs->seq - tot_buffers);
+    
+    bool done = false;
+    if (settings.engine == ENGINE_URING) {
+        tot_read = read_buffer_uring(fi, buff);
+        done = true;
+    }
+    else if (settings.engine == ENGINE_MMAP) {
+        tot_read = read_buffer_mmap(fi, buff, rs);
+        done = (tot_read >= 0);
+        if (!done) {
+            tot_read = 0;
+            lseek(fi->file_descriptor, fi->current_position, SEEK_SET);     // the mapping does not move it
+        }
+    }
+    
+    if (!done) for (int j=0; (count<0 || (count>=0 && fi->b_compl+fi->b_part<count)) && j<bs; j+=bytes_read) {
+        int64_t da_leggere = MIN(ibs,bs-tot_read);
+        if (hole_length(fi, fi->current_position+j) >= da_leggere) {  // a hole: nothing to read
+            memset(buff->buffer+j, 0, da_leggere);
+            temp = bytes_read = (lseek(fi->file_descriptor, da_leggere, SEEK_CUR) < 0) ? -1 : da_leggere;
+        }
+        else {
+   //         gettimeofday(&t_1, NULL);
+    //        t2 = t_1.tv_sec*1000000+t_1.tv_usec;
+            temp = bytes_read = read(fi->file_descriptor, buff->buffer+j, da_leggere);
+    //        gettimeofday(&t_1, NULL);
+    //        t3 = t_1.tv_sec*1000000+t_1.tv_usec;
+    //        couttime << "read "<< (t2-t1) << " " << (t3-t2) << " " << endl;
+    //        t1 = t3;
+            while (temp>0 && bytes_read<da_leggere) {
+                temp = read(fi->file_descriptor, buff->buffer+j+bytes_read, da_leggere-bytes_read);
+                if (temp==0) {
+                    buff->is_last = true;
+                    break;
+                }
+                bytes_read += temp;
+            }
+        }
+        
+        if (temp==-1) {
+            temp=0;
+            bytes_read = read_damaged(fi, buff, j, da_leggere);
+            
+            if (bytes_read) {
+                if (!buff->is_last) 
+                    temp=1;
+            }
+            else buff->is_last = true;
+        }
+            
+        if (bytes_read==ibs)
+            fi->b_compl++;
+        else if (bytes_read)
+            fi->b_part++;
+            
+        tot_read+=bytes_read;
+        
+        if ((count>0 && fi->b_compl+fi->b_part >= count) || !bytes_read) {
+            buff->is_last = true;
+        }
+        
+        if (buff->is_last)
+            break;
+    }
+    
+    buff->length = tot_read;
+    buff->seq = rs->seq++;
+    buff->position = fi->current_position;
+    buff->is_full = true;
+    //cerr << "read: letti " << buff->length << endl;
+}
+
+/** everything the reader does on a buffer just filled: digests, partition
+    table, modules and progress bar */
+void process_buffer(fastdd_file_t *fi, buffer_t *buff, reader_state_t *rs) {
+    int64_t ibs= settings.ibs;
+    int64_t tot_read = buff->length;
+    int64_t current_blocks = rs->current_blocks;
+    
+    ///////////////////////////////////////// MD
+    if (block_hasher)                           // the same, on the block hash threads
+        block_hasher->submit(buff, current_blocks, fi->current_position, settings.is_md_blocks_save, settings.is_md_blocks_check);
+    else if (settings.is_md_blocks_save) {           // calcolo e scrivo su file i digest dei blocchi
+        fastdd_md_ctx_t mdctx;
+        unsigned char md_value[EVP_MAX_MD_SIZE];
+        unsigned int md_len;
+        
+        // the whole blocks go on the SIMD lanes, if it pays
+        int64_t full = tot_read / ibs;
+        vector< vector<unsigned char> > multi(buff->tot_digests);
+        for (int i1=0; i1<buff->tot_digests; i1++) {
+            if (!fastdd_multihash::is_worth(buff->digest_type[i1], full))
+                continue;
+            multi[i1].resize(full * fastdd_digest::md_size(buff->digest_type[i1]));
+            fastdd_multihash::digest(buff->digest_type[i1], buff->buffer, ibs, full, &multi[i1][0]);
+        }
+        
+        for (int i=0; i<tot_read; i+=ibs) {
+            for (int i1=0; i1<buff->tot_digests; i1++) {
+                if (multi[i1].size() && i/ibs < full) {
+                    md_len = fastdd_digest::md_size(buff->digest_type[i1]);
+                    memcpy(md_value, &multi[i1][i/ibs * md_len], md_len);
+                }
+                else {
+                    fastdd_digest::ctx_init(&mdctx);
+                    fastdd_digest::digest_init(&mdctx, buff->digest_type[i1]);
+                    fastdd_digest::digest_update(&mdctx, buff->buffer+i, MIN(ibs,tot_read-i));
+                    fastdd_digest::digest_final(&mdctx, md_value, &md_len);
+                }
+                stringstream ss;
+                for (int i2=0; i2<md_len; i2++) {
+                    ss << setfill('0') << setw(2) << setbase(16) << (unsigned int) md_value[i2];
+                }
+
+                settings.ofstream_md << "block " << num2str(current_blocks+i/ibs,10,8,' ')<<": "
+                    <<num2str(fi->current_position,16,16,'0')<<"-"<<num2str(fi->current_position+MIN(ibs,tot_read-i),16,16,'0')<<": "
+                    << settings.md_blocks[i1] << " - " << ss.str() << endl;
+            }
+        }
+    }
+
+    // digest complessivo del file
+    if (fi->hash_pool && settings.is_md_file_in) {
+        fi->hash_pool->update(buff->buffer, tot_read, buff->seq);
+        if (modules_change_data())          // the digests must see the data as it was read
+            fi->hash_pool->wait(buff->seq);
+    }
+    else for (int i1=0; i1<fi->tot_digests; i1++) {
+        if (settings.is_md_file_in) {
+            fastdd_digest::digest_update(&(fi->ctx[i1]), buff->buffer, tot_read);
+        }
+    }
+    
+    // leaves of the hash tree
+    if (tree_hasher) {
+        tree_hasher->submit(buff->buffer, tot_read, buff->seq, buff->is_last);
+        if (!settings.is_parallel || modules_change_data())    // one buffer only, or data about to change
+            tree_hasher->wait(buff->seq);
+    }
+    
+    // digest per il confronto
+    for (int i1=0; i1<buff->tot_digests && !block_hasher; i1++) {
+        if (settings.is_md_blocks_check) {
+            fastdd_digest::ctx_init(&buff->ctx[i1]);
+            fastdd_digest::digest_init(&buff->ctx[i1], buff->digest_type[i1]);
+            fastdd_digest::digest_update(&buff->ctx[i1], buff->buffer, tot_read);
+            fastdd_digest::digest_final(&buff->ctx[i1], buff->hash[i1], &buff->hash_len[i1]);
+        }
+    }
+    
+    // the writers need the check digests, and the modules may change the data
+    if (block_hasher && (settings.is_md_blocks_check || modules_change_data()))
+        block_hasher->wait(buff->seq);
+    
+    //////////////////////////////// partition table
+    if (settings.is_get_partition) {
+        if (current_blocks==0)
+            rs->next_needed = pm.update(buff->buffer, 0);
+        else if (fi->current_position <= rs->next_needed && rs->next_needed < fi->current_position + buff->length)  {
+           // cout << fi->current_position << " " << rs->next_needed << " " << fi->current_position + buff->length;
+            rs->next_needed = pm.update(buff->buffer+(rs->next_needed - fi->current_position), rs->next_needed);
+        }
+        if (pm.is_error()) settings.is_get_partition=false;
+    }
+    
+    // -------------------------------- use modules (here if there is no module stage)
+    for (int i_mod=0; i_mod<modules.size() && !stage.is_ready(); i_mod++) {
+        if (!run_module(modules[i_mod], buff, &rs->continue_on_error)) {
+            buff->is_last=true;
+            break;
+        }
+    }
+    
+    // -------------------------------- fatto
+    fi->current_position+=tot_read;
+    fi->byte_read+=tot_read;
+    
+    if (settings.is_progress_bar) {
+        pb.add_pos(tot_read);
+        if (fi->current_position - rs->last_update >= 1048576) {
+            cerr << '\r';
+            cerr << pb.get_barra() << flush;
+            rs->last_update = fi->current_position;
+        }
+    }
+}
+
+void *thread_read(void *arg) {
+    fastdd_file_t *fi = (fastdd_file_t *) arg;
+    
+    buffer_t *buff = buffer;
+    
+    reader_state_t rs;
+    init_reader(fi, &rs);
+    
+    do {
+   //     cerr << "read: blocco buffer" << endl;
+        if (ring.is_ready()) {
+            if (!ring.wait_free(rs.seq))    // every writer has gone
+                break;
+        }
+        else {
+            pthread_mutex_lock(&buff->buffer_mutex);
+            while (buff->is_full && !buff->is_last) {
+                if (settings.spill_dir.length() && spill_buffer(buff))
+                    break;
+ //               cerr << "read: aspetto sia vuoto" << endl;
+                pthread_cond_wait (&buff->is_not_full, &buff->buffer_mutex);
+            }
+            
+            if (buff->is_last) {
+                pthread_mutex_unlock(&buff->buffer_mutex);
+                break;
+            }
+        }
+      //  cerr << "read: dentro" << endl;
+
+        // a module has stopped the copy: an empty buffer ends it, if the
+        // writers still need one
+        if (stage.is_ready() && stage.is_stopping()) {
+            if (rs.seq >= (uint64_t) tot_buffers)
+                stage.wait(rs.seq - tot_buffers);
+            buff->length = 0;
+            buff->seq = rs.seq++;
+            buff->is_last = true;
+            buff->is_full = true;
+            if (!ring.is_ready())
+                pthread_mutex_unlock(&buff->buffer_mutex);
+            stage.submit(buff);
+            break;
+        }
+
+        fill_buffer(fi, buff, &rs);
+        process_buffer(fi, buff, &rs);
+        bool is_last = buff->is_last;
+        
+        if (stage.is_ready()) {             // the writers get it from the modules
+            if (!ring.is_ready())
+                pthread_mutex_unlock(&buff->buffer_mutex);
+            stage.submit(buff);
+        }
+        else if (ring.is_ready())
+            ring.publish(buff->seq);
+        else {
+            buff->is_empty = false;
+            for (int j=0; j<tot_output_file; j++) {
+                pthread_cond_signal(&buff->is_not_empty[j]);
+            }
+
+            pthread_mutex_unlock(&buff->buffer_mutex);
+        }
+        
+        if (is_last) {
+    //        cerr << "read: ----------------- LAST" << endl;
+            break;
+        }
+        
+   //     cerr << "read: " << (fi->b_compl + fi->b_part) << endl;
+        buff = buff->next_buffer;
+    } while(true);
+    
+  //  cerr << "read: esco" << endl;
+    
+    pthread_exit(NULL);
+}
+
+bool secure_next_buffer(buffer_t *buff, int id, bool close_thread) {
+    int ret = 0;
+    if (ring.is_ready()) {
+        if (close_thread)
+            ring.leave(id);
+        else
+            ring.release(id, buff->seq);
+        return buff->is_last;
+    }
+    
+    pthread_mutex_lock(&buff->buffer_mutex);
+    if (close_thread) {
+        buff->active[id] = false;
+        buff->writer_active--;
+        buff = buff->next_buffer;
+
+        while (buff->active[id]) {
+            pthread_mutex_lock(&buff->buffer_mutex);
+            buff->active[id]=false;
+            buff->writer_active--;
+            pthread_mutex_unlock(&buff->buffer_mutex);
+            buff = buff->next_buffer;
+        }
+    }
+    
+    buff->already_write[id] = true;
+    
+    // attenzione, qui non prendo il lock dell'altro buffer
 
     bool esci = true;           // hanno tutti terminato?
     bool buffer_ok = true;      // se tutti quelli attivi l'hanno già scritto
@@ -1316,6 +2314,8 @@ bool secure_next_buffer(buffer_t *buff, int id, bool close_thread) {
             buff->already_write[j] = false;
         pthread_cond_signal(&buff->is_not_full);
     }
+    else if (settings.spill_dir.length())
+        pthread_cond_signal(&buff->is_not_full);    // the reader can spill it now
     // else non è l'ultimo, non deve vuotare il buffer
     
     pthread_mutex_unlock(&buff->buffer_mutex);
@@ -1323,524 +2323,922 @@ bool secure_next_buffer(buffer_t *buff, int id, bool close_thread) {
     return buff->is_last;
 }
 
+/** write data on fo and, if requested, read it back to check it. False on
+    error: the output can not go on */
+bool write_buffer(fastdd_file_t *fo, buffer_t *data, unsigned char *local_buffer) {
+    int64_t obs= settings.obs;
+    
+    // --------------------------- riapri file senza o_direct se serve
+    if (fo->is_direct_o && (data->length&511)) {
+        int oldflags = fcntl (fo->file_descriptor, F_GETFL, 0);
+
+        if (oldflags == -1) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << program_name << ": error: while changing O_DIRECT flag in output file '"<<
+                    fo->file_name << "'" << endl;
+            return false;
+        }
+        
+        
+        oldflags &= ~O_DIRECT;
+
+        oldflags = fcntl(fo->file_descriptor, F_SETFL, oldflags);
+        if (oldflags == -1) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << program_name << ": error: while changing O_DIRECT flag in output file '"<<
+                    fo->file_name << "'" << endl;
+            return false;
+        }
+        
+        fo->is_direct_o = 0;
+    //    cerr << fo->file_name << " -------------- riaperto" << endl;
+    }
+    
+    // ----------------------------- scrivo
+    int64_t bytes_written = 0, temp;
+    int64_t start = (fo->is_sparse) ? lseek(fo->file_descriptor, 0, SEEK_CUR) : 0;
+    bool hole = false;          // the last block has been skipped
+    for (int64_t j=0; j<data->length; j+=MIN(obs, data->length-j)) {
+      //  gettimeofday(&t_1, NULL);
+     //   t2 = t_1.tv_sec*1000000+t_1.tv_usec;
+        int64_t n = MIN(obs, data->length-j);
+        hole = fo->is_sparse && start+j >= fo->total_size_in_byte && is_zero_block(data->buffer+j, n);
+        if (hole) {             // leave a hole instead of writing zeros
+            temp = (lseek(fo->file_descriptor, n, SEEK_CUR) < 0) ? -1 : n;
+            fo->byte_elided += n;
+        }
+        else
+            temp = write(fo->file_descriptor, data->buffer+j, n);
+      //  gettimeofday(&t_1, NULL);
+      //  t3 = t_1.tv_sec*1000000+t_1.tv_usec;
+     //   couttime << "write "<< (t2-t1) << " " << (t3-t2) << endl;
+     //   t1=t3;
+        
+        if (temp==-1)
+            exit(1);
+            
+        if (temp==obs) {
+         //   printf("%ld %ld %ld C\n",j,data->length, temp);
+            fo->b_compl++;
+        }
+        else if (temp) {
+         //   printf("%ld %ld %ld P\n",j,data->length, temp);
+            fo->b_part++;
+        }
+        bytes_written += temp;
+    }
+//    cerr << fo->file_name << " scritti " << bytes_written << endl;
+    
+    // a hole at the end does not make the file longer, set its size
+    if (hole && ftruncate(fo->file_descriptor, start+bytes_written)) {
+        if (settings.is_verbose)
+            settings.ofstream_log_file << program_name << ": error: setting size of '" << fo->file_name << "' (" << strerror(errno) << ")" << endl;
+        cerr << program_name << ": error: setting size of '" << fo->file_name << "' (" << strerror(errno) << ")" << endl;
+        return false;
+    }
+    
+    // -------------------------------- rileggo (here only without a verify thread)
+    if ((settings.is_md_blocks_check || settings.is_md_files_out) && local_buffer) {
+        int64_t pos = lseek(fo->file_descriptor, -bytes_written, SEEK_CUR);	// torno a monte del buffer appena scritto
+        int64_t current_read=0;
+        memset((void *) local_buffer, 0, data->length);
+        
+        for (int t=0; t<data->length; t+=MIN(obs, data->length-t)) {
+//            cerr << ">>" << MIN(obs, data->length-t) << endl;
+            int64_t t2 = read(fo->file_descriptor, local_buffer+t, MIN(obs, data->length-t));
+//            cerr << "riletti: " << data->length << " " << t2 << endl;
+            if (t2==-1) {                   // ho trovato un blocco danneggiato, lo salto
+                if (settings.is_verbose)
+                    settings.ofstream_log_file << program_name << ": error: re-reading block "<<num2str(pos,16,16,'0')<<"-"
+                        <<num2str(pos+MIN(obs, data->length-t),16,16,'0')<<" ("<< strerror(errno) << ")\n";
+                fo->verify_failed = true;
+                return false;
+            }
+            else {
+                current_read += t2;
+            }
+            pos+=t2;
+        }
+
+        if (current_read != data->length) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << program_name << ": error: unable to load data just written in '"<< fo->file_name <<"' (read only " << current_read << " bytes)\n";
+            cerr << program_name << ": error: unable to load data just written in '"<< fo->file_name <<"' (read only " << current_read << " bytes)\n";
+            
+            fo->verify_failed = true;
+            return false;
+        }
+        
+        // a questo punto ho riletto senza errori (quindi il supporto non è fisicamente danneggiato)
+        // ma se l'md5 diverge esco subito
+        ///////////////////////////////////////// MD
+        if (settings.is_md_files_out) {
+            for (int i1=0; i1<fo->tot_digests; i1++) {
+                fastdd_digest::digest_update(&(fo->ctx[i1]), local_buffer, current_read);
+            }
+        }
+    
+        if (settings.is_md_blocks_check) {           // calcolo e scrivo su file i digest dei blocchi
+            fastdd_md_ctx_t mdctx;
+            unsigned char md_value[EVP_MAX_MD_SIZE];
+            unsigned int md_len;
+
+            for (int i1=0; i1<data->tot_digests; i1++) {
+                fastdd_digest::ctx_init(&mdctx);
+                fastdd_digest::digest_init(&mdctx, data->digest_type[i1]);
+                fastdd_digest::digest_update(&mdctx, local_buffer, current_read);
+                fastdd_digest::digest_final(&mdctx, md_value, &md_len);
+                
+                bool uguali = true;
+                for (int i2=0; i2<md_len; i2++) {
+                    if (md_value[i2] != data->hash[i1][i2])
+                        uguali = false;
+                }
+                
+                if (!uguali) {
+                    if (settings.is_verbose) {
+                        settings.ofstream_log_file << program_name << ": error: " << settings.md_blocks[i1] << " block check failed"<<endl;
+                        
+                        stringstream ss2;
+                        for (int i2=0; i2<md_len; i2++) {
+                            ss2 << setw(2) << setfill('0') << setbase(16) << (unsigned int) data->hash[i1][i2];
+                        }
+                        
+                        settings.ofstream_log_file << ss2.str() << " - " << num2str(fi_common->current_position-data->length,16,16,'0')<<"-"<<
+                            num2str(fi_common->current_position,16,16,'0')<<" - " << fi_common->file_name << endl;
+                        
+                        stringstream ss;
+                        for (int i2=0; i2<md_len; i2++) {
+                            ss << setw(2) << setfill('0') << setbase(16) << (unsigned int) md_value[i2];
+                        }
+                        
+                        settings.ofstream_log_file << ss.str() << " - " << settings.md_blocks[i1] << " - " << num2str(pos-data->length,16,16,'0')<<"-"<<
+                            num2str(pos,16,16,'0')<<" - "<< fo->file_name << endl;
+                    }
+                    
+                    fo->verify_failed = true;
+                    return false;
+                }
+            }
+        }
+    }
+ //   cerr << "write: " << (fo->b_compl+fo->b_part) << endl;
+    // ------------------------------ fatto
+    
+    fo->byte_written += bytes_written;
+    
+    return true;
+}
+
+/** re-read a written range of fo with the verify fd, update the output file
+    digests and compare the block digests with the input ones */
+bool check_range(fastdd_file_t *fo, verify_range_t *r, unsigned char *local_buffer) {
+    int64_t current_read = 0, t = 0;
+    while (current_read < r->length) {
+        // O_DIRECT reads whole sectors: past the end of the file they are just short
+        int64_t n = ((r->length-current_read+511)/512)*512;
+        t = pread(fo->verify_fd, local_buffer+current_read, n, r->offset+current_read);
+        if (t == -1 && errno == EINVAL) {       // range not aligned: without O_DIRECT
+            fcntl(fo->verify_fd, F_SETFL, fcntl(fo->verify_fd, F_GETFL, 0) & ~O_DIRECT);
+            t = pread(fo->verify_fd, local_buffer+current_read, r->length-current_read, r->offset+current_read);
+        }
+        if (t <= 0) break;
+        current_read += t;
+    }
+    current_read = MIN(current_read, r->length);
+    
+    if (t == -1) {
+        if (settings.is_verbose)
+            settings.ofstream_log_file << program_name << ": error: re-reading block "<<num2str(r->offset+current_read,16,16,'0')<<"-"
+                <<num2str(r->offset+r->length,16,16,'0')<<" of '" << fo->file_name << "' ("<< strerror(errno) << ")\n";
+        cerr << program_name << ": error: re-reading block "<<num2str(r->offset+current_read,16,16,'0')<<"-"
+                <<num2str(r->offset+r->length,16,16,'0')<<" of '" << fo->file_name << "' ("<< strerror(errno) << ")\n";
+        return false;
+    }
+    if (current_read != r->length) {
+        if (settings.is_verbose)
+            settings.ofstream_log_file << program_name << ": error: unable to load data just written in '"<< fo->file_name <<"' (read only " << current_read << " bytes)\n";
+        cerr << program_name << ": error: unable to load data just written in '"<< fo->file_name <<"' (read only " << current_read << " bytes)\n";
+        return false;
+    }
+    
+    if (fo->hash_pool)              // it is waited for at the end
+        fo->hash_pool->update(local_buffer, current_read, r->seq);
+    else if (settings.is_md_files_out) {
+        for (int i1=0; i1<fo->tot_digests; i1++)
+            fastdd_digest::digest_update(&(fo->ctx[i1]), local_buffer, current_read);
+    }
+    
+    bool ok = true;
+    if (settings.is_md_blocks_check) {
+        fastdd_md_ctx_t mdctx;
+        unsigned char md_value[EVP_MAX_MD_SIZE];
+        unsigned int md_len;
+        
+        for (int i1=0; i1<buffer->tot_digests; i1++) {
+            fastdd_digest::ctx_init(&mdctx);
+            fastdd_digest::digest_init(&mdctx, buffer->digest_type[i1]);
+            fastdd_digest::digest_update(&mdctx, local_buffer, current_read);
+            fastdd_digest::digest_final(&mdctx, md_value, &md_len);
+            
+            if (!memcmp(md_value, r->hash[i1], md_len))
+                continue;
+            
+            stringstream ss, ss2;
+            for (int i2=0; i2<md_len; i2++) {
+                ss << setw(2) << setfill('0') << setbase(16) << (unsigned int) md_value[i2];
+                ss2 << setw(2) << setfill('0') << setbase(16) << (unsigned int) r->hash[i1][i2];
+            }
+            if (settings.is_verbose) {
+                settings.ofstream_log_file << program_name << ": error: " << settings.md_blocks[i1] << " block check failed"<<endl;
+                settings.ofstream_log_file << ss2.str() << " - input buffer " << r->seq << " - " << fi_common->file_name << endl;
+                settings.ofstream_log_file << ss.str() << " - " << settings.md_blocks[i1] << " - " << num2str(r->offset,16,16,'0')<<"-"<<
+                    num2str(r->offset+r->length,16,16,'0')<<" - "<< fo->file_name << endl;
+            }
+            cerr << '\r' << program_name << ": error: " << settings.md_blocks[i1] << " block check failed in '" << fo->file_name << "' at "
+                << num2str(r->offset,16,16,'0') << "-" << num2str(r->offset+r->length,16,16,'0') << endl;
+            ok = false;
+            break;
+        }
+    }
+    
+    if (fo->hash_pool)              // local_buffer is going to be reused
+        fo->hash_pool->wait(r->seq);
+    
+    return ok;
+}
+
+/** verify stage of an output: it checks the ranges queued by the writer, in
+    order. After a failure it only drains the queue, the writer stops */
+void *thread_verify(void *arg) {
+    fastdd_file_t *fo = (fastdd_file_t *) arg;
+    
+    unsigned char *local_buffer = NULL;
+    uint64_t capacity = settings.bs+512;
+    if (posix_memalign( (void **) &(local_buffer), 512, capacity)) {
+        cerr << program_name << ": error: allocating buffer for re-reading " << fo->file_name << endl;
+        fo->verify_failed = true;
+    }
+    
+    while (true) {
+        pthread_mutex_lock(&fo->verify_mutex);
+        while (fo->verify_head == fo->verify_tail && !fo->verify_end)
+            pthread_cond_wait(&fo->verify_not_empty, &fo->verify_mutex);
+        if (fo->verify_head == fo->verify_tail) {
+            pthread_mutex_unlock(&fo->verify_mutex);
+            break;
+        }
+        verify_range_t *r = &fo->verify_ranges[fo->verify_head % VERIFY_RANGES];
+        pthread_mutex_unlock(&fo->verify_mutex);
+        
+        // a module can make a buffer longer than bs (whole sectors are read)
+        if (!fo->verify_failed && (uint64_t) r->length+512 > capacity) {
+            free(local_buffer);
+            capacity = r->length+512;
+            if (posix_memalign( (void **) &(local_buffer), 512, capacity)) {
+                cerr << program_name << ": error: allocating buffer for re-reading " << fo->file_name << endl;
+                local_buffer = NULL;
+                fo->verify_failed = true;
+            }
+        }
+        
+        if (!fo->verify_failed && !check_range(fo, r, local_buffer))
+            fo->verify_failed = true;
+        
+        pthread_mutex_lock(&fo->verify_mutex);
+        fo->verify_head++;
+        pthread_cond_signal(&fo->verify_not_full);
+        pthread_mutex_unlock(&fo->verify_mutex);
+    }
+    
+    if (fo->hash_pool)
+        fo->hash_pool->finish();
+    free(local_buffer);
+    pthread_exit(NULL);
+}
+
+/** start the verify stage of fo; false if the output can not be opened again */
+bool start_verify(fastdd_file_t *fo) {
+    fo->verify_fd = open(fo->file_name, O_RDONLY|O_DIRECT|O_LARGEFILE);
+    if (fo->verify_fd == -1)
+        fo->verify_fd = open(fo->file_name, O_RDONLY|O_LARGEFILE);
+    if (fo->verify_fd == -1)
+        return false;
+    
+    fo->verify_ranges = (verify_range_t *) malloc(VERIFY_RANGES * sizeof(verify_range_t));
+    for (int i=0; i<VERIFY_RANGES; i++) {
+        fo->verify_ranges[i].hash = (unsigned char **) malloc(MAX(buffer->tot_digests, 1) * sizeof(unsigned char *));
+        for (int i1=0; i1<buffer->tot_digests; i1++)
+            fo->verify_ranges[i].hash[i1] = (unsigned char *) malloc(EVP_MAX_MD_SIZE * sizeof(unsigned char));
+    }
+    fo->verify_head = fo->verify_tail = 0;
+    fo->verify_end = fo->verify_failed = false;
+    pthread_mutex_init(&fo->verify_mutex, NULL);
+    pthread_cond_init(&fo->verify_not_empty, NULL);
+    pthread_cond_init(&fo->verify_not_full, NULL);
+    
+    // with more digests, each one in its own thread
+    if (settings.is_md_files_out && fo->tot_digests > 1) {
+        fo->hash_pool = new fastdd_hash_pool();
+        if (!fo->hash_pool->init(fo->ctx, fo->tot_digests)) {
+            delete fo->hash_pool;
+            fo->hash_pool = NULL;
+        }
+    }
+    
+    if (pthread_create(&fo->verify_thread, NULL, thread_verify, (void *) fo)) {
+        close(fo->verify_fd);
+        fo->verify_fd = -1;
+        return false;
+    }
+    
+    return true;
+}
+
+/** hand the range just written from data to the verify stage; the writer
+    waits only if the verifier is VERIFY_RANGES ranges behind */
+void queue_verify(fastdd_file_t *fo, buffer_t *data, int64_t offset) {
+    pthread_mutex_lock(&fo->verify_mutex);
+    while (fo->verify_tail - fo->verify_head == VERIFY_RANGES)
+        pthread_cond_wait(&fo->verify_not_full, &fo->verify_mutex);
+    pthread_mutex_unlock(&fo->verify_mutex);
+    
+    verify_range_t *r = &fo->verify_ranges[fo->verify_tail % VERIFY_RANGES];
+    r->offset = offset;
+    r->length = data->length;
+    r->seq = data->seq;
+    for (int i1=0; i1<data->tot_digests; i1++)
+        memcpy(r->hash[i1], data->hash[i1], EVP_MAX_MD_SIZE);
+    
+    pthread_mutex_lock(&fo->verify_mutex);
+    fo->verify_tail++;
+    pthread_cond_signal(&fo->verify_not_empty);
+    pthread_mutex_unlock(&fo->verify_mutex);
+}
+
+/** wait for the verifier to check the last ranges; false if one failed */
+bool stop_verify(fastdd_file_t *fo) {
+    if (fo->verify_fd < 0)
+        return true;
+    
+    pthread_mutex_lock(&fo->verify_mutex);
+    fo->verify_end = true;
+    pthread_cond_signal(&fo->verify_not_empty);
+    pthread_mutex_unlock(&fo->verify_mutex);
+    
+    pthread_join(fo->verify_thread, NULL);
+    close(fo->verify_fd);
+    fo->verify_fd = -1;
+    
+    return !fo->verify_failed;
+}
+
 void *thread_write(void *arg) {
     fastdd_file_t *fo = (fastdd_file_t *) arg;
     int id = fo->idx;
 
     buffer_t *buff = buffer;
     
-    unsigned char *local_buffer;
-    if (settings.is_md_blocks_check || settings.is_md_files_out) {
-        int t = posix_memalign( (void **) &(local_buffer), 512, settings.bs);
-        if (t) {
+    // the written data is re-read by the verify stage, not here
+    bool verify = settings.is_md_blocks_check || settings.is_md_files_out;
+    if (verify) {
+        if (!start_verify(fo)) {
             if (settings.is_verbose) {
-                settings.ofstream_log_file << program_name << "error allocating buffer for " << fo->file_name << " (" <<
+                settings.ofstream_log_file << program_name << "error opening " << fo->file_name << " again to verify it (" <<
                     strerror(errno) << ")\n";
             }
-            cerr << program_name << ": error: allocating buffer for " << fo->file_name << " (" <<
+            cerr << program_name << ": error: opening " << fo->file_name << " again to verify it (" <<
                     strerror(errno) << ")\n";
 
+            if (ring.is_ready())
+                ring.leave(id);
             while (buff->active[id]) {
                 pthread_mutex_lock(&buff->buffer_mutex);
                 buff->active[id]=false;
                 buff->writer_active--;
                 pthread_mutex_unlock(&buff->buffer_mutex);
-                buff = buff->the_other_buffer;
+                buff = buff->next_buffer;
             }
 
+            writer_done(fo);
             pthread_exit(NULL);
         }
     }
     
-    int64_t bs= settings.bs;
-    int64_t obs= settings.obs;
-    int64_t count= settings.count;
+    buffer_t spill_view;        // a buffer coming from the spill file
  //   struct timeval t_1;
   //  int64_t t1=t_start, t2, t3;
     
     do {
     //    cerr << fo->file_name << " aspetto" << endl;
-        pthread_mutex_lock(&buff->buffer_mutex);
-        if (buff->is_empty || buff->already_write[id]) {
-    //        cerr << fo->file_name << " aspetto che il buffer si riempia" << endl;
-            pthread_cond_wait (&buff->is_not_empty[id], &buff->buffer_mutex);
-        }
-        if (buff->is_last && buff->length==0) {
-            pthread_mutex_unlock(&buff->buffer_mutex);
-            break;
+        buffer_t *data = buff;
+        bool spilled;
+        if (ring.is_ready()) {
+            ring.wait_published(fo->next_seq);      // the buffer is ours until we release it
+            spilled = false;
         }
-        buff->writer_entered++;
-        pthread_mutex_unlock(&buff->buffer_mutex);
-        
-  //      cerr << fo->file_name << " dentro" << endl;
-        
-        // --------------------------- riapri file senza o_direct se serve
-        if (fo->is_direct_o && (buff->length&511)) {
-            int oldflags = fcntl (fo->file_descriptor, F_GETFL, 0);
-
-            if (oldflags == -1) {
-                if (settings.is_verbose)
-                    settings.ofstream_log_file << program_name << ": error: while changing O_DIRECT flag in output file '"<<
-                        fo->file_name << "'" << endl;
-                secure_next_buffer(buff, id, true);
-                pthread_exit(NULL);
-            }
-            
-            
-            oldflags &= ~O_DIRECT;
-
-            oldflags = fcntl(fo->file_descriptor, F_SETFL, oldflags);
-            if (oldflags == -1) {
-                if (settings.is_verbose)
-                    settings.ofstream_log_file << program_name << ": error: while changing O_DIRECT flag in output file '"<<
-                        fo->file_name << "'" << endl;
-                secure_next_buffer(buff, id, true);
-                pthread_exit(NULL);
-            }
-            
-            fo->is_direct_o = 0;
-        //    cerr << fo->file_name << " -------------- riaperto" << endl;
-        }
-        
-        // ----------------------------- scrivo
-        int64_t bytes_written = 0, temp;
-        for (int64_t j=0; j<buff->length; j+=MIN(obs, buff->length-j)) {
-          //  gettimeofday(&t_1, NULL);
-         //   t2 = t_1.tv_sec*1000000+t_1.tv_usec;
-            temp = write(fo->file_descriptor, buff->buffer+j, MIN(obs, buff->length-j));
-          //  gettimeofday(&t_1, NULL);
-          //  t3 = t_1.tv_sec*1000000+t_1.tv_usec;
-         //   couttime << "write "<< (t2-t1) << " " << (t3-t2) << endl;
-         //   t1=t3;
-            
-            if (temp==-1)
-                exit(1);
-                
-            if (temp==obs) {
-             //   printf("%ld %ld %ld C\n",j,buff->length, temp);
-                fo->b_compl++;
-            }
-            else if (temp) {
-             //   printf("%ld %ld %ld P\n",j,buff->length, temp);
-                fo->b_part++;
+        else {
+            pthread_mutex_lock(&buff->buffer_mutex);
+            while (!(spilled = is_spilled(fo)) && (buff->is_empty || buff->already_write[id]) && !(buff->is_last && buff->length==0)) {
+    //            cerr << fo->file_name << " aspetto che il buffer si riempia" << endl;
+                pthread_cond_wait (&buff->is_not_empty[id], &buff->buffer_mutex);
             }
-            bytes_written += temp;
-        }
-    //    cerr << fo->file_name << " scritti " << bytes_written << endl;
-        
-        // -------------------------------- rileggo
-        if (settings.is_md_blocks_check || settings.is_md_files_out) {
-            int64_t pos = lseek(fo->file_descriptor, -bytes_written, SEEK_CUR);	// torno a monte del buffer appena scritto
-            int64_t current_read=0;
-            memset((void *) local_buffer, 0, bs);
-            
-            for (int t=0; t<buff->length; t+=MIN(obs, buff->length-t)) {
-    //            cerr << ">>" << MIN(obs, buff->length-t) << endl;
-                int64_t t2 = read(fo->file_descriptor, local_buffer+t, MIN(obs, buff->length-t));
-    //            cerr << "riletti: " << buff->length << " " << t2 << endl;
-                if (t2==-1) {                   // ho trovato un blocco danneggiato, lo salto
+            if (spilled) {
+                pthread_mutex_unlock(&buff->buffer_mutex);
+                if (!load_spilled(fo, &spill_view)) {
                     if (settings.is_verbose)
-                        settings.ofstream_log_file << program_name << ": error: re-reading block "<<num2str(pos,16,16,'0')<<"-"
-                            <<num2str(pos+MIN(obs, buff->length-t),16,16,'0')<<" ("<< strerror(errno) << ")\n";
+                        settings.ofstream_log_file << program_name << ": error: reading spill file of '" << fo->file_name << "'" << endl;
+                    cerr << program_name << ": error: reading spill file of '" << fo->file_name << "'" << endl;
                     secure_next_buffer(buff, id, true);
-                
+                    if (!stop_verify(fo))
+                        fo->verify_failed = true;
+                    writer_done(fo);
                     pthread_exit(NULL);
                 }
-                else {
-                    current_read += t2;
-                }
-                pos+=t2;
-            }
-
-            if (current_read != buff->length) {
-                if (settings.is_verbose)
-                    settings.ofstream_log_file << program_name << ": error: unable to load data just written in '"<< fo->file_name <<"' (read only " << current_read << " bytes)\n";
-                cerr << program_name << ": error: unable to load data just written in '"<< fo->file_name <<"' (read only " << current_read << " bytes)\n";
-                
-                secure_next_buffer(buff, id, true);
-                
-                pthread_exit(NULL);
+                data = &spill_view;
             }
-            
-            // a questo punto ho riletto senza errori (quindi il supporto non è fisicamente danneggiato)
-            // ma se l'md5 diverge esco subito
-            ///////////////////////////////////////// MD
-            if (settings.is_md_files_out) {
-                for (int i1=0; i1<fo->tot_digests; i1++) {
-                    EVP_DigestUpdate(&(fo->ctx[i1]), local_buffer, current_read);
+            else {
+                if (buff->is_last && buff->length==0) {
+                    pthread_mutex_unlock(&buff->buffer_mutex);
+                    break;
                 }
+                buff->writer_entered++;
+                fo->ring_seq = buff->seq;
+                pthread_mutex_unlock(&buff->buffer_mutex);
             }
+        }
         
-            if (settings.is_md_blocks_check) {           // calcolo e scrivo su file i digest dei blocchi
-                EVP_MD_CTX mdctx;
-                unsigned char md_value[EVP_MAX_MD_SIZE];
-                unsigned int md_len;
-
-                for (int i1=0; i1<buff->tot_digests; i1++) {
-                    EVP_MD_CTX_init(&mdctx);
-                    EVP_DigestInit_ex(&mdctx, buff->digest_type[i1], NULL);
-                    EVP_DigestUpdate(&mdctx, local_buffer, current_read);
-                    EVP_DigestFinal_ex(&mdctx, md_value, &md_len);
-                    
-                    bool uguali = true;
-                    for (int i2=0; i2<md_len; i2++) {
-                        if (md_value[i2] != buff->hash[i1][i2])
-                            uguali = false;
-                    }
-                    
-                    if (!uguali) {
-                        if (settings.is_verbose) {
-                            settings.ofstream_log_file << program_name << ": error: " << settings.md_blocks[i1] << " block check failed"<<endl;
-                            
-                            stringstream ss2;
-                            for (int i2=0; i2<md_len; i2++) {
-                                ss2 << setw(2) << setfill('0') << setbase(16) << (unsigned int) buff->hash[i1][i2];
-                            }
-                            
-                            settings.ofstream_log_file << ss2.str() << " - " << num2str(fi_common->current_position-buff->length,16,16,'0')<<"-"<<
-                                num2str(fi_common->current_position,16,16,'0')<<" - " << fi_common->file_name << endl;
-                            
-                            stringstream ss;
-                            for (int i2=0; i2<md_len; i2++) {
-                                ss << setw(2) << setfill('0') << setbase(16) << (unsigned int) md_value[i2];
-                            }
-                            
-                            settings.ofstream_log_file << ss.str() << " - " << settings.md_blocks[i1] << " - " << num2str(pos-buff->length,16,16,'0')<<"-"<<
-                                num2str(pos,16,16,'0')<<" - "<< fo->file_name << endl;
-                        }
-                        
-                        secure_next_buffer(buff, id, true);
-                    
-                        pthread_exit(NULL);
-                    }
-                }
-            }
+  //      cerr << fo->file_name << " dentro" << endl;
+        
+        int64_t offset = fo->current_position + fo->byte_written;
+        if (fo->verify_failed || !write_buffer(fo, data, NULL)) {
+            secure_next_buffer(buff, id, true);
+            if (!stop_verify(fo))
+                fo->verify_failed = true;
+            writer_done(fo);
+            pthread_exit(NULL);
         }
-     //   cerr << "write: " << (fo->b_compl+fo->b_part) << endl;
-        // ------------------------------ fatto
+        if (verify)
+            queue_verify(fo, data, offset);
         
-        bool esci = buff->is_last;
-        secure_next_buffer(buff, id, false);
+        fo->next_seq++;
+        
+        bool esci = data->is_last;
+        if (spilled)
+            pop_spilled(fo);
+        else {
+            secure_next_buffer(buff, id, false);
+            fo->ring_seq = -1;
+        }
         if (esci) break;
         
-        buff = buff->the_other_buffer;
+        buff = buff->next_buffer;
         
     } while(true);
     
     //cerr << fo->file_name << " " << fo->b_compl << "+" << fo->b_part << endl;
+    // the last ranges are checked after the last write: they fail the output
+    // as a range checked while writing
+    if (!stop_verify(fo))
+        fo->verify_failed = true;
+    writer_done(fo);
     pthread_exit(NULL);
 }
 
+/** the whole copy in the main thread: the same read, modules, hash and write
+    steps of thread_read and thread_write, one buffer at time, without threads
+    nor handoffs. Used by --no-parallel and for small inputs */
 void no_parallel(fastdd_file_t *fi, fastdd_file_t *fo) {
-  /*  fi->b_part = fi->b_compl = 0;
-    
     buffer_t *buff = buffer;
     
-    int64_t bs= settings.bs;
-    int64_t ibs= settings.ibs;
-    int64_t obs= settings.obs;
-    int64_t count= settings.count;
-    
-    unsigned char **local_buffer;
+    unsigned char *local_buffer = NULL;
+    uint64_t capacity = settings.bs;
     if (settings.is_md_blocks_check || settings.is_md_files_out) {
-        local_buffer = (unsigned char **) malloc(tot_output_file*sizeof(unsigned char *));
-        
-        for (int i=0; i<tot_output_file; i++) {
-            int t = posix_memalign( (void **) &(local_buffer[i]), 512, settings.bs);
-            if (t) {
-                if (settings.is_verbose) {
-                    settings.ofstream_log_file << program_name << "error allocating buffer for " << fo[i].file_name << " (" <<
-                        strerror(errno) << ")\n";
-                }
-                cerr << program_name << ": error: allocating buffer for " << fo[i].file_name << " (" <<
+        int t = posix_memalign( (void **) &(local_buffer), 512, capacity);
+        if (t) {
+            if (settings.is_verbose) {
+                settings.ofstream_log_file << program_name << "error allocating buffer for re-reading outputs (" <<
+                    strerror(errno) << ")\n";
+            }
+            cerr << program_name << ": error: allocating buffer for re-reading outputs (" <<
+                    strerror(errno) << ")\n";
+            exit(1);
+        }
+    }
+    
+    reader_state_t rs;
+    init_reader(fi, &rs);
+    
+    bool someone_active;
+    do {
+        fill_buffer(fi, buff, &rs);
+        process_buffer(fi, buff, &rs);
+        
+        // a module can make the buffer longer than bs
+        if (local_buffer && buff->length > capacity) {
+            free(local_buffer);
+            capacity = buff->length;
+            if (posix_memalign( (void **) &(local_buffer), 512, capacity)) {
+                cerr << program_name << ": error: allocating buffer for re-reading outputs (" <<
                         strerror(errno) << ")\n";
+                exit(1);
+            }
+        }
+        
+        someone_active = false;
+        for (int id=0; id<tot_output_file; id++) {
+            if (!buff->active[id]) continue;
+            
+            if (write_buffer(&fo[id], buff, local_buffer)) {
+                fo[id].next_seq++;
+                someone_active = true;
+            }
+            else {              // as a writer thread, this output stops here
+                buff->active[id] = false;
+                writer_done(&fo[id]);
+            }
+        }
+    } while (someone_active && !buff->is_last);
+    
+    for (int id=0; id<tot_output_file; id++)
+        if (buff->active[id]) writer_done(&fo[id]);
+    
+    free(local_buffer);
+}
+
+//////////////////////////////////////////////// engine=zero-copy
+// the ways the kernel can copy by itself, from the best one
+enum { KCOPY_COPY_FILE_RANGE=0, KCOPY_SENDFILE=1, KCOPY_SPLICE=2, KCOPY_NONE=3 };
+
+/** why the data can not be copied by the kernel alone (empty if it can) */
+string zero_copy_obstacle() {
+    int writers = 0;
+    for (int i=0; i<tot_output_file; i++)
+        if (fo_common[i].clone_of == CLONE_NONE) writers++;
+    if (writers != 1)
+        return "more than one output";
+    if (settings.is_md_blocks_check || settings.is_md_blocks_save || settings.is_md_file_in || settings.is_md_files_out)
+        return "hashes are computed";
+    if (settings.md_tree.length())
+        return "the hash tree is computed";
+    if (settings.is_get_partition)
+        return "the partition table is read";
+    if (settings.is_sparse)
+        return "zero blocks must be found";
+    if (settings.input_index_file_name.length() || settings.decode.length())
+        return "the input is decompressed";
+    for (int i=0; i<modules.size(); i++)
+        if (modules[i]->is_active())
+            return modules[i]->get_name() + " module is active";
+    
+    return "";
+}
 
-                buffer[0].active[i] = false;
+/** move the data of a pipe to fd_out, with write() if splice() fails */
+bool drain_pipe(int pipe_in, int fd_out, fastdd_file_t *fo, int64_t len) {
+    while (len > 0) {
+        int64_t t = splice(pipe_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE);
+        if (t > 0) {
+            len -= t;
+            continue;
+        }
+        
+        // the output refuses splice: take the data back and write it
+        buffer_t view = buffer[0];
+        view.length = 0;
+        while (view.length < len) {
+            t = read(pipe_in, view.buffer+view.length, len-view.length);
+            if (t <= 0) return false;
+            view.length += t;
+        }
+        fastdd_file_t counted = *fo;
+        if (!write_buffer(fo, &view, NULL)) return false;
+        fo->byte_written = counted.byte_written;    // counted by the caller
+        fo->b_compl = counted.b_compl;
+        fo->b_part = counted.b_part;
+        len = 0;
+    }
+    
+    return true;
+}
+
+/** copy up to len bytes from fi to fo inside the kernel, with the method in *method.
+    Returns the bytes copied: less than len at the end of the input or on error
+    (*err is then set, and the method is given up if the kernel does not support it) */
+int64_t kernel_copy(int *method, fastdd_file_t *fi, fastdd_file_t *fo, int *pipe_fd, bool direct_splice, int64_t len, int *err) {
+    int64_t done = 0, t = 0;
+    *err = 0;
+    
+    while (done < len) {
+        int64_t chunk = MIN(len-done, settings.bs);
+        
+        if (*method == KCOPY_COPY_FILE_RANGE)
+            t = copy_file_range(fi->file_descriptor, NULL, fo->file_descriptor, NULL, chunk, 0);
+        else if (*method == KCOPY_SENDFILE)
+            t = sendfile(fo->file_descriptor, fi->file_descriptor, NULL, chunk);
+        else if (direct_splice)     // one of the two is a pipe
+            t = splice(fi->file_descriptor, NULL, fo->file_descriptor, NULL, chunk, SPLICE_F_MOVE);
+        else {
+            t = splice(fi->file_descriptor, NULL, pipe_fd[1], NULL, chunk, SPLICE_F_MOVE);
+            if (t > 0 && !drain_pipe(pipe_fd[0], fo->file_descriptor, fo, t)) {
+                *err = errno;
+                if (settings.is_verbose)
+                    settings.ofstream_log_file << program_name << ": error: writing '" << fo->file_name << "' (" << strerror(errno) << ")" << endl;
+                cerr << program_name << ": error: writing '" << fo->file_name << "' (" << strerror(errno) << ")" << endl;
+                exit(1);
+            }
+        }
+        
+        if (t < 0) {
+            *err = errno;
+            if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF) {
+                if (settings.is_verbose)
+                    settings.ofstream_log_file << "zero-copy: method " << *method << " not supported here (" << strerror(errno) << "), trying the next one" << endl;
+                (*method)++;
             }
+            break;
         }
-    } 
+        if (t == 0)         // end of input
+            break;
+        done += t;
+    }
+    
+    return done;
+}
+
+/** engine=zero-copy: the data goes from the input to the output without
+    passing through the buffers. Ranges the kernel can not copy (or that fail,
+    e.g. damaged blocks to recover) go through fill_buffer/write_buffer */
+void zero_copy(fastdd_file_t *fi, fastdd_file_t *fo) {
+    struct stat st_in, st_out;
+    fstat(fi->file_descriptor, &st_in);
+    fstat(fo->file_descriptor, &st_out);
+    
+    int method = KCOPY_SPLICE;
+    if (S_ISREG(st_in.st_mode) && S_ISREG(st_out.st_mode))
+        method = KCOPY_COPY_FILE_RANGE;
+    else if (S_ISREG(st_in.st_mode) || S_ISBLK(st_in.st_mode))
+        method = KCOPY_SENDFILE;
+    
+    bool direct_splice = S_ISFIFO(st_in.st_mode) || S_ISFIFO(st_out.st_mode);
+    int pipe_fd[2] = { -1, -1 };
+    if (!direct_splice) {
+        if (pipe(pipe_fd))
+            direct_splice = true;       // splice will fail and we fall back
+        else
+            fcntl(pipe_fd[1], F_SETPIPE_SZ, settings.bs);
+    }
     
-    bool is_find = (settings.total_regexes > 0);
+    if (settings.is_verbose)
+        settings.ofstream_log_file << "zero-copy: starting with method " << method << " (0=copy_file_range, 1=sendfile, 2=splice)" << endl;
     
-    int64_t tot_read;
-    int64_t bytes_read, temp;
-    while ((count<0 || (count>=0 && fi->b_compl+fi->b_part<count)) && !buff->is_last) {
-        tot_read = 0;
-      //  cerr << "read: " << fi->b_compl << "+" << fi->b_part << endl;
-        ////////////////////////////////////////////// leggi
-        int64_t current_blocks = fi->b_compl+fi->b_part;
-        for (int j=0; (count<0 || (count>=0 && fi->b_compl+fi->b_part<count)) && j<bs; j+=bytes_read) {
-            if (!settings.full_block) {
-                bytes_read = read(fi->file_descriptor, buff->buffer+j, MIN(ibs,bs-tot_read));
-            }
-            else {
-                int64_t da_leggere = MIN(ibs,bs-tot_read);
-                temp = bytes_read = read(fi->file_descriptor, buff->buffer+j, da_leggere);
-                while (temp>0 && bytes_read<da_leggere) {
-                    temp = read(fi->file_descriptor, buff->buffer+j+bytes_read, da_leggere-bytes_read);
-                    if (temp==0) {
-                        buff->is_last = true;
-                        break;
-                    }
-                    bytes_read += temp;
-                }
-                if (temp==-1)
-                    bytes_read = -1;
-            }
-            
-            if (bytes_read==-1) {
-                cerr << program_name << ": error: " << strerror(errno) << endl;
-                exit(1);
-            }
-                
-            if (bytes_read==ibs)
-                fi->b_compl++;
-            else if (bytes_read)
-                fi->b_part++;
-                
-            tot_read+=bytes_read;
+    reader_state_t rs;
+    init_reader(fi, &rs);
+    buffer_t *buff = buffer;
+    
+    // kernel copies and buffered fallbacks can split a block between them:
+    // the block counts are derived once from the bytes of the whole copy
+    fastdd_file_t counted_in = *fi, counted_out = *fo;
+    
+    // as many bs blocks as fit in 8M, one progress bar update each
+    int64_t range = settings.bs * MAX(1, (8<<20)/settings.bs);
+    
+    while (!buff->is_last) {
+        int64_t len = range;
+        if (fi->byte_to_read >= 0)
+            len = MIN(len, fi->byte_to_read - (int64_t) fi->byte_read);
+        if (len <= 0) break;
+        
+        int err = 0;
+        int64_t done = 0;
+        if (method < KCOPY_NONE)
+            done = kernel_copy(&method, fi, fo, pipe_fd, direct_splice, len, &err);
+        
+        if (done) {
+            fi->b_compl += done/settings.ibs;
+            fo->b_compl += done/settings.obs;
+            fi->current_position += done;
+            fi->byte_read += done;
+            fo->byte_written += done;
             
-            if ((count>0 && fi->b_compl+fi->b_part >= count) || !bytes_read) {
-                buff->is_last = true;
+            if (settings.is_progress_bar) {
+                pb.add_pos(done);
+                if (fi->current_position - rs.last_update >= 1048576) {
+                    cerr << '\r';
+                    cerr << pb.get_barra() << flush;
+                    rs.last_update = fi->current_position;
+                }
             }
-            
-            if (buff->is_last)
-                break;
         }
-        buff->length = tot_read;
         
-        ///////////////////////////////////////// MD
+        if (done == len) continue;
+        if (!err && method < KCOPY_NONE) break;     // end of input
         
-        if (settings.is_md_blocks_save) {           // calcolo e scrivo su file i digest dei blocchi
-            EVP_MD_CTX mdctx;
-            unsigned char md_value[EVP_MAX_MD_SIZE];
-            unsigned int md_len;
-            
-            for (int i=0; i<tot_read; i+=ibs) {
-                for (int i1=0; i1<buff->tot_digests; i1++) {
-                    EVP_MD_CTX_init(&mdctx);
-                    EVP_DigestInit_ex(&mdctx, buff->digest_type[i1], NULL);
-                    EVP_DigestUpdate(&mdctx, buff->buffer+i, MIN(ibs,tot_read-i));
-                    EVP_DigestFinal_ex(&mdctx, md_value, &md_len);
-                    stringstream ss;
-                    for (int i2=0; i2<md_len; i2++) {
-                        ss << setfill('0') << setw(2) << setbase(16) << (unsigned int) md_value[i2];
-                    }
-
-                    settings.ofstream_md << "block " << num2str(current_blocks+i/ibs,10,8,' ')<<": "
-                        <<num2str(fi->current_position,16,16,'0')<<"-"<<num2str(fi->current_position+MIN(ibs,tot_read-i),16,16,'0')<<": "
-                        << settings.md_blocks[i1] << " - " << ss.str() << endl;
-                }
-            }
+        // the rest of the range through the buffers
+        int64_t end = fi->byte_read + (len-done);
+        while (fi->byte_read < end && !buff->is_last) {
+            fill_buffer(fi, buff, &rs);
+            process_buffer(fi, buff, &rs);
+            if (!write_buffer(fo, buff, NULL))
+                goto out;
         }
+    }
+    
+out:
+    int64_t in_bytes = fi->byte_read - counted_in.byte_read;
+    int64_t out_bytes = fo->byte_written - counted_out.byte_written;
+    fi->b_compl = counted_in.b_compl + in_bytes/settings.ibs;
+    fi->b_part = counted_in.b_part + ((in_bytes%settings.ibs) ? 1 : 0);
+    fo->b_compl = counted_out.b_compl + out_bytes/settings.obs;
+    fo->b_part = counted_out.b_part + ((out_bytes%settings.obs) ? 1 : 0);
+    
+    writer_done(fo);
+    if (pipe_fd[0] >= 0) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+    }
+}
 
-        for (int i1=0; i1<fi->tot_digests; i1++) {
-            if (settings.is_md_file_in) {
-                EVP_DigestUpdate(&(fi->ctx[i1]), buff->buffer, tot_read);
-            }
+//////////////////////////////////////////////// --clone
+/** reflink len bytes of src from src_off in dst at dst_off (len=0: up to the
+    end of src). Both must be on a filesystem that shares extents (btrfs, XFS...) */
+bool clone_range(int src, int64_t src_off, int dst, int64_t dst_off, int64_t len) {
+    struct file_clone_range range;
+    range.src_fd = src;
+    range.src_offset = src_off;
+    range.src_length = len;
+    range.dest_offset = dst_off;
+    
+    return !ioctl(dst, FICLONERANGE, &range);
+}
+
+/** true if dst can share the extents of src: an empty clone at the end of src
+    fails with EXDEV/EOPNOTSUPP where reflinks are not possible */
+bool can_clone(int src, int dst) {
+    struct stat st_src, st_dst;
+    if (fstat(src, &st_src) || fstat(dst, &st_dst) || !S_ISREG(st_src.st_mode) || !S_ISREG(st_dst.st_mode))
+        return false;
+    
+    return clone_range(src, st_src.st_size, dst, 0, 0);
+}
+
+/** why the input can not be reflinked in the outputs (empty if it can) */
+string clone_obstacle(fastdd_file_t *fi) {
+    if (fi->file_descriptor == 0)
+        return "the input is stdin";
+    if (settings.input_index_file_name.length() || settings.decode.length())
+        return "the input is decompressed";
+    if (settings.is_md_blocks_check || settings.is_md_blocks_save)
+        return "block hashes are computed";
+    if (settings.is_md_files_out && !settings.is_md_file_in)
+        return "output hashes are taken from the input ones";
+    if (settings.is_get_partition)
+        return "the partition table is read";
+    for (int i=0; i<modules.size(); i++)
+        if (modules[i]->is_active())
+            return modules[i]->get_name() + " module is active";
+    
+    return "";
+}
+
+/** --clone: decide which outputs are not written by the writers. The outputs
+    that can share the extents of the input get them now; among the others,
+    the first one is written and the ones on its filesystem will share its
+    extents at the end (fin_clones) */
+void init_clones(fastdd_file_t *fi, fastdd_file_t *fo) {
+    string obstacle = clone_obstacle(fi);
+    if (obstacle.length() && settings.is_verbose)
+        settings.ofstream_log_file << "--clone: the input can not be reflinked (" << obstacle << ")" << endl;
+    
+    int64_t len = fi->total_size_in_byte - (int64_t) fi->skip_in_byte;
+    if (fi->byte_to_read >= 0)
+        len = MIN(len, fi->byte_to_read);
+    
+    for (int i=0; i<tot_output_file && !obstacle.length() && len > 0; i++) {
+        if (!can_clone(fi->file_descriptor, fo[i].file_descriptor))
+            continue;
+        if (!clone_range(fi->file_descriptor, fi->skip_in_byte, fo[i].file_descriptor, fo[i].current_position, len)) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "--clone: reflink of the input in '" << fo[i].file_name << "' failed (" << strerror(errno) << "), it is written" << endl;
+            continue;
         }
         
-        for (int i1=0; i1<buff->tot_digests; i1++) {
-            if (settings.is_md_blocks_check) {
-                EVP_MD_CTX_init(&buff->ctx[i1]);
-                EVP_DigestInit_ex(&buff->ctx[i1], buff->digest_type[i1], NULL);
-                EVP_DigestUpdate(&buff->ctx[i1], buff->buffer, tot_read);
-                EVP_DigestFinal_ex(&buff->ctx[i1], buff->hash[i1], &buff->hash_len[i1]);
-            }
+        fo[i].clone_of = CLONE_INPUT;
+        fo[i].byte_written = len;
+        fo[i].b_compl = len / settings.obs;
+        fo[i].b_part = (len % settings.obs) ? 1 : 0;
+        writer_done(&fo[i]);
+        if (settings.is_verbose)
+            settings.ofstream_log_file << "--clone: " << len << " bytes of the input reflinked in '" << fo[i].file_name << "'" << endl;
+    }
+    
+    int first = -1;
+    for (int i=0; i<tot_output_file; i++) {
+        if (fo[i].clone_of != CLONE_NONE) continue;
+        if (first < 0) {
+            first = i;
+            continue;
         }
-        // -------------------------------- find
-        if (is_find) {               /////////////////////////// FIND REGEX
-            string search_buffer(buff->buffer, buff->buffer+buff->length);
-            for (int j2=0; j2<settings.total_regexes; j2++) {
-                if (settings.is_simple_regex_match) {  // write just if there is a match in this block
-                    bool result = boost::regex_search(search_buffer , what, settings.re[j2]);
-                    if (result) {
-                        out_find << "matches found for regex "<<j2<<" in input block "<<num2str(current_blocks + what.position()/ibs,10,8,' ')
-                            << ": " << num2str(fi->current_position,16,16,'0') << "-" << num2str(fi->current_position+buff->length,16,16,'0') << "\n";
-                    }
-                }
-                else { // print in find_file_output all information
-                    boost::sregex_iterator m1(search_buffer.begin(), search_buffer.end(), settings.re[j2], boost::match_default | boost::match_partial);
-                    boost::sregex_iterator m2;
-                    
-                    if (m1==m2) continue;
-                    
-                    do {
-                        boost::smatch m = *m1;
-                        
-                        if (!m[0].matched) out_find << "? ";
-                        
-                        out_find << setbase(10) << j2 << " " << ( current_blocks+m.position()/ibs ) << " " << (fi->current_position+m.position()) << " " << m.length(0) << " ";
-                        for (int temp1=0; temp1<m.length(0); temp1++) {
-                            out_find << num2str((int)(buff->buffer[m.position()+temp1] & 255),16,2,'0');
-                        }
-                        out_find << endl;
-                        
-                        m1++;
-                    } while ( !(m1 == m2));
-                    
-                }
-            }
+        if (can_clone(fo[first].file_descriptor, fo[i].file_descriptor)) {
+            fo[i].clone_of = first;
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "--clone: '" << fo[i].file_name << "' will be reflinked from '" << fo[first].file_name << "'" << endl;
         }
-        
-        fi->current_position+=tot_read;
-        fi->byte_read+=tot_read;
-        
-        // ---------------------- scrive
-        for (int id=0; id<tot_output_file; id++) {
-            if (!buff->active[id]) continue;
-            
-            //// se serve riapro
-            if (fo[id].is_direct_o && (buff->length&511)) {
-                int oldflags = fcntl (fo[id].file_descriptor, F_GETFL, 0);
+    }
+    
+    // the writers skip what is not theirs
+    for (int i=0; i<tot_output_file; i++)
+        if (fo[i].clone_of != CLONE_NONE)
+            for (int j=0; j<tot_buffers; j++)
+                buffer[j].active[i] = false;
+}
 
-                if (oldflags == -1) {
-                    if (settings.is_verbose)
-                        settings.ofstream_log_file << program_name << ": error: while changing O_DIRECT flag in output file '"<<
-                            fo[id].file_name << "'" << endl;
-                    buff->active[id] = false;
-                    continue;
-                }
-                
-                
-                oldflags &= ~O_DIRECT;
+/** --clone with every output reflinked from the input: the input is read
+    only if its hashes are wanted, otherwise it is just accounted */
+void clone_only(fastdd_file_t *fi) {
+    if (!settings.is_md_file_in && !tree_hasher) {
+        int64_t len = fo_common[0].byte_written;
+        fi->byte_read = len;
+        fi->current_position += len;
+        fi->b_compl = len / settings.ibs;
+        fi->b_part = (len % settings.ibs) ? 1 : 0;
+        return;
+    }
+    
+    reader_state_t rs;
+    init_reader(fi, &rs);
+    buffer_t *buff;
+    do {        // the digest threads may still be reading the previous buffers
+        buff = buffer + rs.seq % tot_buffers;
+        fill_buffer(fi, buff, &rs);
+        process_buffer(fi, buff, &rs);
+    } while (!buff->is_last);
+}
 
-                oldflags = fcntl(fo[id].file_descriptor, F_SETFL, oldflags);
-                if (oldflags == -1) {
-                    if (settings.is_verbose)
-                        settings.ofstream_log_file << program_name << ": error: while changing O_DIRECT flag in output file '"<<
-                            fo[id].file_name << "'" << endl;
-                    buff->active[id] = false;
-                    continue;
-                }
-                
-                fo[id].is_direct_o = 0;
-                //cerr << fo[id].file_name << " -------------- riaperto" << endl;
-            }
-            
-            // ----------------------------- scrivo
-            int64_t bytes_written = 0, temp1;
-            for (int64_t j=0; j<buff->length; j+=MIN(obs, bs-j)) {
-                temp1 = write(fo[id].file_descriptor, buff->buffer+j, MIN(obs, buff->length-j));
-                
-                if (temp1==-1){
-                    buff->active[id] = false;
-                    break;
-                }
-                    
-                if (temp1==obs)
-                    fo[id].b_compl++;
-                else if (temp1) {
-                    fo[id].b_part++;
-                }
-                bytes_written += temp1;
-            }
-            if (temp1==-1) continue;
-        //    cerr << fo[id].file_name << " scritti " << bytes_written << endl;
-            
-            if (bytes_written != tot_read) {
-                cerr << "errore: letti " << tot_read << " scritti " << bytes_written << " bytes" << endl;
-                buff->active[id] = false;
-                continue;
-            }
-            
-            // -------------------------------- rileggo
-            if (settings.is_md_blocks_check || settings.is_md_files_out) {
-                int64_t pos = lseek(fo[id].file_descriptor, -bytes_written, SEEK_CUR);	// torno a monte del buffer appena scritto
-                int64_t current_read=0;
-                memset((void *) local_buffer[id], 0, bs);
-                
-                for (int t=0; t<buff->length; t+=MIN(obs, bs-t)) {
-        //            cerr << ">>" << MIN(obs, buff->length-t) << endl;
-                    int64_t t2 = read(fo[id].file_descriptor, local_buffer[id]+t, MIN(obs, buff->length-t));
-        //            cerr << "riletti: " << buff->length << " " << t2 << endl;
-                    if (t2==-1) {                   // ho trovato un blocco danneggiato, lo salto
-                        if (settings.is_verbose)
-                            settings.ofstream_log_file << program_name << ": error: re-reading block "<<num2str(pos,16,16,'0')<<"-"
-                                <<num2str(pos+MIN(obs, buff->length-t),16,16,'0')<<" ("<< strerror(errno) << ")\n";
-                        buff->active[id] = false;
-                        break;
-                    }
-                    else {
-                        current_read += t2;
-                    }
-                    pos+=t2;
-                }
+/** copy len bytes of src in dst when reflinking them fails, re-reading dst
+    for its hashes as a writer would */
+bool copy_clone(fastdd_file_t *src, fastdd_file_t *dst, int64_t off, int64_t len) {
+    // the last block can be of any size: no O_DIRECT
+    fcntl(src->file_descriptor, F_SETFL, fcntl(src->file_descriptor, F_GETFL, 0) & ~O_DIRECT);
+    fcntl(dst->file_descriptor, F_SETFL, fcntl(dst->file_descriptor, F_GETFL, 0) & ~O_DIRECT);
+    
+    unsigned char *data = buffer[0].own_buffer;
+    bool hole = false;
+    for (int64_t done=0; done<len; ) {
+        int64_t n = MIN(settings.bs, len-done);
+        if (pread(src->file_descriptor, data, n, off+done) != n)
+            return false;
+        
+        hole = dst->is_sparse && off+done >= dst->total_size_in_byte && is_zero_block(data, n);
+        if (hole)
+            dst->byte_elided += n;
+        else if (pwrite(dst->file_descriptor, data, n, off+done) != n)
+            return false;
+        
+        if (settings.is_md_files_out) {
+            if (pread(dst->file_descriptor, data, n, off+done) != n)
+                return false;
+            for (int i1=0; i1<dst->tot_digests; i1++)
+                fastdd_digest::digest_update(&(dst->ctx[i1]), data, n);
+        }
+        done += n;
+    }
+    
+    return !(hole && ftruncate(dst->file_descriptor, off+len));
+}
 
-                if (!buff->active[id])
-                    continue;
-                    
-                if (current_read != buff->length) {
+/** --clone: the outputs waiting for the extents of a written one get them */
+void fin_clones(fastdd_file_t *fi, fastdd_file_t *fo) {
+    for (int i=0; i<tot_output_file; i++) {
+        if (fo[i].clone_of == CLONE_NONE) continue;
+        
+        fastdd_file_t *src = (fo[i].clone_of == CLONE_INPUT) ? fi : &fo[fo[i].clone_of];
+        bool same_data = true;      // the hashes of src are the ones of fo[i]
+        if (fo[i].clone_of >= 0) {
+            int64_t len = src->byte_written;
+            if (len && !clone_range(src->file_descriptor, src->current_position, fo[i].file_descriptor, fo[i].current_position, len)) {
+                if (settings.is_verbose)
+                    settings.ofstream_log_file << "--clone: reflink of '" << src->file_name << "' in '" << fo[i].file_name
+                        << "' failed (" << strerror(errno) << "), copying it" << endl;
+                same_data = false;
+                if (!copy_clone(src, &fo[i], src->current_position, len)) {
                     if (settings.is_verbose)
-                        settings.ofstream_log_file << program_name << ": error: unable to load data just written in '"<< fo[id].file_name <<"' (read only " << current_read << " bytes)\n";
-                    cerr << program_name << ": error: unable to load data just written in '"<< fo[id].file_name <<"' (read only " << current_read << " bytes)\n";
-                    
-                    buff->active[id] = false;
+                        settings.ofstream_log_file << program_name << ": error: copying '" << src->file_name << "' in '" << fo[i].file_name << "' (" << strerror(errno) << ")" << endl;
+                    cerr << program_name << ": error: copying '" << src->file_name << "' in '" << fo[i].file_name << "' (" << strerror(errno) << ")" << endl;
+                    writer_done(&fo[i]);
                     continue;
                 }
-                
-                // a questo punto ho riletto senza errori (quindi il supporto non è fisicamente danneggiato)
-                // ma se l'md5 diverge esco subito
-                
-                ///////////////////// Hash Output
-                if (settings.is_md_files_out) {
-                    for (int i1=0; i1<fo[id].tot_digests; i1++) {
-                        EVP_DigestUpdate(&(fo[id].ctx[i1]), local_buffer[id], current_read);
-                    }
-                }
-        
-                if (settings.is_md_blocks_check) {           // calcolo e scrivo su file i digest dei blocchi
-                    EVP_MD_CTX mdctx;
-                    unsigned char md_value[EVP_MAX_MD_SIZE];
-                    unsigned int md_len;
-
-                    for (int i1=0; i1<buff->tot_digests; i1++) {
-                        EVP_MD_CTX_init(&mdctx);
-                        EVP_DigestInit_ex(&mdctx, buff->digest_type[i1], NULL);
-                        EVP_DigestUpdate(&mdctx, local_buffer[id], current_read);
-                        EVP_DigestFinal_ex(&mdctx, md_value, &md_len);
-                        
-                        bool uguali = true;
-                        for (int i2=0; i2<md_len; i2++) {
-                            if (md_value[i2] != buff->hash[i1][i2])
-                                uguali = false;
-                        }
-                        
-                        if (!uguali) {
-                            if (settings.is_verbose) {
-                                settings.ofstream_log_file << program_name << ": error: " << settings.md_blocks[i1] << " block check failed"<<endl;
-                                
-                                stringstream ss2;
-                                for (int i2=0; i2<md_len; i2++) {
-                                    ss2 << setw(2) << setfill('0') << setbase(16) << (unsigned int) buff->hash[i1][i2];
-                                }
-                                
-                                settings.ofstream_log_file << ss2.str() << " - " << num2str(fi_common->current_position-buff->length,16,16,'0')<<"-"<<
-                                    num2str(fi_common->current_position,16,16,'0')<<" - " << fi_common->file_name << endl;
-                                
-                                stringstream ss;
-                                for (int i2=0; i2<md_len; i2++) {
-                                    ss << setw(2) << setfill('0') << setbase(16) << (unsigned int) md_value[i2];
-                                }
-                                
-                                settings.ofstream_log_file << ss.str() << " - " << settings.md_blocks[i1] << " - " << num2str(pos-buff->length,16,16,'0')<<"-"<<
-                                    num2str(pos,16,16,'0')<<" - "<< fo->file_name << endl;
-                            }
-                            
-                            buff->active[id]=false;
-                            
-                            bool tutti_finito=true;
-                            for (int i1=0; i1<tot_output_file; i1++)
-                                if (buff->active[i1]) tutti_finito=false;
-                                
-                            if (tutti_finito) buff->is_last = true;
-                        }
-                    }
-                }
-                ///////////////////// Fine Hash Output
             }
+            fo[i].byte_written = len;
+            fo[i].b_compl = src->b_compl;
+            fo[i].b_part = src->b_part;
+            writer_done(&fo[i]);
         }
-    }*/
+        
+        if (settings.is_md_files_out && same_data)
+            for (int i1=0; i1<fo[i].tot_digests; i1++)
+                fastdd_digest::ctx_copy(&(fo[i].ctx[i1]), &(src->ctx[i1]));
+    }
 }
 
 string to_human_readable(double num) {
@@ -1864,6 +3262,264 @@ string to_human_readable(double num) {
     return temp.str();
 }
 
+/////////////////////////////////////////////// --benchmark-handoff
+// reader and writers of the benchmark: they pass the buffers of the ring
+// exactly as thread_read and thread_write do, but without any I/O
+
+void *bench_read(void *arg) {
+    int64_t tot = *(int64_t *) arg;
+    buffer_t *buff = buffer;
+    
+    for (int64_t seq=0; seq<tot; seq++) {
+        if (ring.is_ready()) {
+            if (!ring.wait_free(seq)) break;
+        }
+        else {
+            pthread_mutex_lock(&buff->buffer_mutex);
+            while (buff->is_full && !buff->is_last)
+                pthread_cond_wait (&buff->is_not_full, &buff->buffer_mutex);
+        }
+        
+        buff->buffer[0] = (unsigned char) seq;
+        buff->length = settings.bs;
+        buff->seq = seq;
+        buff->is_last = (seq == tot-1);
+        buff->is_full = true;
+        buff->is_empty = false;
+        
+        if (ring.is_ready())
+            ring.publish(buff->seq);
+        else {
+            for (int j=0; j<tot_output_file; j++)
+                pthread_cond_signal(&buff->is_not_empty[j]);
+            pthread_mutex_unlock(&buff->buffer_mutex);
+        }
+        
+        buff = buff->next_buffer;
+    }
+    
+    pthread_exit(NULL);
+}
+
+void *bench_write(void *arg) {
+    int id = *(int *) arg;
+    buffer_t *buff = buffer;
+    uint64_t sum = 0;
+    
+    for (uint64_t seq=0; true; seq++) {
+        if (ring.is_ready())
+            ring.wait_published(seq);
+        else {
+            pthread_mutex_lock(&buff->buffer_mutex);
+            while ((buff->is_empty || buff->already_write[id]) && !(buff->is_last && buff->length==0))
+                pthread_cond_wait (&buff->is_not_empty[id], &buff->buffer_mutex);
+            pthread_mutex_unlock(&buff->buffer_mutex);
+        }
+        
+        sum += buff->buffer[0];         // touch the data
+        bool esci = buff->is_last;
+        secure_next_buffer(buff, id, false);
+        if (esci) break;
+        
+        buff = buff->next_buffer;
+    }
+    
+    *(int *) arg = (int) sum;
+    pthread_exit(NULL);
+}
+
+/** time the two handoffs moving count buffers (default: 100000) of bs bytes from
+    one reader to as many writers as the of= given (default: 1) */
+void benchmark_handoff() {
+    settings.is_parallel = true;
+    settings.is_md_blocks_check = settings.is_md_blocks_save = false;
+    tot_output_file = MAX(settings.output_file_name.size(), 1);
+    int64_t tot = (settings.count > 0) ? settings.count : 100000;
+    
+    init_buffers();
+    
+    cerr << "handoff of " << tot << " buffers of " << settings.bs << " bytes, ring of " << tot_buffers
+        << " buffers, " << tot_output_file << " writers" << endl;
+    
+    for (int round=0; round<2; round++) {
+        for (int i=0; i<tot_buffers; i++) {
+            buffer[i].length = 0;
+            buffer[i].is_full = buffer[i].is_last = false;
+            buffer[i].is_empty = true;
+            for (int j=0; j<tot_output_file; j++)
+                buffer[i].already_write[j] = false;
+        }
+        if (round==1 && !ring.init(tot_buffers, tot_output_file)) {
+            cerr << program_name << ": error: unable to set up the lock-free handoff" << endl;
+            exit(1);
+        }
+        
+        pthread_t threads[1+tot_output_file];
+        int ids[tot_output_file];
+        struct timeval t_1;
+        gettimeofday(&t_1, NULL);
+        int64_t t1 = t_1.tv_sec*1000000+t_1.tv_usec;
+        
+        pthread_create(&threads[0], NULL, bench_read, (void *) &tot);
+        for (int j=0; j<tot_output_file; j++) {
+            ids[j] = j;
+            pthread_create(&threads[1+j], NULL, bench_write, (void *) &ids[j]);
+        }
+        for (int j=0; j<1+tot_output_file; j++)
+            pthread_join(threads[j], NULL);
+        
+        gettimeofday(&t_1, NULL);
+        int64_t diff = MAX(t_1.tv_sec*1000000+t_1.tv_usec-t1, 1);
+        cerr << "handoff=" << ((round) ? "lockfree" : "mutex   ") << ": " << (diff/1000000.0) << " sec., "
+            << (int64_t) (tot*1000000.0/diff) << " buffers/sec, "
+            << to_human_readable(tot*settings.bs*1000000.0/diff) << "B/sec" << endl;
+    }
+}
+
+/** hash-tree-verify=FILE: digest again the leaves of the input in the range
+    given by skip and count (default: all of it) and compare them with the
+    ones saved in FILE by hash-tree-save. Returns the exit code */
+int verify_tree() {
+    fastdd_tree saved;
+    if (!saved.load(settings.tree_verify_file_name.c_str())) {
+        cerr << program_name << ": error: hash-tree-verify: " << saved.get_error() << endl;
+        return 1;
+    }
+    if (!settings.input_file_name.length()) {
+        cerr << program_name << ": error: hash-tree-verify needs if=FILE" << endl;
+        return 1;
+    }
+    int fd = open(settings.input_file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << program_name << ": error: opening '" << settings.input_file_name << "' (" << strerror(errno) << ")" << endl;
+        return 1;
+    }
+    
+    int64_t leaf = saved.get_leaf_size();
+    int64_t length = saved.get_length();
+    int64_t from = settings.skip*settings.ibs;
+    int64_t to = (settings.count >= 0) ? MIN(from+settings.count*settings.ibs, length) : length;
+    uint64_t first = from/leaf;
+    uint64_t last = (to > from) ? (to-1)/leaf : first;
+    if (from > length || (from == length && length)) {
+        cerr << program_name << ": error: hash-tree-verify: the range starts after the end of the image (" << length << " bytes)" << endl;
+        return 1;
+    }
+    
+    int threads = settings.block_hash_threads;
+    if (!threads)
+        threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+    fastdd_tree check;
+    if (!check.init(saved.get_algorithm(), leaf, threads)) {
+        cerr << program_name << ": error: hash-tree-verify: " << check.get_error() << endl;
+        return 1;
+    }
+    
+    // a few leaves in flight per thread, each read in its own buffer; no
+    // leaf can be read past the end of the input, so no buffer is larger
+    int64_t buffer_size = MIN(leaf, length);
+    int64_t input_size = lseek(fd, 0, SEEK_END);
+    if (input_size >= 0)
+        buffer_size = MIN(buffer_size, input_size);
+    int tot_leaf_buffers = 2*threads;
+    vector<unsigned char *> leaf_buffers(tot_leaf_buffers);
+    for (int i=0; i<tot_leaf_buffers; i++)
+        leaf_buffers[i] = new unsigned char[buffer_size];
+    
+    for (uint64_t i=first; i<=last; i++) {
+        uint64_t seq = i-first;
+        if (seq >= (uint64_t) tot_leaf_buffers)
+            check.wait(seq - tot_leaf_buffers);
+        
+        unsigned char *data = leaf_buffers[seq % tot_leaf_buffers];
+        int64_t n = MIN(MIN(leaf, length - (int64_t) i*leaf), buffer_size), done = 0, r = 1;
+        while (done < n && r > 0) {
+            r = pread(fd, data+done, n-done, i*leaf+done);
+            if (r > 0) done += r;
+        }
+        if (r < 0 && settings.is_verbose)
+            settings.ofstream_log_file << "hash-tree-verify: read error at " << num2str(i*leaf+done, 16, 16, '0') << endl;
+        check.submit_leaf(i, data, done, seq);     // a short read does not match
+    }
+    check.finish();
+    close(fd);
+    
+    int64_t bad = 0;
+    for (uint64_t i=first; i<=last; i++) {
+        if (check.get_leaf(i) == saved.get_leaf(i))
+            continue;
+        bad++;
+        int64_t end = MIN((int64_t) (i+1)*leaf, length);
+        cerr << "leaf " << num2str(i, 10, 8, ' ') << ": " << num2str(i*leaf, 16, 16, '0') << "-"
+            << num2str(end, 16, 16, '0') << ": mismatch" << endl;
+        if (settings.is_verbose)
+            settings.ofstream_log_file << "hash-tree-verify: leaf " << i << " (" << num2str(i*leaf, 16, 16, '0') << "-"
+                << num2str(end, 16, 16, '0') << ") does not match" << endl;
+    }
+    
+    for (int i=0; i<tot_leaf_buffers; i++)
+        delete[] leaf_buffers[i];
+    
+    cerr << settings.input_file_name << ": " << (last-first+1) << " leaves of " << leaf << " bytes checked ("
+        << num2str(first*leaf, 16, 16, '0') << "-" << num2str(MIN((int64_t) (last+1)*leaf, length), 16, 16, '0') << "), "
+        << bad << " mismatching, tree-" << saved.get_algorithm() << " " << fastdd_tree::to_hex(saved.get_root()) << endl;
+    
+    return (bad) ? 1 : 0;
+}
+
+/** digest in memory buffers of bs bytes (1M if not given) for about a second
+    per algorithm of hash-files (default: a few common ones) */
+void benchmark_digests() {
+    unsigned char *data = (unsigned char *) malloc(settings.bs);
+    if (!data) {
+        cerr << program_name << ": error: unable to allocate " << settings.bs << " bytes" << endl;
+        exit(1);
+    }
+    srand(1);
+    for (int64_t i=0; i<settings.bs; i++)
+        data[i] = rand();
+    
+    int threads = settings.block_hash_threads;
+    if (!threads)
+        threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+    if (settings.is_parallel)
+        fastdd_digest::set_threads(threads);
+    cerr << "digest of buffers of " << settings.bs << " bytes, " << fastdd_digest::get_features() << endl;
+    
+    for (int i=0; i<settings.md_files.size(); i++) {
+        const fastdd_md_t *type = fastdd_digest::get_digestbyname(settings.md_files[i].c_str());
+        if (!type) {
+            cerr << settings.md_files[i] << ": unknown message digest" << endl;
+            continue;
+        }
+        
+        fastdd_md_ctx_t ctx;
+        unsigned char md_value[EVP_MAX_MD_SIZE];
+        unsigned int md_len;
+        fastdd_digest::ctx_init(&ctx);
+        fastdd_digest::digest_init(&ctx, type);
+        
+        struct timeval t_1;
+        gettimeofday(&t_1, NULL);
+        int64_t t1 = t_1.tv_sec*1000000+t_1.tv_usec, diff = 0, tot = 0;
+        while (diff < 1000000) {
+            fastdd_digest::digest_update(&ctx, data, settings.bs);
+            tot += settings.bs;
+            gettimeofday(&t_1, NULL);
+            diff = t_1.tv_sec*1000000+t_1.tv_usec-t1;
+        }
+        fastdd_digest::digest_final(&ctx, md_value, &md_len);
+        
+        cerr << setw(12) << setfill(' ') << left << settings.md_files[i] << right << ": "
+            << setprecision(3) << fixed << (tot/1000.0/diff) << " GB/sec ("
+            << to_human_readable(tot) << "B in " << (diff/1000000.0) << " sec.)" << endl;
+        cerr.unsetf(ios_base::floatfield);
+        cerr << setprecision(6);
+    }
+    
+    free(data);
+}
+
 void final_stat() {
     if (settings.is_progress_bar) {
         cerr << endl;
@@ -1878,8 +3534,22 @@ void final_stat() {
     
     struct timeval t_2;
     gettimeofday(&t_2, NULL);
-    int64_t diff = t_2.tv_sec*1000000+t_2.tv_usec-t_start;
+    int64_t now = t_2.tv_sec*1000000+t_2.tv_usec;
+    int64_t diff = now-t_start;
     cerr << fi_common->byte_read << " bytes read, " << (diff/1000000.0) << " sec., " << to_human_readable(fi_common->byte_read*1000000.0/diff) << "B/sec" <<endl;
+    
+    // every output runs at its own speed
+    for (int i=0; i<tot_output_file; i++) {
+        int64_t diff_o = ((fo_common[i].t_end) ? fo_common[i].t_end : now) - t_start;
+        if (diff_o <= 0) diff_o = 1;
+        cerr << fo_common[i].file_name << ": " << fo_common[i].byte_written << " bytes written, " << (diff_o/1000000.0) << " sec., "
+            << to_human_readable(fo_common[i].byte_written*1000000.0/diff_o) << "B/sec";
+        if (fo_common[i].spill_fd >= 0)
+            cerr << ", up to " << fo_common[i].spill_max << " bytes spilled";
+        if (fo_common[i].is_sparse)
+            cerr << ", " << fo_common[i].byte_elided << " bytes elided";
+        cerr << endl;
+    }
 }
 
 void on_ctrlc(int sig) {
@@ -1901,9 +3571,17 @@ void init_modules() {
     temp = (fastdd_module *)temp_conv;
     modules.push_back(temp);
     
-    fastdd_module_gzip *temp_gzip = new fastdd_module_gzip(&settings, (buffer_t *) &buffer[0]);
+    fastdd_module_gzip *temp_gzip = new fastdd_module_gzip(&settings);
     temp = (fastdd_module *)temp_gzip;
     modules.push_back(temp);
+    
+    fastdd_module_zstd *temp_zstd = new fastdd_module_zstd(&settings);
+    temp = (fastdd_module *)temp_zstd;
+    modules.push_back(temp);
+    
+    fastdd_module_lz4 *temp_lz4 = new fastdd_module_lz4(&settings);
+    temp = (fastdd_module *)temp_lz4;
+    modules.push_back(temp);
 }
 
 void fin_modules() {
@@ -1933,15 +3611,147 @@ int main(int argc, char *argv[]) {
     init_read_arguments_settings(argc, argv);
     
     OpenSSL_add_all_digests();
+    fastdd_digest::init();
+    
+    if (settings.is_benchmark_digests) {
+        benchmark_digests();
+        exit(0);
+    }
+    
+    if (settings.is_benchmark_handoff) {
+        benchmark_handoff();
+        exit(0);
+    }
+    
+    if (settings.tree_verify_file_name.length())
+        exit(verify_tree());
     
     init_buffers();
     
     fi_common = init_input_file();
+    
+    // for small copies starting the threads costs more than the copy itself
+    if (settings.is_parallel) {
+        int64_t to_copy = fi_common->byte_to_read;
+        if (fi_common->total_size_in_byte >= 0) {
+            int64_t rest = fi_common->total_size_in_byte - fi_common->skip_in_byte;
+            to_copy = (to_copy < 0) ? rest : MIN(to_copy, rest);
+        }
+        if (to_copy >= 0 && to_copy < settings.parallel_threshold) {
+            settings.is_parallel = false;
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "only " << to_copy << " bytes to copy, no threads used" << endl;
+        }
+    }
     fo_common = init_output_file();
     
     fin_modules();
     
+    // views of the mapping are read-only: only modules that do not change the data can see them
+    // and only while all the buffers can be locked in memory at once
+    if (settings.engine == ENGINE_MMAP) {
+        mmap_views = !modules_change_data();
+        const char *why = "modules change the data";
+        struct rlimit memlock;
+        if (mmap_views && geteuid() && !getrlimit(RLIMIT_MEMLOCK, &memlock) && memlock.rlim_cur != RLIM_INFINITY
+                && memlock.rlim_cur < (rlim_t) settings.bs * tot_buffers) {
+            mmap_views = false;
+            why = "RLIMIT_MEMLOCK is lower than the buffer ring";
+        }
+        if (settings.is_verbose) {
+            if (mmap_views)
+                settings.ofstream_log_file << "engine=mmap: buffers are views of the input" << endl;
+            else
+                settings.ofstream_log_file << "engine=mmap: mapped data copied in the buffers (" << why << ")" << endl;
+        }
+    }
+    
+    int writers = tot_output_file;
+    if (settings.is_clone) {
+        init_clones(fi_common, fo_common);
+        writers = 0;
+        for (int i=0; i<tot_output_file; i++)
+            if (fo_common[i].clone_of == CLONE_NONE) writers++;
+    }
+    
+    // when nothing looks at the data the kernel can copy it by itself
+    if (settings.engine == ENGINE_AUTO || settings.engine == ENGINE_ZERO_COPY) {
+        string obstacle = zero_copy_obstacle();
+        if (obstacle.length()) {
+            if (settings.is_verbose && settings.engine == ENGINE_ZERO_COPY)
+                settings.ofstream_log_file << "engine=zero-copy not possible (" << obstacle << "), using read()" << endl;
+            settings.engine = ENGINE_READ;
+        }
+        else
+            settings.engine = ENGINE_ZERO_COPY;
+    }
+    
+    // the file digests of the input run in their own threads, next to the reader
+    if (settings.is_parallel && settings.is_md_file_in && fi_common->tot_digests) {
+        fi_common->hash_pool = new fastdd_hash_pool();
+        if (!fi_common->hash_pool->init(fi_common->ctx, fi_common->tot_digests)) {
+            delete fi_common->hash_pool;
+            fi_common->hash_pool = NULL;
+        }
+    }
+    
+    if (settings.is_parallel && (settings.is_md_blocks_save || settings.is_md_blocks_check)) {
+        int threads = settings.block_hash_threads;
+        if (!threads)
+            threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+        block_hasher = new fastdd_block_hasher();
+        if (!block_hasher->init(threads, settings.md_blocks, settings.ibs, &settings.ofstream_md)) {
+            delete block_hasher;
+            block_hasher = NULL;
+        }
+        else if (settings.is_verbose)
+            settings.ofstream_log_file << "block digests on " << threads << " threads" << endl;
+    }
+    
+    // BLAKE3 spreads big updates on the threads
     if (settings.is_parallel) {
+        int threads = settings.block_hash_threads;
+        if (!threads)
+            threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+        fastdd_digest::set_threads(threads);
+    }
+    if (settings.is_verbose) {
+        settings.ofstream_log_file << "digests: " << fastdd_digest::get_features() << endl;
+        if (settings.is_md_blocks_save)
+            settings.ofstream_log_file << "block digests: " << fastdd_multihash::get_features() << endl;
+    }
+    
+    if (settings.md_tree.length()) {
+        int threads = settings.block_hash_threads;
+        if (!threads)
+            threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+        tree_hasher = new fastdd_tree();
+        if (!tree_hasher->init(settings.md_tree, settings.tree_leaf, threads)) {
+            cerr << program_name << ": error: hash-tree: " << tree_hasher->get_error() << endl;
+            exit(1);
+        }
+    }
+    
+    if (!writers) {
+        clone_only(fi_common);
+    }
+    else if (settings.engine == ENGINE_ZERO_COPY) {
+        int i = 0;
+        while (fo_common[i].clone_of != CLONE_NONE) i++;
+        zero_copy(fi_common, fo_common+i);
+    }
+    else if (settings.is_parallel) {
+        if (settings.handoff == HANDOFF_LOCKFREE && !ring.init(tot_buffers, tot_output_file)) {
+            if (settings.is_verbose)
+                settings.ofstream_log_file << "unable to set up the lock-free handoff, using handoff=mutex" << endl;
+            settings.handoff = HANDOFF_MUTEX;
+        }
+        for (int i=0; i<tot_output_file; i++)
+            if (fo_common[i].clone_of != CLONE_NONE && ring.is_ready())
+                ring.leave(i);      // no writer for it
+        
+        init_stage();
+        
         pthread_t threads[1+tot_output_file];
         pthread_attr_t attr;
 
@@ -1953,8 +3763,9 @@ int main(int argc, char *argv[]) {
         //cerr << "input thread started\n";
         
         for (int i=0; i<tot_output_file; i++) {
+            if (fo_common[i].clone_of != CLONE_NONE) continue;
             //cerr << "starting " << fo[i].file_name << endl;
-            for (int j=0; j<TOT_BUFFERS; j++)
+            for (int j=0; j<tot_buffers; j++)
                 buffer[j].writer_active++;
             pthread_create(&threads[1+i], &attr, thread_write, (void *) (fo_common+i));
         }
@@ -1962,14 +3773,38 @@ int main(int argc, char *argv[]) {
         
         // attendo che tutti finiscano
         for (int i=0; i<1+tot_output_file; i++) {
+            if (i && fo_common[i-1].clone_of != CLONE_NONE) continue;
             pthread_join(threads[i], NULL);
         }
+        stage.finish();
     }
     else {
         //cerr << "no_parallel" << endl;
         no_parallel(fi_common, fo_common);
     }
     
+    if (fi_common->hash_pool)
+        fi_common->hash_pool->finish();
+    if (block_hasher)
+        block_hasher->finish();
+    if (tree_hasher)
+        tree_hasher->finish();
+    if (!input_index.finish()) {
+        cerr << program_name << ": error: if-gzip-index: " << input_index.get_error() << endl;
+        exit(1);
+    }
+    if (!decoder.finish()) {
+        cerr << program_name << ": error: decode: " << decoder.get_error() << endl;
+        exit(1);
+    }
+    if (settings.decode.length() && settings.is_verbose)
+        settings.ofstream_log_file << "input decoded as " << decoder.get_format() << endl;
+    if (mmap_copies && settings.is_verbose)
+        settings.ofstream_log_file << "engine=mmap: " << mmap_copies << " buffers copied, their views could not be locked" << endl;
+    
+    if (settings.is_clone)
+        fin_clones(fi_common, fo_common);
+    
     if (settings.is_progress_bar) {
         cerr << endl;
     }
@@ -1978,7 +3813,7 @@ int main(int argc, char *argv[]) {
     
     if (settings.is_md_file_in) {
         for (int i1=0; i1<fi_common->tot_digests; i1++) {
-            EVP_DigestFinal_ex(&fi_common->ctx[i1], fi_common->hash[i1], &fi_common->hash_len[i1]);
+            fastdd_digest::digest_final(&fi_common->ctx[i1], fi_common->hash[i1], &fi_common->hash_len[i1]);
 
             stringstream ss;
             for (int i2=0; i2<fi_common->hash_len[i1]; i2++)
@@ -1990,10 +3825,22 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (tree_hasher) {
+        string root = fastdd_tree::to_hex(tree_hasher->get_root());
+        if (settings.is_verbose)
+            settings.ofstream_log_file << root << " - tree-" << settings.md_tree << " - " << fi_common->file_name << endl;
+        cerr << root << " - tree-" << settings.md_tree << " - " << fi_common->file_name << endl;
+        
+        if (settings.tree_file_name.length() && !tree_hasher->save(settings.tree_file_name.c_str())) {
+            cerr << program_name << ": error: hash-tree-save: " << tree_hasher->get_error() << endl;
+            exit(1);
+        }
+    }
+    
     if (settings.is_md_files_out) {
         for (int i=0; i<tot_output_file; i++) {
             for (int i1=0; i1<fo_common[i].tot_digests; i1++) {
-                EVP_DigestFinal_ex(&fo_common[i].ctx[i1], fo_common[i].hash[i1], &fo_common[i].hash_len[i1]);
+                fastdd_digest::digest_final(&fo_common[i].ctx[i1], fo_common[i].hash[i1], &fo_common[i].hash_len[i1]);
                 stringstream ss;
                 for (int i2=0; i2<fo_common[i].hash_len[i1]; i2++)
                     ss << setw(2) << setfill('0') << setbase(16) << (unsigned int) fo_common[i].hash[i1][i2];
@@ -2028,6 +3875,12 @@ int main(int argc, char *argv[]) {
                 << "  " << partition_types[temp_pm[a].type] << endl;
         }
     }
+    
+    // an output whose written data could not be re-read or did not match
+    for (int i=0; i<tot_output_file; i++)
+        if (fo_common[i].verify_failed)
+            return 1;
+    return 0;
 }
 
 void help() {
@@ -2065,13 +3918,90 @@ void help() {
     cout << "   hash-blocks=ALGORITHM1[,ALGORITHM2,...]\n";
     cout << "      use the specified hash algorithms to check input and output blocks\n";
     cout << "   hash-files=ALGORITHM1[,ALGORITHM2,...]\n";
-    cout << "      use the specified hash algorithms to check input and output files\n";
+    cout << "      use the specified hash algorithms to check input and output files.\n";
+    cout << "      Unless --no-parallel is used, every algorithm runs in its own thread\n";
+    cout << "      Besides the OpenSSL digests, these lists accept blake3 (on SIMD lanes\n";
+    cout << "      and, for big buffers, on block-hash-threads threads), xxh3-128 and\n";
+    cout << "      crc32c (SSE4.2 if the CPU has it)\n";
     cout << "   hash-blocks-save=FILE\n";
     cout << "      save in FILE the hash of the input blocks\n";
+    cout << "      md5 (sha1 and sha256 too with AVX2 or AVX-512) digests many blocks\n";
+    cout << "      at once, one per SIMD lane\n";
+    cout << "   hash-tree=ALGORITHM[,leaf=SIZE]\n";
+    cout << "      compute also a tree (Merkle) hash of the input: the digests of its\n";
+    cout << "      leaves of SIZE bytes (default: 1M) are computed in parallel, on the\n";
+    cout << "      threads of block-hash-threads, and combined in a root hash\n";
+    cout << "   hash-tree-save=FILE\n";
+    cout << "      save the tree of hash-tree in FILE, to check any part of the copy later\n";
+    cout << "      with hash-tree-verify\n";
+    cout << "   hash-tree-verify=FILE\n";
+    cout << "      do not copy: digest again the leaves of if= in the range given by skip\n";
+    cout << "      and count (default: all the image) and compare them with the tree saved\n";
+    cout << "      in FILE. The mismatching leaves are printed, exit status 1 if any\n";
+    cout << "   if-gzip-index=FILE\n";
+    cout << "      if= is a gzip image written with gzip-index=FILE: only the members that\n";
+    cout << "      hold the bytes selected by skip and count are decompressed and copied\n";
+    cout << "   decode=FORMAT\n";
+    cout << "      if= (or stdin) is compressed in FORMAT (gzip, zstd, lz4 or auto, that\n";
+    cout << "      finds it out and copies the data as it is if it is none of them): it is\n";
+    cout << "      decompressed by a thread and skip, count, hashes and modules work on its\n";
+    cout << "      data. gzip members, zstd frames and LZ4 independent blocks are\n";
+    cout << "      decompressed in parallel\n";
+    cout << "   decode-threads=N\n";
+    cout << "      threads decompressing the blocks of decode (default: one per CPU, not\n";
+    cout << "      used with --no-parallel)\n";
+    cout << "   buffers=N\n";
+    cout << "      number of buffers in the ring between reader and writers (default: 2).\n";
+    cout << "      More buffers absorb bursts of latency at the price of N*bs bytes of memory\n";
+    cout << "   spill-dir=DIR\n";
+    cout << "      enable fan-out mode: when an output is too slow to keep up with the\n";
+    cout << "      others, the buffers it still has to write are moved in a scratch file\n";
+    cout << "      created in DIR, so the faster outputs are not throttled (not used with\n";
+    cout << "      --no-parallel). Without spill-dir every output is written at the pace of\n";
+    cout << "      the slowest one\n";
+    cout << "   max-lag=BYTES\n";
+    cout << "      the maximum amount of data an output can keep in its scratch file\n";
+    cout << "      (default: unlimited). Beyond it the reader waits. It needs spill-dir\n";
+    cout << "   engine=ENGINE\n";
+    cout << "      how the data is moved: 'read' uses one read() at time, 'uring' keeps\n";
+    cout << "      queue-depth reads in flight with io_uring (regular files and block\n";
+    cout << "      devices only, otherwise 'read' is used), 'mmap' maps the input (same\n";
+    cout << "      limits) and passes to hashes, writers and regex searches views of it,\n";
+    cout << "      without copies while their pages can be locked in memory (ulimit -l;\n";
+    cout << "      modules that change the data get a copy); unreadable pages are read\n";
+    cout << "      again as bad blocks. 'zero-copy' lets the kernel copy\n";
+    cout << "      the data (copy_file_range, sendfile or splice) without buffers. It needs\n";
+    cout << "      one output, no hashes, no partition table and no modules, otherwise\n";
+    cout << "      'read' is used. 'auto' (default) is 'zero-copy' when possible, else 'read'\n";
+    cout << "      With 'read' and 'uring' the holes of a sparse input file are not read,\n";
+    cout << "      their zeros are made up in memory\n";
+    cout << "   queue-depth=N\n";
+    cout << "      number of reads kept in flight by engine=uring (default: 8)\n";
+    cout << "   block-hash-threads=N\n";
+    cout << "      threads computing the block digests of hash-blocks-save and\n";
+    cout << "      --hash-blocks-check (default: one per CPU, not used with --no-parallel)\n";
+    cout << "      and the leaves of hash-tree\n";
+    cout << "   module-threads=N\n";
+    cout << "      threads running the modules between the reader and the writers, so the\n";
+    cout << "      reader does not wait for them (default: one per CPU, not used with\n";
+    cout << "      --no-parallel). A module that keeps a state (like the compressions) works\n";
+    cout << "      on a buffer at time, the others (conversions) on many: give them buffers=\n";
+    cout << "      The modules that only read the data (regex) run at the same time as the\n";
+    cout << "      writers, when no module after them changes it\n";
+    cout << "   parallel-threshold=BYTES\n";
+    cout << "      inputs smaller than BYTES are copied by a single thread, as with\n";
+    cout << "      --no-parallel (default: 4M, 0 to always use threads)\n";
+    cout << "   handoff=HANDOFF\n";
+    cout << "      how the buffers pass from the reader to the writers: 'lockfree' (default)\n";
+    cout << "      uses atomic sequence numbers and sleeps only when a side has to wait,\n";
+    cout << "      'mutex' locks every buffer. spill-dir always uses 'mutex'\n";
     cout << "\nOPTIONS\n";
     cout << "   --hash-blocks-check, -c\n";
     cout << "      re-read every written block and check its hashes with the corrisponding\n" <<
-            "      input block. Exit on re-reading error\n";
+            "      input block. Exit on re-reading error. With threads the blocks are\n" <<
+            "      re-read (O_DIRECT if possible) by a thread per output, a few blocks\n" <<
+            "      behind the writer, so the copy goes on while they are checked. Exit\n" <<
+            "      status 1 if a block of an output could not be re-read or did not match\n";
     cout << "   --hash-file-in\n";
     cout << "      print hashes of input file at the end of computation\n";
     cout << "   --hash-file-out\n";
@@ -2088,11 +4018,27 @@ void help() {
     cout << "      same as 'reading-attempts=0 bs=16M'\n";
     cout << "   --no-parallel, -p\n";
     cout << "      make every read/write action sequentially, without using multi-threading\n";
+    cout << "   --sparse\n";
+    cout << "      do not write the output blocks (obs bytes) made only of zeros, leave holes\n";
+    cout << "      in the output files instead (regular files only). Hashes still see zeros\n";
+    cout << "   --clone\n";
+    cout << "      on filesystems that share extents (btrfs, XFS...) reflink the input in the\n";
+    cout << "      outputs instead of copying it. When it is not possible (block hashes,\n";
+    cout << "      modules, different filesystems...) the first output is written and the\n";
+    cout << "      others on its filesystem are reflinked from it. File hashes are computed\n";
+    cout << "      once. Without reflink support the copy is done as usual\n";
     cout << "   --no-progress-bar\n";
     cout << "      disable progress bar\n";
     cout << "   --ignore-modules-errors\n";
     cout << "      ignore errors occurred in the execution of modules (otherwise it asks how\n";
     cout << "      to procede, stopping the copy until an answer is given)\n";
+    cout << "   --benchmark-handoff\n";
+    cout << "      measure how fast the two handoffs move count buffers of bs bytes (no I/O\n";
+    cout << "      is done, of= only sets the number of writers) and exit\n";
+    cout << "   --benchmark-digests\n";
+    cout << "      measure how many GB/sec every algorithm of hash-files (default: md5,\n";
+    cout << "      sha1, sha256, sha512, blake2b512, blake3, xxh3-128, crc32c) digests on\n";
+    cout << "      this CPU, with in memory buffers of bs bytes (default: 1M), and exit\n";
     cout << "   --debug\n";
     cout << "      debug mode, it is ignored if a log file is not specified.\n";
     cout << "   --help, -h\n";
@@ -2104,6 +4050,9 @@ void help() {
     cout << "   fastdd's capabilities can be easily expanded by createing a new module" << endl;
     cout << "   implementing fastdd_module.hpp interface, and adding it to the main program" << endl;
     cout << "   with few code lines in init_modules() and fin_modules() functions." << endl;
+    cout << "   Modules of API v2 (get_api_version() returns 2) do not change the buffer in" << endl;
+    cout << "   place: transform_to() writes their output, of any size, in a buffer taken from" << endl;
+    cout << "   a pool of the pipeline, that replaces the input one." << endl;
     cout << "   Here the actually available modules.\n" << endl;
 
     for (int a=0; a<modules.size(); a++) {
@@ -0,0 +1,101 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_BUFFER_POOL_H
+    #define _FASTDD_BUFFER_POOL_H
+
+#include <vector>
+#include <cstdlib>
+#include <stdint.h>
+#include <pthread.h>
+
+using namespace std;
+
+/** Aligned buffers owned by the pipeline, where the modules of API v2 write
+ *  their output. The buffer given to a module takes the place of the one of
+ *  the ring it transformed, and that one comes back here: so the pool holds
+ *  only the buffers in flight between the modules, and the ring buffers can
+ *  grow (up to what the modules need) without being reallocated. */
+class fastdd_buffer_pool {
+    private:
+    typedef struct {
+        unsigned char *data;
+        uint64_t capacity;
+    } entry_t;
+    
+    vector<entry_t> free_buffers;
+    uint64_t min_size;          // no buffer is smaller (bs: they go in the ring)
+    pthread_mutex_t mutex;
+    
+    public:
+    
+    fastdd_buffer_pool() {
+        min_size = 0;
+        pthread_mutex_init(&mutex, NULL);
+    }
+    
+    void init(uint64_t min_size_) { min_size = min_size_; }
+    
+    /** a buffer of at least size bytes (its capacity in *capacity), NULL if
+     *  there is no memory */
+    unsigned char *get(uint64_t size, uint64_t *capacity) {
+        if (size < min_size)
+            size = min_size;
+        
+        pthread_mutex_lock(&mutex);
+        int best = -1;
+        for (int i=0; i<free_buffers.size(); i++)
+            if (free_buffers[i].capacity >= size && (best < 0 || free_buffers[i].capacity < free_buffers[best].capacity))
+                best = i;
+        if (best >= 0) {
+            unsigned char *data = free_buffers[best].data;
+            *capacity = free_buffers[best].capacity;
+            free_buffers[best] = free_buffers.back();
+            free_buffers.pop_back();
+            pthread_mutex_unlock(&mutex);
+            return data;
+        }
+        pthread_mutex_unlock(&mutex);
+        
+        // rounded up, so a slightly bigger request later can use it
+        size = (size + 65535) & ~(uint64_t) 65535;
+        unsigned char *data;
+        if (posix_memalign((void **) &data, 512, size))
+            return NULL;
+        *capacity = size;
+        return data;
+    }
+    
+    /** give back a buffer (from the pool or from the ring) */
+    void put(unsigned char *data, uint64_t capacity) {
+        pthread_mutex_lock(&mutex);
+        entry_t e = { data, capacity };
+        free_buffers.push_back(e);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    ~fastdd_buffer_pool() {
+        for (int i=0; i<free_buffers.size(); i++)
+            free(free_buffers[i].data);
+    }
+};
+
+#endif
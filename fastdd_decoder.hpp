@@ -0,0 +1,699 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_DECODER_H
+    #define _FASTDD_DECODER_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <lz4.h>
+#include "fastdd_module_lz4.hpp"
+
+using namespace std;
+
+#define DECODER_READ (1<<20)    // bytes of the image read at time
+#ifndef DECODER_BATCH
+#define DECODER_BATCH (4<<20)   // compressed bytes for every thread in a batch of gzip members or zstd frames
+#endif
+#define DECODER_UNIT_MAX (256<<20)  // data of a member (or frame) decoded on a thread, the bigger ones are streamed
+#define DECODER_CHUNK (1<<18)   // data passed on at time by the stream decoders
+
+/** Input decode stage (decode=FORMAT): a thread reads the compressed image
+ *  and writes the data it holds in a socket, that the reader of fastdd reads
+ *  as a stream; skip and count are in bytes of the data. With decode=auto the
+ *  format (gzip, zstd or lz4, else the data is passed on as it is) is taken
+ *  from the first bytes of the image.
+ *
+ *  What can be decompressed on its own is decompressed at the same time by a
+ *  pool of threads: LZ4 independent blocks, zstd frames (their size is in
+ *  their blocks headers) and gzip members. The members of a gzip image are
+ *  found looking for their headers: a guess is right when the data before it
+ *  ends exactly there (with the right CRC), otherwise the image is decoded as
+ *  a stream till the end of the member, as it is done for the members (or
+ *  frames) too big for a batch. */
+class fastdd_decoder {
+    private:
+    typedef struct {
+        vector<unsigned char> in;
+        int in_len;
+        bool is_stored;
+        vector<unsigned char> out;
+        int out_len;
+    } block_t;
+    
+    // a gzip member or zstd frame (or more of them), a slice of the batch
+    typedef struct {
+        size_t from, to;
+        vector<unsigned char> out;
+        size_t out_len;
+        bool is_ok;             // decoded and ended exactly at 'to'
+    } unit_t;
+    
+    string format;
+    int image_fd;
+    int sock[2];                // the thread writes in sock[1], fastdd reads sock[0]
+    uint64_t skip;              // bytes of data not to write
+    int64_t to_write;           // -1: till the end
+    pthread_t thread;
+    bool is_running;
+    
+    // the image is read in order, DECODER_READ bytes at time
+    vector<unsigned char> in;
+    size_t in_pos, in_len;
+    
+    // pool of block (or unit) decoders
+    int tot_threads;
+    vector<pthread_t> threads;
+    vector<block_t> blocks;
+    vector<unit_t> units;
+    vector<unsigned char> batch;    // the units are slices of it
+    int tot_jobs, next_job, jobs_done;
+    int block_max;
+    
+    // stream decoding of a member (or frame)
+    z_stream zs;
+    ZSTD_DCtx *zd;
+    bool is_open;
+    bool is_stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // blocks to decode (or stop)
+    pthread_cond_t done;        // all the blocks are decoded
+    
+    string errore;
+    
+    static void *run(void *arg) {
+        fastdd_decoder *d = (fastdd_decoder *) arg;
+        if (!d->format.compare("auto"))
+            d->format = d->detect();
+        if (!d->format.compare("lz4"))
+            d->decode_lz4();
+        else if (!d->format.compare("gzip") || !d->format.compare("zstd"))
+            d->decode_frames();
+        else
+            d->decode_raw();
+        close(d->sock[1]);      // end of data for the reader
+        d->stop_threads();
+        return NULL;
+    }
+    
+    static void *run_worker(void *arg) {
+        fastdd_decoder *d = (fastdd_decoder *) arg;
+        
+        pthread_mutex_lock(&d->mutex);
+        while (true) {
+            while (d->next_job == d->tot_jobs && !d->is_stop)
+                pthread_cond_wait(&d->work, &d->mutex);
+            if (d->is_stop)
+                break;
+            int job = d->next_job++;
+            pthread_mutex_unlock(&d->mutex);
+            
+            d->decode_job(job);
+            
+            pthread_mutex_lock(&d->mutex);
+            if (++d->jobs_done == d->tot_jobs)
+                pthread_cond_broadcast(&d->done);
+        }
+        pthread_mutex_unlock(&d->mutex);
+        
+        return NULL;
+    }
+    
+    void decode_job(int job) {
+        if (!format.compare("lz4"))
+            decode_block(&blocks[job], NULL, 0);
+        else
+            decode_unit(&units[job]);
+    }
+    
+    /** decode tot jobs, on the threads if there are */
+    void run_jobs(int tot) {
+        if (threads.size() && tot > 1) {
+            pthread_mutex_lock(&mutex);
+            tot_jobs = tot;
+            next_job = jobs_done = 0;
+            pthread_cond_broadcast(&work);
+            while (jobs_done < tot_jobs)
+                pthread_cond_wait(&done, &mutex);
+            pthread_mutex_unlock(&mutex);
+        }
+        else {
+            for (int i=0; i<tot; i++)
+                decode_job(i);
+        }
+    }
+    
+    void stop_threads() {
+        pthread_mutex_lock(&mutex);
+        is_stop = true;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+        for (int i=0; i<threads.size(); i++)
+            pthread_join(threads[i], NULL);
+        threads.clear();
+    }
+    
+    /** exactly n bytes of the image in dest (NULL: skip them); false at its end */
+    bool get(void *dest, size_t n) {
+        unsigned char *p = (unsigned char *) dest;
+        while (n) {
+            if (in_pos == in_len) {
+                ssize_t got = read(image_fd, &in[0], DECODER_READ);
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got <= 0) {
+                    if (got < 0)
+                        errore = string("reading the image (") + strerror(errno) + ")";
+                    return false;
+                }
+                in_pos = 0;
+                in_len = got;
+            }
+            size_t t = (in_len-in_pos < n) ? in_len-in_pos : n;
+            if (p) {
+                memcpy(p, &in[in_pos], t);
+                p += t;
+            }
+            in_pos += t;
+            n -= t;
+        }
+        return true;
+    }
+    
+    /** up to n bytes of the image in dest: 0 at its end, -1 on error */
+    ssize_t take(unsigned char *dest, size_t n) {
+        if (in_pos < in_len) {
+            size_t t = (in_len-in_pos < n) ? in_len-in_pos : n;
+            memcpy(dest, &in[in_pos], t);
+            in_pos += t;
+            return t;
+        }
+        while (true) {
+            ssize_t got = read(image_fd, dest, n);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                errore = string("reading the image (") + strerror(errno) + ")";
+            return got;
+        }
+    }
+    
+    /** the format of the image, from its first bytes (they are not taken) */
+    string detect() {
+        while (in_len < 4) {
+            ssize_t got = read(image_fd, &in[in_len], DECODER_READ-in_len);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            in_len += got;
+        }
+        if (in_len >= 2 && in[0] == 0x1f && in[1] == 0x8b)
+            return "gzip";
+        if (in_len >= 4 && in[0] == 0x28 && in[1] == 0xb5 && in[2] == 0x2f && in[3] == 0xfd)
+            return "zstd";
+        if (in_len >= 4 && in[0] == 0x04 && in[1] == 0x22 && in[2] == 0x4d && in[3] == 0x18)
+            return "lz4";
+        return "raw";
+    }
+    
+    bool get32(uint32_t *v) {
+        unsigned char b[4];
+        if (!get(b, 4)) return false;
+        *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+        return true;
+    }
+    
+    /** decompress a block, with the data before it as dictionary (NULL: an
+     *  independent block); out_len < 0 on error */
+    void decode_block(block_t *b, const unsigned char *dict, int dict_len) {
+        if (b->is_stored) {
+            b->out.swap(b->in);
+            b->out_len = b->in_len;
+            return;
+        }
+        b->out.resize(block_max);
+        if (dict)
+            b->out_len = LZ4_decompress_safe_usingDict((const char *) &b->in[0], (char *) &b->out[0], b->in_len, block_max,
+                (const char *) dict, dict_len);
+        else
+            b->out_len = LZ4_decompress_safe((const char *) &b->in[0], (char *) &b->out[0], b->in_len, block_max);
+    }
+    
+    /** decode a unit on its own: it must end exactly at its end */
+    void decode_unit(unit_t *u) {
+        const unsigned char *p = &batch[u->from];
+        size_t len = u->to - u->from;
+        u->is_ok = false;
+        u->out_len = 0;
+        if (u->out.size() < 4*len)
+            u->out.resize(4*len);
+        
+        if (!format.compare("gzip")) {
+            z_stream z;
+            z.zalloc = Z_NULL;
+            z.zfree = Z_NULL;
+            z.opaque = Z_NULL;
+            z.next_in = (Bytef *) p;
+            z.avail_in = len;
+            if (inflateInit2(&z, 16+15) != Z_OK)
+                return;
+            int ret = Z_OK;
+            while (true) {
+                if (u->out_len == u->out.size()) {
+                    if (u->out.size() >= DECODER_UNIT_MAX) break;
+                    u->out.resize(2*u->out.size());
+                }
+                z.next_out = &u->out[u->out_len];
+                z.avail_out = u->out.size() - u->out_len;
+                ret = inflate(&z, Z_NO_FLUSH);
+                u->out_len = u->out.size() - z.avail_out;
+                if (ret == Z_STREAM_END && z.avail_in)      // the next member
+                    ret = inflateReset(&z);
+                else if (ret != Z_OK)
+                    break;
+            }
+            inflateEnd(&z);
+            u->is_ok = (ret == Z_STREAM_END && !z.avail_in);
+        }
+        else {
+            ZSTD_DCtx *d = ZSTD_createDCtx();
+            if (!d) return;
+            ZSTD_inBuffer zin = { p, len, 0 };
+            size_t ret = 1;
+            while (true) {
+                if (u->out_len == u->out.size()) {
+                    if (u->out.size() >= DECODER_UNIT_MAX) break;
+                    u->out.resize(2*u->out.size());
+                }
+                ZSTD_outBuffer zout = { &u->out[0], u->out.size(), u->out_len };
+                ret = ZSTD_decompressStream(d, &zout, &zin);
+                u->out_len = zout.pos;
+                if (ZSTD_isError(ret) || (zin.pos == zin.size && zout.pos < zout.size))
+                    break;
+            }
+            ZSTD_freeDCtx(d);
+            u->is_ok = (!ret && zin.pos == zin.size);
+        }
+    }
+    
+    /** where the unit starting at 'from' of the batch ends (0: not known) */
+    size_t next_boundary(size_t from) {
+        size_t len = batch.size();
+        if (!format.compare("zstd")) {
+            size_t size = ZSTD_findFrameCompressedSize(&batch[from], len-from);
+            return (ZSTD_isError(size)) ? 0 : from+size;
+        }
+        
+        // the next gzip header: ID, deflate, no reserved flags, known extra flags and OS
+        for (size_t i=from+20; i+10 <= len; i++) {
+            const unsigned char *h = (const unsigned char *) memchr(&batch[i], 0x1f, len-10-i+1);
+            if (!h) break;
+            i = h - &batch[0];
+            if (h[1] == 0x8b && h[2] == 8 && !(h[3] & 0xe0) && (h[8] == 0 || h[8] == 2 || h[8] == 4) && (h[9] <= 13 || h[9] == 255))
+                return i;
+        }
+        return 0;
+    }
+    
+    void stream_open() {
+        if (!format.compare("gzip")) {
+            inflateEnd(&zs);
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            zs.next_in = Z_NULL;
+            zs.avail_in = 0;
+            inflateInit2(&zs, 16+15);
+        }
+        else {
+            if (!zd) zd = ZSTD_createDCtx();
+            ZSTD_DCtx_reset(zd, ZSTD_reset_session_only);
+        }
+        is_open = true;
+    }
+    
+    /** go on decoding the open member (or frame) with len bytes of p, till it
+     *  ends: *used are the bytes taken. -1 on error (or when nothing more is
+     *  needed), 1 at the end of the member, else 0 */
+    int stream(const unsigned char *p, size_t len, size_t *used) {
+        vector<unsigned char> out(DECODER_CHUNK);
+        *used = 0;
+        
+        if (!format.compare("gzip")) {
+            zs.next_in = (Bytef *) p;
+            zs.avail_in = len;
+            int ret;
+            do {
+                zs.next_out = &out[0];
+                zs.avail_out = DECODER_CHUNK;
+                ret = inflate(&zs, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    errore = string("corrupted gzip data (") + ((zs.msg) ? zs.msg : "inflate error") + ")";
+                    return -1;
+                }
+                if (!emit(&out[0], DECODER_CHUNK - zs.avail_out))
+                    return -1;
+            } while (ret != Z_STREAM_END && (zs.avail_in || !zs.avail_out));
+            *used = len - zs.avail_in;
+            return (ret == Z_STREAM_END) ? 1 : 0;
+        }
+        
+        ZSTD_inBuffer zin = { p, len, 0 };
+        while (true) {
+            ZSTD_outBuffer zout = { &out[0], DECODER_CHUNK, 0 };
+            size_t ret = ZSTD_decompressStream(zd, &zout, &zin);
+            if (ZSTD_isError(ret)) {
+                errore = string("corrupted zstd data (") + ZSTD_getErrorName(ret) + ")";
+                return -1;
+            }
+            if (!emit(&out[0], zout.pos))
+                return -1;
+            *used = zin.pos;
+            if (!ret)
+                return 1;
+            if (zin.pos == zin.size && zout.pos < zout.size)
+                return 0;
+        }
+    }
+    
+    /** decode the units of the batch that are complete: *pos are the bytes
+     *  taken, *is_failed tells that the next one is to be streamed. False
+     *  when nothing more is needed */
+    bool decode_units(bool is_eof, size_t *pos, bool *is_failed) {
+        int max_units = 4*MAX(1, tot_threads);
+        if (units.size() < max_units)
+            units.resize(max_units);
+        
+        int tot = 0;
+        size_t end = 0;
+        while (tot < max_units && end < batch.size()) {
+            size_t next = next_boundary(end);
+            if (!next && !is_eof)
+                break;
+            units[tot].from = end;
+            units[tot].to = end = (next) ? next : batch.size();
+            tot++;
+        }
+        run_jobs(tot);
+        
+        *pos = 0;
+        *is_failed = false;
+        for (int i=0; i<tot; i++) {
+            unit_t &u = units[i];
+            if (!u.is_ok) {
+                *is_failed = true;      // a wrong guess, or too big: the rest is streamed
+                return true;
+            }
+            if (!emit(&u.out[0], u.out_len))
+                return false;
+            *pos = u.to;
+        }
+        return true;
+    }
+    
+    /** the members of a gzip image, or the frames of a zstd one */
+    void decode_frames() {
+        bool is_eof = false;
+        size_t target = DECODER_BATCH*MAX(1, tot_threads);
+        
+        while (true) {
+            while (!is_eof && batch.size() < target) {
+                size_t had = batch.size();
+                batch.resize(had + DECODER_READ);
+                ssize_t got = take(&batch[had], DECODER_READ);
+                if (got < 0)
+                    return;
+                batch.resize(had + got);
+                is_eof = !got;
+            }
+            if (batch.empty())
+                break;
+            
+            size_t pos = 0;
+            if (!is_open) {
+                bool is_failed;
+                if (!decode_units(is_eof, &pos, &is_failed))
+                    return;
+                if (is_failed || !pos)      // no unit ends in the batch: a big one
+                    stream_open();
+            }
+            if (is_open) {
+                size_t used;
+                int ret = stream(&batch[pos], batch.size()-pos, &used);
+                if (ret < 0)
+                    return;
+                pos += used;
+                if (ret) is_open = false;
+            }
+            if (!pos) {
+                errore = "the image is truncated";
+                return;
+            }
+            batch.erase(batch.begin(), batch.begin()+pos);
+        }
+        
+        if (is_open)
+            errore = "the image is truncated";
+    }
+    
+    /** not compressed (decode=auto) */
+    void decode_raw() {
+        vector<unsigned char> data(DECODER_READ);
+        ssize_t got;
+        while ((got = take(&data[0], DECODER_READ)) > 0)
+            if (!emit(&data[0], got))
+                return;
+    }
+    
+    /** pass the data on, without what is skipped; false when nothing more is needed */
+    bool emit(const unsigned char *p, int64_t len) {
+        if (skip) {
+            int64_t s = (skip < (uint64_t) len) ? skip : len;
+            skip -= s;
+            p += s;
+            len -= s;
+        }
+        if (to_write >= 0 && len > to_write)
+            len = to_write;
+        while (len > 0) {
+            ssize_t w = send(sock[1], p, len, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EPIPE)         // EPIPE: the reader does not need more
+                    errore = string("passing the data (") + strerror(errno) + ")";
+                return false;
+            }
+            p += w;
+            len -= w;
+            if (to_write > 0)
+                to_write -= w;
+        }
+        return to_write != 0;
+    }
+    
+    /** the frames of an LZ4 image, one after the other */
+    void decode_lz4() {
+        vector<unsigned char> history;      // last 64K of data, for dependent blocks
+        XXH32_state_t checksum;
+        uint32_t magic;
+        
+        while (get32(&magic)) {
+            if ((magic & 0xfffffff0) == LZ4_SKIPPABLE_MAGIC) {
+                uint32_t size;
+                if (!get32(&size) || !get(NULL, size)) break;
+                continue;
+            }
+            
+            unsigned char h[15];
+            if (magic != LZ4_FRAME_MAGIC || !get(h, 2) || (h[0] & 0xc0) != LZ4_FLG_VERSION || ((h[1] >> 4) & 7) < 4) {
+                errore = "not an LZ4 frame";
+                return;
+            }
+            int h_len = 2 + ((h[0] & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + ((h[0] & LZ4_FLG_DICT_ID) ? 4 : 0);
+            if (!get(h+2, h_len-2+1)) break;
+            if (h[h_len] != ((XXH32(h, h_len, 0) >> 8) & 0xff)) {
+                errore = "corrupted LZ4 frame header";
+                return;
+            }
+            bool is_independent = h[0] & LZ4_FLG_INDEPENDENT;
+            bool is_checksum = h[0] & LZ4_FLG_CONTENT_CHECKSUM;
+            block_max = LZ4_BLOCK_SIZE((h[1] >> 4) & 7);
+            XXH32_reset(&checksum, 0);
+            history.clear();
+            
+            // the blocks are read in groups, the independent ones decoded in parallel
+            bool is_end = false;
+            while (!is_end) {
+                int max_blocks = (is_independent) ? 4*MAX(1, tot_threads) : 1;
+                if (blocks.size() < max_blocks)
+                    blocks.resize(max_blocks);
+                int tot_blocks = 0;
+                while (tot_blocks < max_blocks) {
+                    uint32_t size;
+                    if (!get32(&size)) {
+                        if (!errore.length()) errore = "the image is truncated";
+                        return;
+                    }
+                    if (!size) {
+                        is_end = true;
+                        break;
+                    }
+                    block_t &b = blocks[tot_blocks++];
+                    b.is_stored = size & LZ4_UNCOMPRESSED;
+                    b.in_len = size & ~LZ4_UNCOMPRESSED;
+                    if (b.in_len > block_max) {
+                        errore = "corrupted LZ4 block";
+                        return;
+                    }
+                    b.in.resize(b.in_len);
+                    if (!get(&b.in[0], b.in_len) || ((h[0] & LZ4_FLG_BLOCK_CHECKSUM) && !get(NULL, 4))) {
+                        if (!errore.length()) errore = "the image is truncated";
+                        return;
+                    }
+                }
+                
+                if (is_independent)
+                    run_jobs(tot_blocks);
+                else {
+                    for (int i=0; i<tot_blocks; i++)
+                        decode_block(&blocks[i], history.size() ? &history[0] : NULL, history.size());
+                }
+                
+                for (int i=0; i<tot_blocks; i++) {
+                    block_t &b = blocks[i];
+                    if (b.out_len < 0) {
+                        errore = "corrupted LZ4 block";
+                        return;
+                    }
+                    if (is_checksum)
+                        XXH32_update(&checksum, &b.out[0], b.out_len);
+                    if (!is_independent) {
+                        history.insert(history.end(), b.out.begin(), b.out.begin()+b.out_len);
+                        if (history.size() > 65536)
+                            history.erase(history.begin(), history.end()-65536);
+                    }
+                    if (!emit(&b.out[0], b.out_len))
+                        return;
+                }
+            }
+            
+            uint32_t expected;
+            if (is_checksum && (!get32(&expected) || expected != XXH32_digest(&checksum))) {
+                if (!errore.length()) errore = "the data does not match the LZ4 checksum";
+                return;
+            }
+        }
+    }
+    
+    public:
+    
+    fastdd_decoder() {
+        image_fd = -1;
+        sock[0] = sock[1] = -1;
+        is_running = false;
+        in_pos = in_len = 0;
+        tot_threads = 1;
+        tot_jobs = next_job = jobs_done = 0;
+        block_max = 0;
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, 16+15);
+        zd = NULL;
+        is_open = false;
+        is_stop = false;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work, NULL);
+        pthread_cond_init(&done, NULL);
+    }
+    
+    /** true if FORMAT can be decoded */
+    static bool is_format(string format_) {
+        return !format_.compare("auto") || !format_.compare("gzip") || !format_.compare("zstd") || !format_.compare("lz4");
+    }
+    
+    // the format decoded (after finish, with decode=auto)
+    string get_format() { return format; }
+    
+    string get_error() { return errore; }
+    
+    /** start decoding the image of format format_ open in fd, from the byte
+     *  'from' of its data, for len bytes (-1: all), with 'threads' threads;
+     *  the data can be read from *read_fd */
+    bool open(int fd, string format_, uint64_t from, int64_t len, int threads_, int *read_fd) {
+        format = format_;
+        image_fd = fd;
+        skip = from;
+        to_write = len;
+        in.resize(DECODER_READ);
+        
+        tot_threads = threads_;
+        if (tot_threads > 1) {
+            threads.resize(tot_threads);
+            for (int i=0; i<tot_threads; i++) {
+                if (pthread_create(&threads[i], NULL, run_worker, (void *) this)) {
+                    threads.resize(i);
+                    break;
+                }
+            }
+        }
+        
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock)) {
+            errore = string("socketpair failed (") + strerror(errno) + ")";
+            return false;
+        }
+        if (pthread_create(&thread, NULL, run, (void *) this)) {
+            errore = "unable to start the decoding thread";
+            return false;
+        }
+        is_running = true;
+        *read_fd = sock[0];
+        return true;
+    }
+    
+    /** wait for the decoding; false if it failed */
+    bool finish() {
+        if (is_running) {
+            shutdown(sock[0], SHUT_RD);     // nothing more will be read
+            pthread_join(thread, NULL);
+            is_running = false;
+        }
+        return !errore.length();
+    }
+    
+    ~fastdd_decoder() {
+        finish();
+        stop_threads();
+        if (sock[0] >= 0) close(sock[0]);
+        inflateEnd(&zs);
+        if (zd) ZSTD_freeDCtx(zd);
+    }
+};
+
+#endif
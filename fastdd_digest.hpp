@@ -0,0 +1,751 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_DIGEST_H
+    #define _FASTDD_DIGEST_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <map>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+using namespace std;
+
+// chunks of a single update that make BLAKE3 spread the work on the threads
+#ifndef BLAKE3_THREAD_CHUNKS
+    #define BLAKE3_THREAD_CHUNKS 1024
+#endif
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+/** Message digests of fastdd: every digest is picked by name with
+ *  get_digestbyname() and computed with digest_init(), digest_update() and
+ *  digest_final(), so hash-files=, hash-blocks= and hash-tree= accept the
+ *  OpenSSL digests (computed with EVP) and these ones, that OpenSSL does not
+ *  have and fastdd computes itself:
+ *      blake3      BLAKE3 (256 bit), chunks hashed on SIMD lanes (SSE2, AVX2
+ *                  or AVX-512, chosen at run time) and, for big updates, on
+ *                  the threads given to set_threads()
+ *      xxh3-128    xXHash3 128 bit (libxxhash), printed in its canonical form
+ *      crc32c      CRC-32C (Castagnoli), with the SSE4.2 instruction when the
+ *                  CPU has it; printed big endian as the usual 8 hex digits
+ *  Their states are plain data: ctx_copy() copies them with memcpy. */
+class fastdd_digest {
+    private:
+    typedef struct {
+        uint32_t cv[8];
+        uint64_t chunk_counter;
+        uint8_t buf[BLAKE3_BLOCK_LEN];
+        uint8_t buf_len;
+        uint8_t blocks_compressed;
+    } blake3_chunk_t;
+    
+    typedef struct {
+        blake3_chunk_t chunk;
+        uint8_t cv_stack_len;
+        uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+    } blake3_state_t;
+    
+    // XXH3_state_t wants 64 bytes alignment, the contexts are malloc'ed and
+    // copied with memcpy: the state is kept at an aligned offset of raw
+    typedef struct {
+        uint8_t offset;
+        uint8_t raw[sizeof(XXH3_state_t)+64];
+    } xxh3_state_t;
+    
+    typedef struct {
+        uint32_t crc;
+    } crc32c_state_t;
+    
+    // parallel for of the BLAKE3 chunks
+    typedef struct {
+        const uint8_t *input;
+        uint64_t counter;
+        int64_t tot_chunks;
+        int64_t slice;          // chunks of a task
+        uint32_t *cvs;
+        int tot, next, done;
+    } job_t;
+    
+    typedef void (*lanes_fn)(const uint8_t *, uint64_t, uint32_t *);
+    
+    static const uint32_t *iv() {
+        static const uint32_t IV[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+            0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+        return IV;
+    }
+    
+    static const uint8_t (*schedule())[16] {
+        static const uint8_t SCHEDULE[7][16] = {
+            {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+            {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+            {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+            {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+            {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+            {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+            {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+        };
+        return SCHEDULE;
+    }
+    
+    static uint32_t load32(const uint8_t *p) {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+    
+    /** the BLAKE3 rounds on 'V' lanes: V is uint32_t for a single block or a
+     *  vector of uint32_t to hash blocks of different chunks at once */
+    template <typename V>
+    static inline __attribute__((always_inline)) void rounds(V v[16], const V m[16]) {
+        const uint8_t (*s)[16] = schedule();
+        #define B3_ROTR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+        #define B3_G(a, b, c, d, x, y) \
+            v[a] = v[a] + v[b] + m[s[r][x]]; v[d] = B3_ROTR(v[d] ^ v[a], 16); \
+            v[c] = v[c] + v[d]; v[b] = B3_ROTR(v[b] ^ v[c], 12); \
+            v[a] = v[a] + v[b] + m[s[r][y]]; v[d] = B3_ROTR(v[d] ^ v[a], 8); \
+            v[c] = v[c] + v[d]; v[b] = B3_ROTR(v[b] ^ v[c], 7);
+        #pragma GCC unroll 7
+        for (int r=0; r<7; r++) {
+            B3_G(0, 4, 8, 12, 0, 1);
+            B3_G(1, 5, 9, 13, 2, 3);
+            B3_G(2, 6, 10, 14, 4, 5);
+            B3_G(3, 7, 11, 15, 6, 7);
+            B3_G(0, 5, 10, 15, 8, 9);
+            B3_G(1, 6, 11, 12, 10, 11);
+            B3_G(2, 7, 8, 13, 12, 13);
+            B3_G(3, 4, 9, 14, 14, 15);
+        }
+        #undef B3_G
+        #undef B3_ROTR
+    }
+    
+    /** compress one block; out gets the 16 words of the output */
+    static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+            uint64_t counter, uint8_t flags, uint32_t out[16]) {
+        uint32_t m[16], v[16];
+        for (int i=0; i<16; i++)
+            m[i] = load32(block+4*i);
+        for (int i=0; i<8; i++)
+            v[i] = cv[i];
+        for (int i=0; i<4; i++)
+            v[8+i] = iv()[i];
+        v[12] = (uint32_t) counter;
+        v[13] = (uint32_t) (counter >> 32);
+        v[14] = block_len;
+        v[15] = flags;
+        rounds<uint32_t>(v, m);
+        for (int i=0; i<8; i++) {
+            out[i] = v[i] ^ v[i+8];
+            out[i+8] = v[i+8] ^ cv[i];
+        }
+    }
+    
+    typedef uint32_t v4u __attribute__((vector_size(16)));
+    typedef uint32_t v8u __attribute__((vector_size(32)));
+    typedef uint32_t v16u __attribute__((vector_size(64)));
+    
+    /** m[i] = word i of the block at 'input' of every lane (chunk) */
+    template <typename V>
+    static inline __attribute__((always_inline)) void load_words(const uint8_t *input, V m[16]) {
+        for (int i=0; i<16; i++)
+            for (int l=0; l<(int) (sizeof(V)/4); l++)
+                m[i][l] = load32(input + l*BLAKE3_CHUNK_LEN + 4*i);
+    }
+    
+    /** chaining values of 'lanes' whole chunks that follow each other */
+    template <typename V, int lanes>
+    static inline __attribute__((always_inline)) void chunks_lanes(const uint8_t *input, uint64_t counter, uint32_t *cvs) {
+        V h[8], v[16], m[16];
+        V counter_lo, counter_hi;
+        for (int l=0; l<lanes; l++) {
+            counter_lo[l] = (uint32_t) (counter+l);
+            counter_hi[l] = (uint32_t) ((counter+l) >> 32);
+        }
+        for (int i=0; i<8; i++)
+            h[i] = (V) {} + iv()[i];
+        
+        for (int b=0; b<BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN; b++) {
+            load_words(input + b*BLAKE3_BLOCK_LEN, m);
+            uint32_t flags = ((b == 0) ? BLAKE3_CHUNK_START : 0) |
+                ((b == BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN-1) ? BLAKE3_CHUNK_END : 0);
+            for (int i=0; i<8; i++)
+                v[i] = h[i];
+            for (int i=0; i<4; i++)
+                v[8+i] = (V) {} + iv()[i];
+            v[12] = counter_lo;
+            v[13] = counter_hi;
+            v[14] = (V) {} + (uint32_t) BLAKE3_BLOCK_LEN;
+            v[15] = (V) {} + flags;
+            rounds<V>(v, m);
+            for (int i=0; i<8; i++)
+                h[i] = v[i] ^ v[i+8];
+        }
+        
+        for (int l=0; l<lanes; l++)
+            for (int i=0; i<8; i++)
+                cvs[8*l+i] = h[i][l];
+    }
+    
+    static void chunks_4(const uint8_t *input, uint64_t counter, uint32_t *cvs) {
+        chunks_lanes<v4u, 4>(input, counter, cvs);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    static void chunks_8(const uint8_t *input, uint64_t counter, uint32_t *cvs) {
+        chunks_lanes<v8u, 8>(input, counter, cvs);
+    }
+    __attribute__((target("avx512f")))
+    static void chunks_16(const uint8_t *input, uint64_t counter, uint32_t *cvs) {
+        chunks_lanes<v16u, 16>(input, counter, cvs);
+    }
+#endif
+    
+    /** chaining value of a whole chunk that is not the last one */
+    static void chunk_cv(const uint8_t *input, uint64_t counter, uint32_t cv[8]) {
+        uint32_t out[16];
+        memcpy(cv, iv(), 32);
+        for (int b=0; b<BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN; b++) {
+            uint8_t flags = ((b == 0) ? BLAKE3_CHUNK_START : 0) |
+                ((b == BLAKE3_CHUNK_LEN/BLAKE3_BLOCK_LEN-1) ? BLAKE3_CHUNK_END : 0);
+            compress(cv, input + b*BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter, flags, out);
+            memcpy(cv, out, 32);
+        }
+    }
+    
+    static int &lanes() {
+        static int tot_lanes = 0;
+        return tot_lanes;
+    }
+    
+    static lanes_fn &lanes_function() {
+        static lanes_fn fn = chunks_4;
+        return fn;
+    }
+    
+    /** chaining values of tot whole chunks (none of them is the last one) */
+    static void chunks(const uint8_t *input, uint64_t counter, int64_t tot, uint32_t *cvs) {
+        int l = lanes();
+        lanes_fn fn = lanes_function();
+        int64_t i = 0;
+        for (; i+l<=tot; i+=l)
+            fn(input + i*BLAKE3_CHUNK_LEN, counter+i, cvs + 8*i);
+        for (; i<tot; i++)
+            chunk_cv(input + i*BLAKE3_CHUNK_LEN, counter+i, cvs + 8*i);
+    }
+    
+    // helper threads of BLAKE3
+    static pthread_mutex_t *pool_mutex() {
+        static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        return &mutex;
+    }
+    
+    static pthread_cond_t *pool_work() {
+        static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+        return &work;
+    }
+    
+    static pthread_cond_t *pool_done() {
+        static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+        return &done;
+    }
+    
+    static deque<job_t *> &pool_jobs() {
+        static deque<job_t *> jobs;
+        return jobs;
+    }
+    
+    static int &pool_threads() {
+        static int threads = 0;
+        return threads;
+    }
+    
+    /** take a task of a job and do it; false if there are no tasks. Called with
+     *  the mutex locked, it is locked again on return */
+    static bool run_task(job_t *job) {
+        if (job->next == job->tot)
+            return false;
+        int task = job->next++;
+        if (job->next == job->tot)
+            pool_jobs().erase(find(pool_jobs().begin(), pool_jobs().end(), job));
+        pthread_mutex_unlock(pool_mutex());
+        
+        int64_t first = task*job->slice;
+        int64_t n = MIN(job->slice, job->tot_chunks-first);
+        chunks(job->input + first*BLAKE3_CHUNK_LEN, job->counter+first, n, job->cvs + 8*first);
+        
+        pthread_mutex_lock(pool_mutex());
+        if (++job->done == job->tot)
+            pthread_cond_broadcast(pool_done());
+        return true;
+    }
+    
+    static void *pool_worker(void *arg) {
+        pthread_mutex_lock(pool_mutex());
+        while (true) {
+            while (pool_jobs().empty())
+                pthread_cond_wait(pool_work(), pool_mutex());
+            run_task(pool_jobs().front());
+        }
+        return NULL;
+    }
+    
+    /** chunks() of a big update, split among the caller and the helper threads */
+    static void chunks_threads(const uint8_t *input, uint64_t counter, int64_t tot, uint32_t *cvs) {
+        job_t job;
+        job.input = input;
+        job.counter = counter;
+        job.tot_chunks = tot;
+        job.slice = MAX(BLAKE3_THREAD_CHUNKS/4, (tot + pool_threads()) / (pool_threads()+1));
+        job.cvs = cvs;
+        job.tot = (tot + job.slice - 1) / job.slice;
+        job.next = job.done = 0;
+        
+        pthread_mutex_lock(pool_mutex());
+        pool_jobs().push_back(&job);
+        pthread_cond_broadcast(pool_work());
+        while (run_task(&job))
+            ;
+        while (job.done < job.tot)
+            pthread_cond_wait(pool_done(), pool_mutex());
+        pthread_mutex_unlock(pool_mutex());
+    }
+    
+    static void push_cv(blake3_state_t *s, uint32_t cv[8], uint64_t total_chunks) {
+        uint8_t block[BLAKE3_BLOCK_LEN];
+        uint32_t out[16];
+        // a complete subtree on the top of the stack is merged
+        while (!(total_chunks & 1)) {
+            s->cv_stack_len--;
+            memcpy(block, s->cv_stack[s->cv_stack_len], 32);
+            memcpy(block+32, cv, 32);
+            compress(iv(), block, BLAKE3_BLOCK_LEN, 0, BLAKE3_PARENT, out);
+            memcpy(cv, out, 32);
+            total_chunks >>= 1;
+        }
+        memcpy(s->cv_stack[s->cv_stack_len++], cv, 32);
+    }
+    
+    static void chunk_reset(blake3_chunk_t *c, uint64_t counter) {
+        memcpy(c->cv, iv(), 32);
+        c->chunk_counter = counter;
+        c->buf_len = 0;
+        c->blocks_compressed = 0;
+    }
+    
+    static int chunk_len(blake3_chunk_t *c) {
+        return BLAKE3_BLOCK_LEN*c->blocks_compressed + c->buf_len;
+    }
+    
+    static uint8_t chunk_start(blake3_chunk_t *c) {
+        return (c->blocks_compressed) ? 0 : BLAKE3_CHUNK_START;
+    }
+    
+    static void chunk_update(blake3_chunk_t *c, const uint8_t *input, size_t len) {
+        uint32_t out[16];
+        while (len) {
+            // a full block is compressed only when more data follows it
+            if (c->buf_len == BLAKE3_BLOCK_LEN) {
+                compress(c->cv, c->buf, BLAKE3_BLOCK_LEN, c->chunk_counter, chunk_start(c), out);
+                memcpy(c->cv, out, 32);
+                c->blocks_compressed++;
+                c->buf_len = 0;
+            }
+            size_t n = MIN((size_t) BLAKE3_BLOCK_LEN - c->buf_len, len);
+            memcpy(c->buf + c->buf_len, input, n);
+            c->buf_len += n;
+            input += n;
+            len -= n;
+        }
+    }
+    
+    static int blake3_init(void *state) {
+        blake3_state_t *s = (blake3_state_t *) state;
+        chunk_reset(&s->chunk, 0);
+        s->cv_stack_len = 0;
+        return 1;
+    }
+    
+    static int blake3_update(void *state, const void *data, size_t len) {
+        blake3_state_t *s = (blake3_state_t *) state;
+        const uint8_t *input = (const uint8_t *) data;
+        uint32_t cv[8], out[16];
+        
+        while (len) {
+            if (chunk_len(&s->chunk) == BLAKE3_CHUNK_LEN) {
+                compress(s->chunk.cv, s->chunk.buf, BLAKE3_BLOCK_LEN, s->chunk.chunk_counter,
+                    chunk_start(&s->chunk) | BLAKE3_CHUNK_END, out);
+                memcpy(cv, out, 32);
+                push_cv(s, cv, s->chunk.chunk_counter+1);
+                chunk_reset(&s->chunk, s->chunk.chunk_counter+1);
+            }
+            
+            // whole chunks followed by more data go on the lanes (and threads)
+            if (!chunk_len(&s->chunk) && len > BLAKE3_CHUNK_LEN) {
+                int64_t tot = (len-1) / BLAKE3_CHUNK_LEN;
+                uint64_t counter = s->chunk.chunk_counter;
+                uint32_t cvs[8*64];
+                if (pool_threads() && tot >= BLAKE3_THREAD_CHUNKS) {
+                    vector<uint32_t> all(8*tot);
+                    chunks_threads(input, counter, tot, &all[0]);
+                    for (int64_t i=0; i<tot; i++)
+                        push_cv(s, &all[8*i], counter+i+1);
+                }
+                else for (int64_t done=0; done<tot; done+=64) {
+                    int64_t n = MIN(64, tot-done);
+                    chunks(input + done*BLAKE3_CHUNK_LEN, counter+done, n, cvs);
+                    for (int64_t i=0; i<n; i++)
+                        push_cv(s, cvs+8*i, counter+done+i+1);
+                }
+                chunk_reset(&s->chunk, counter+tot);
+                input += tot*BLAKE3_CHUNK_LEN;
+                len -= tot*BLAKE3_CHUNK_LEN;
+                continue;
+            }
+            
+            size_t n = MIN((size_t) (BLAKE3_CHUNK_LEN - chunk_len(&s->chunk)), len);
+            chunk_update(&s->chunk, input, n);
+            input += n;
+            len -= n;
+        }
+        
+        return 1;
+    }
+    
+    static int blake3_final(void *state, unsigned char *md) {
+        blake3_state_t *s = (blake3_state_t *) state;
+        uint32_t cv[8], out[16];
+        uint8_t block[BLAKE3_BLOCK_LEN];
+        
+        // the output node: the last chunk, then its parents up to the root
+        memcpy(cv, s->chunk.cv, 32);
+        memcpy(block, s->chunk.buf, s->chunk.buf_len);
+        memset(block + s->chunk.buf_len, 0, BLAKE3_BLOCK_LEN - s->chunk.buf_len);
+        uint8_t block_len = s->chunk.buf_len;
+        uint64_t counter = s->chunk.chunk_counter;
+        uint8_t flags = chunk_start(&s->chunk) | BLAKE3_CHUNK_END;
+        
+        for (int i=s->cv_stack_len-1; i>=0; i--) {
+            compress(cv, block, block_len, counter, flags, out);
+            memcpy(block, s->cv_stack[i], 32);
+            memcpy(block+32, out, 32);
+            memcpy(cv, iv(), 32);
+            block_len = BLAKE3_BLOCK_LEN;
+            counter = 0;
+            flags = BLAKE3_PARENT;
+        }
+        compress(cv, block, block_len, 0, flags | BLAKE3_ROOT, out);
+        
+        for (int i=0; i<8; i++)
+            for (int j=0; j<4; j++)
+                md[4*i+j] = (unsigned char) (out[i] >> (8*j));
+        return 1;
+    }
+    
+    static XXH3_state_t *xxh3_state(void *state) {
+        xxh3_state_t *s = (xxh3_state_t *) state;
+        uint8_t offset = (64 - ((uintptr_t) s->raw & 63)) & 63;
+        if (offset != s->offset) {
+            memmove(s->raw + offset, s->raw + s->offset, sizeof(XXH3_state_t));
+            s->offset = offset;
+        }
+        return (XXH3_state_t *) (s->raw + offset);
+    }
+    
+    static int xxh3_init(void *state) {
+        xxh3_state_t *s = (xxh3_state_t *) state;
+        s->offset = (64 - ((uintptr_t) s->raw & 63)) & 63;
+        return XXH3_128bits_reset(xxh3_state(state)) == XXH_OK;
+    }
+    
+    static int xxh3_update(void *state, const void *data, size_t len) {
+        return XXH3_128bits_update(xxh3_state(state), data, len) == XXH_OK;
+    }
+    
+    static int xxh3_final(void *state, unsigned char *md) {
+        XXH128_canonical_t canonical;
+        XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(xxh3_state(state)));
+        memcpy(md, canonical.digest, 16);
+        return 1;
+    }
+    
+    static const uint32_t (*crc32c_table())[256] {
+        static uint32_t table[8][256];
+        static bool is_ready = false;
+        if (!is_ready) {
+            for (int i=0; i<256; i++) {
+                uint32_t crc = i;
+                for (int j=0; j<8; j++)
+                    crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+                table[0][i] = crc;
+            }
+            for (int i=0; i<256; i++)
+                for (int j=1; j<8; j++)
+                    table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 255];
+            is_ready = true;
+        }
+        return table;
+    }
+    
+    // slicing by 8
+    static uint32_t crc32c_table_update(uint32_t crc, const uint8_t *p, size_t len) {
+        const uint32_t (*t)[256] = crc32c_table();
+        for (; len >= 8; len -= 8, p += 8) {
+            uint32_t lo = crc ^ load32(p), hi = load32(p+4);
+            crc = t[7][lo & 255] ^ t[6][(lo >> 8) & 255] ^ t[5][(lo >> 16) & 255] ^ t[4][lo >> 24] ^
+                t[3][hi & 255] ^ t[2][(hi >> 8) & 255] ^ t[1][(hi >> 16) & 255] ^ t[0][hi >> 24];
+        }
+        for (; len; len--, p++)
+            crc = (crc >> 8) ^ t[0][(crc ^ *p) & 255];
+        return crc;
+    }
+    
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    static uint32_t crc32c_sse42_update(uint32_t crc, const uint8_t *p, size_t len) {
+        uint64_t crc64 = crc;
+        for (; len >= 8; len -= 8, p += 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            crc64 = __builtin_ia32_crc32di(crc64, word);
+        }
+        crc = (uint32_t) crc64;
+        for (; len; len--, p++)
+            crc = __builtin_ia32_crc32qi(crc, *p);
+        return crc;
+    }
+#endif
+    
+    static bool &has_sse42() {
+        static bool is_sse42 = false;
+        return is_sse42;
+    }
+    
+    static int crc32c_init(void *state) {
+        ((crc32c_state_t *) state)->crc = 0xFFFFFFFF;
+        return 1;
+    }
+    
+    static int crc32c_update(void *state, const void *data, size_t len) {
+        crc32c_state_t *s = (crc32c_state_t *) state;
+#if defined(__x86_64__)
+        if (has_sse42()) {
+            s->crc = crc32c_sse42_update(s->crc, (const uint8_t *) data, len);
+            return 1;
+        }
+#endif
+        s->crc = crc32c_table_update(s->crc, (const uint8_t *) data, len);
+        return 1;
+    }
+    
+    static int crc32c_final(void *state, unsigned char *md) {
+        uint32_t crc = ~((crc32c_state_t *) state)->crc;
+        for (int i=0; i<4; i++)
+            md[i] = (unsigned char) (crc >> (24-8*i));
+        return 1;
+    }
+    
+    public:
+    
+    /** a message digest: its own functions, or an OpenSSL one (evp) */
+    typedef struct {
+        const char *name;
+        int md_size;
+        int state_size;
+        int (*init)(void *);
+        int (*update)(void *, const void *, size_t);
+        int (*final)(void *, unsigned char *);
+        const EVP_MD *evp;          // NULL for the digests of fastdd
+    } md_t;
+    
+    /** a digest being computed: the state of a digest of fastdd or the EVP context */
+    typedef struct {
+        const md_t *md;
+        EVP_MD_CTX evp;
+        union {
+            blake3_state_t blake3;
+            xxh3_state_t xxh3;
+            crc32c_state_t crc32c;
+        } state;
+    } ctx_t;
+    
+    private:
+    
+    // descriptors of the OpenSSL digests asked so far
+    static map<const EVP_MD *, md_t *> &evp_digests() {
+        static map<const EVP_MD *, md_t *> digests;
+        return digests;
+    }
+    
+    static pthread_mutex_t *evp_mutex() {
+        static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        return &mutex;
+    }
+    
+    public:
+    
+    /** pick the fastest code for this CPU */
+    static void init() {
+        lanes() = 4;
+        lanes_function() = chunks_4;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            lanes() = 16;
+            lanes_function() = chunks_16;
+        }
+        else if (__builtin_cpu_supports("avx2")) {
+            lanes() = 8;
+            lanes_function() = chunks_8;
+        }
+        has_sse42() = __builtin_cpu_supports("sse4.2");
+#endif
+        crc32c_table();
+    }
+    
+    /** the digest called 'name', NULL if neither fastdd nor OpenSSL have it.
+     *  The OpenSSL digests need OpenSSL_add_all_digests() first */
+    static const md_t *get_digestbyname(const char *name) {
+        static const md_t own[] = {
+            { "blake3", BLAKE3_OUT_LEN, sizeof(blake3_state_t), blake3_init, blake3_update, blake3_final, NULL },
+            { "xxh3-128", 16, sizeof(xxh3_state_t), xxh3_init, xxh3_update, xxh3_final, NULL },
+            { "xxh128", 16, sizeof(xxh3_state_t), xxh3_init, xxh3_update, xxh3_final, NULL },
+            { "crc32c", 4, sizeof(crc32c_state_t), crc32c_init, crc32c_update, crc32c_final, NULL },
+        };
+        for (int i=0; i<(int) (sizeof(own)/sizeof(own[0])); i++)
+            if (!strcmp(own[i].name, name))
+                return &own[i];
+        
+        const EVP_MD *evp = EVP_get_digestbyname(name);
+        if (!evp)
+            return NULL;
+        pthread_mutex_lock(evp_mutex());
+        md_t *&md = evp_digests()[evp];
+        if (!md) {
+            md = new md_t;
+            md->name = OBJ_nid2sn(EVP_MD_type(evp));
+            md->md_size = EVP_MD_size(evp);
+            md->state_size = 0;
+            md->init = NULL;
+            md->update = NULL;
+            md->final = NULL;
+            md->evp = evp;
+        }
+        pthread_mutex_unlock(evp_mutex());
+        return md;
+    }
+    
+    static int md_size(const md_t *md) {
+        return md->md_size;
+    }
+    
+    /** ready a context for digest_init() or ctx_copy() */
+    static void ctx_init(ctx_t *ctx) {
+        ctx->md = NULL;
+        EVP_MD_CTX_init(&ctx->evp);
+    }
+    
+    static void digest_init(ctx_t *ctx, const md_t *md) {
+        ctx->md = md;
+        if (md->evp)
+            EVP_DigestInit_ex(&ctx->evp, md->evp, NULL);
+        else
+            md->init(&ctx->state);
+    }
+    
+    static void digest_update(ctx_t *ctx, const void *data, size_t len) {
+        if (ctx->md->evp)
+            EVP_DigestUpdate(&ctx->evp, data, len);
+        else
+            ctx->md->update(&ctx->state, data, len);
+    }
+    
+    /** md gets the digest, of *len bytes (len can be NULL) */
+    static void digest_final(ctx_t *ctx, unsigned char *md, unsigned int *len) {
+        if (ctx->md->evp)
+            EVP_DigestFinal_ex(&ctx->evp, md, len);
+        else {
+            ctx->md->final(&ctx->state, md);
+            if (len)
+                *len = ctx->md->md_size;
+        }
+    }
+    
+    /** out continues the digest of in; out has been through ctx_init() */
+    static void ctx_copy(ctx_t *out, const ctx_t *in) {
+        out->md = in->md;
+        if (in->md->evp)
+            EVP_MD_CTX_copy_ex(&out->evp, &in->evp);
+        else
+            memcpy(&out->state, &in->state, in->md->state_size);
+    }
+    
+    /** digest of len bytes at data in one go */
+    static void digest(const void *data, size_t len, unsigned char *md, unsigned int *md_len, const md_t *type) {
+        ctx_t ctx;
+        ctx_init(&ctx);
+        digest_init(&ctx, type);
+        digest_update(&ctx, data, len);
+        digest_final(&ctx, md, md_len);
+    }
+    
+    /** let BLAKE3 use 'threads' threads (the caller included) for big updates */
+    static void set_threads(int threads) {
+        pthread_mutex_lock(pool_mutex());
+        for (; pool_threads() < threads-1; pool_threads()++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, pool_worker, NULL))
+                break;
+            pthread_detach(thread);
+        }
+        pthread_mutex_unlock(pool_mutex());
+    }
+    
+    /** what init() chose, for the logs */
+    static string get_features() {
+        stringstream ss;
+        ss << "blake3 on " << ((lanes() == 16) ? "16 (AVX-512)" : (lanes() == 8) ? "8 (AVX2)" : "4") << " lanes";
+        if (pool_threads())
+            ss << " and " << pool_threads()+1 << " threads";
+        ss << ((has_sse42()) ? ", crc32c with SSE4.2" : ", crc32c with tables");
+        return ss.str();
+    }
+};
+
+typedef fastdd_digest::md_t fastdd_md_t;
+typedef fastdd_digest::ctx_t fastdd_md_ctx_t;
+
+#endif
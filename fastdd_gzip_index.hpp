@@ -0,0 +1,288 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_GZIP_INDEX_H
+    #define _FASTDD_GZIP_INDEX_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+using namespace std;
+
+#define GZIP_INDEX_MAGIC "FDDGZIX1"
+
+/** Index of a gzip image made of independent members, written by the
+ *  compression module with gzip-index=FILE: where every member starts in the
+ *  uncompressed data and in the image. A range of the data is decompressed
+ *  starting from the member that holds its first byte (if-gzip-index=FILE).
+ *
+ *  The sidecar file is:
+ *      "FDDGZIX1", interval, uncompressed length, number of members (uint64),
+ *      then uncompressed and compressed offset of every member (uint64);
+ *      integers in the byte order of the host. */
+class fastdd_gzip_index {
+    private:
+    uint64_t interval;          // uncompressed bytes of every member (the last can be shorter)
+    uint64_t length;            // uncompressed bytes of the image
+    vector<uint64_t> in_offset, out_offset;
+    
+    // decompression of a range, in its own thread
+    int image_fd;
+    int sock[2];                // the thread writes in sock[1], fastdd reads sock[0]
+    uint64_t from;
+    int64_t to_write;           // -1: till the end
+    pthread_t thread;
+    bool is_running;
+    
+    string errore;
+    
+    static void *run(void *arg) {
+        fastdd_gzip_index *gi = (fastdd_gzip_index *) arg;
+        gi->decompress();
+        close(gi->sock[1]);     // end of data for the reader
+        return NULL;
+    }
+    
+    /** write out the bytes from 'from' on: the members after the first one
+     *  are just the next ones in the image */
+    void decompress() {
+        int m = member_of(from);
+        uint64_t pos = out_offset[m];
+        uint64_t skip = from - in_offset[m];
+        
+        const int chunk = 1<<18;
+        vector<unsigned char> in(chunk), out(chunk);
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        zs.next_in = Z_NULL;
+        zs.avail_in = 0;
+        if (inflateInit2(&zs, 16+15) != Z_OK) {
+            errore = "inflateInit failed";
+            return;
+        }
+        
+        int ret = Z_OK;
+        while (to_write) {
+            if (!zs.avail_in) {
+                ssize_t got = pread(image_fd, &in[0], chunk, pos);
+                if (got < 0) {
+                    errore = string("reading the image (") + strerror(errno) + ")";
+                    break;
+                }
+                if (!got) {
+                    if (ret != Z_STREAM_END)
+                        errore = "the image is truncated";
+                    break;
+                }
+                pos += got;
+                zs.next_in = &in[0];
+                zs.avail_in = got;
+            }
+            if (ret == Z_STREAM_END)        // next member
+                inflateReset(&zs);
+            
+            zs.next_out = &out[0];
+            zs.avail_out = chunk;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                errore = string("corrupted image (") + ((zs.msg) ? zs.msg : "inflate error") + ")";
+                break;
+            }
+            
+            int64_t have = chunk - zs.avail_out;
+            unsigned char *p = &out[0];
+            if (skip) {
+                int64_t s = (skip < (uint64_t) have) ? skip : have;
+                skip -= s;
+                p += s;
+                have -= s;
+            }
+            if (to_write >= 0 && have > to_write)
+                have = to_write;
+            if (!write_all(p, have))
+                break;
+            if (to_write > 0)
+                to_write -= have;
+        }
+        
+        inflateEnd(&zs);
+    }
+    
+    bool write_all(const unsigned char *p, int64_t len) {
+        while (len > 0) {
+            ssize_t w = send(sock[1], p, len, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EPIPE)         // EPIPE: the reader does not need more
+                    errore = string("passing the data (") + strerror(errno) + ")";
+                return false;
+            }
+            p += w;
+            len -= w;
+        }
+        return true;
+    }
+    
+    public:
+    
+    fastdd_gzip_index() {
+        interval = length = 0;
+        image_fd = -1;
+        sock[0] = sock[1] = -1;
+        is_running = false;
+    }
+    
+    void set_interval(uint64_t interval_) { interval = interval_; }
+    void set_length(uint64_t length_) { length = length_; }
+    uint64_t get_length() { return length; }
+    uint64_t get_tot_members() { return in_offset.size(); }
+    string get_error() { return errore; }
+    
+    /** a new member starts at uncompressed offset 'in' and at 'out' in the image */
+    void add(uint64_t in, uint64_t out) {
+        in_offset.push_back(in);
+        out_offset.push_back(out);
+    }
+    
+    /** member holding the uncompressed byte 'offset' */
+    int member_of(uint64_t offset) {
+        int lo = 0, hi = in_offset.size()-1;
+        while (lo < hi) {
+            int mid = (lo+hi+1)/2;
+            if (in_offset[mid] <= offset) lo = mid;
+            else hi = mid-1;
+        }
+        return lo;
+    }
+    
+    /** start decompressing len bytes (-1: all) from the uncompressed byte
+     *  'from_' of the image open in fd; the data can be read from *read_fd */
+    bool open_range(int fd, uint64_t from_, int64_t len, int *read_fd) {
+        if (!in_offset.size() || from_ >= length) {
+            errore = "the range is outside of the image";
+            return false;
+        }
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock)) {
+            errore = string("socketpair failed (") + strerror(errno) + ")";
+            return false;
+        }
+        image_fd = fd;
+        from = from_;
+        to_write = len;
+        if (pthread_create(&thread, NULL, run, (void *) this)) {
+            errore = "unable to start the decompression thread";
+            return false;
+        }
+        is_running = true;
+        *read_fd = sock[0];
+        return true;
+    }
+    
+    /** wait for the decompression; false if it failed */
+    bool finish() {
+        if (is_running) {
+            shutdown(sock[0], SHUT_RD);     // nothing more will be read
+            pthread_join(thread, NULL);
+            is_running = false;
+        }
+        return !errore.length();
+    }
+    
+    /** write the sidecar file */
+    bool save(const char *file_name) {
+        ofstream f(file_name, ios_base::out | ios_base::binary);
+        if (!f.is_open()) {
+            errore = string("opening ") + file_name;
+            return false;
+        }
+        
+        uint64_t tot = in_offset.size();
+        f.write(GZIP_INDEX_MAGIC, 8);
+        f.write((char *) &interval, sizeof(interval));
+        f.write((char *) &length, sizeof(length));
+        f.write((char *) &tot, sizeof(tot));
+        for (uint64_t i=0; i<tot; i++) {
+            f.write((char *) &in_offset[i], sizeof(uint64_t));
+            f.write((char *) &out_offset[i], sizeof(uint64_t));
+        }
+        
+        f.close();
+        if (f.fail()) {
+            errore = string("writing ") + file_name;
+            return false;
+        }
+        return true;
+    }
+    
+    /** read a sidecar file */
+    bool load(const char *file_name) {
+        ifstream f(file_name, ios_base::in | ios_base::binary);
+        if (!f.is_open()) {
+            errore = string("opening ") + file_name;
+            return false;
+        }
+        
+        char magic[8];
+        uint64_t tot = 0;
+        f.read(magic, 8);
+        f.read((char *) &interval, sizeof(interval));
+        f.read((char *) &length, sizeof(length));
+        f.read((char *) &tot, sizeof(tot));
+        if (!f || memcmp(magic, GZIP_INDEX_MAGIC, 8) || tot > length+1) {
+            errore = string(file_name) + " is not a gzip index file";
+            return false;
+        }
+        
+        bool is_sorted = true;
+        in_offset.resize(tot);
+        out_offset.resize(tot);
+        for (uint64_t i=0; f && i<tot; i++) {
+            f.read((char *) &in_offset[i], sizeof(uint64_t));
+            f.read((char *) &out_offset[i], sizeof(uint64_t));
+            if (i && (in_offset[i] <= in_offset[i-1] || out_offset[i] <= out_offset[i-1]))
+                is_sorted = false;
+        }
+        if (!f || !tot || in_offset[0] || !is_sorted) {
+            errore = string(file_name) + " is truncated or damaged";
+            return false;
+        }
+        
+        return true;
+    }
+    
+    ~fastdd_gzip_index() {
+        finish();
+        if (sock[0] >= 0) close(sock[0]);
+    }
+};
+
+#endif
@@ -0,0 +1,437 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_HASH_POOL_H
+    #define _FASTDD_HASH_POOL_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "fastdd_t.hpp"
+#include "fastdd_digest.hpp"
+#include "fastdd_multihash.hpp"
+
+using namespace std;
+
+#ifndef HASH_POOL_JOBS
+#define HASH_POOL_JOBS 16   // buffers a digest thread can be behind
+#endif
+
+/** One thread per digest context: every context gets the same data, in the
+ *  order it is given, while the caller goes on. Used for the file digests
+ *  (hash-files=), so md5,sha1,sha256 run side by side instead of one after
+ *  the other. The data must stay untouched until wait() says it has been
+ *  digested. */
+class fastdd_hash_pool {
+    private:
+    typedef struct {
+        const unsigned char *data;
+        int64_t length;
+        uint64_t seq;           // buffer the data comes from
+    } job_t;
+    
+    typedef struct {
+        fastdd_hash_pool *pool;
+        fastdd_md_ctx_t *ctx;
+        uint64_t next;          // next job to digest
+        pthread_t thread;
+    } worker_t;
+    
+    vector<worker_t> workers;
+    job_t jobs[HASH_POOL_JOBS];
+    uint64_t tail;              // jobs given
+    bool is_stop;
+    
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;   // a job arrived (or stop)
+    pthread_cond_t progress;    // a worker finished a job
+    
+    // first job not digested by every worker, called with mutex locked
+    uint64_t head() {
+        uint64_t ris = tail;
+        for (int i=0; i<workers.size(); i++)
+            if (workers[i].next < ris) ris = workers[i].next;
+        return ris;
+    }
+    
+    static void *run(void *arg) {
+        worker_t *w = (worker_t *) arg;
+        fastdd_hash_pool *p = w->pool;
+        
+        while (true) {
+            pthread_mutex_lock(&p->mutex);
+            while (w->next == p->tail && !p->is_stop)
+                pthread_cond_wait(&p->not_empty, &p->mutex);
+            if (w->next == p->tail) {
+                pthread_mutex_unlock(&p->mutex);
+                break;
+            }
+            job_t job = p->jobs[w->next % HASH_POOL_JOBS];
+            pthread_mutex_unlock(&p->mutex);
+            
+            fastdd_digest::digest_update(w->ctx, job.data, job.length);
+            
+            pthread_mutex_lock(&p->mutex);
+            w->next++;
+            pthread_cond_broadcast(&p->progress);
+            pthread_mutex_unlock(&p->mutex);
+        }
+        
+        return NULL;
+    }
+    
+    public:
+    
+    fastdd_hash_pool() {
+        tail = 0;
+        is_stop = false;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&not_empty, NULL);
+        pthread_cond_init(&progress, NULL);
+    }
+    
+    /** start a thread for each of the 'tot' contexts in 'ctx' */
+    bool init(fastdd_md_ctx_t *ctx, int tot) {
+        workers.resize(tot);
+        for (int i=0; i<tot; i++) {
+            workers[i].pool = this;
+            workers[i].ctx = &ctx[i];
+            workers[i].next = 0;
+        }
+        for (int i=0; i<tot; i++) {
+            if (pthread_create(&workers[i].thread, NULL, run, (void *) &workers[i])) {
+                workers.resize(i);
+                finish();
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    /** digest 'length' bytes of 'data' in every context. It waits only if the
+     *  slowest thread is HASH_POOL_JOBS jobs behind */
+    void update(const unsigned char *data, int64_t length, uint64_t seq) {
+        pthread_mutex_lock(&mutex);
+        while (tail - head() == HASH_POOL_JOBS)
+            pthread_cond_wait(&progress, &mutex);
+        
+        job_t &job = jobs[tail % HASH_POOL_JOBS];
+        job.data = data;
+        job.length = length;
+        job.seq = seq;
+        tail++;
+        pthread_cond_broadcast(&not_empty);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** wait until the data of buffer 'seq' and of the ones before it has
+     *  been digested by every context */
+    void wait(uint64_t seq) {
+        pthread_mutex_lock(&mutex);
+        uint64_t h;
+        while ((h = head()) < tail && jobs[h % HASH_POOL_JOBS].seq <= seq)
+            pthread_cond_wait(&progress, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** digest what is left and stop the threads; the contexts can then be finalized */
+    void finish() {
+        pthread_mutex_lock(&mutex);
+        is_stop = true;
+        pthread_cond_broadcast(&not_empty);
+        pthread_mutex_unlock(&mutex);
+        
+        for (int i=0; i<workers.size(); i++)
+            pthread_join(workers[i].thread, NULL);
+        workers.clear();
+    }
+    
+    ~fastdd_hash_pool() {
+        if (!is_stop) finish();
+    }
+};
+
+/** The block digests of the input (hash-blocks-save, hash-blocks-check) on a
+ *  pool of threads. The ibs blocks of a buffer are split in as many ranges
+ *  as threads; every thread keeps its contexts initialized once, copies them
+ *  for each block and formats the lines of the hash file by itself. The lines
+ *  are written by wait(), in block order, so the file is the same as the one
+ *  written by a single thread. */
+class fastdd_block_hasher {
+    private:
+    struct _batch_t;
+    
+    typedef struct {
+        struct _batch_t *batch;
+        buffer_t *buff;
+        int64_t from, to;       // bytes of the buffer to digest, block by block
+        int algorithm;          // >=0: whole buffer digest for the check, in buff->hash
+        string text;            // lines for the hash file
+    } job_t;
+    
+    typedef struct _batch_t {
+        uint64_t seq;           // buffer the jobs come from
+        int64_t first_block;    // number of the first block of the buffer
+        uint64_t position;      // position of the buffer in the input
+        vector<job_t> jobs;
+        int pending;            // jobs not done yet
+    } batch_t;
+    
+    int tot_threads;
+    vector<pthread_t> threads;
+    vector<const fastdd_md_t *> digest_type;
+    vector<string> names;
+    int64_t ibs;
+    ostream *out;
+    
+    deque<job_t *> todo;
+    deque<batch_t *> batches;   // oldest first
+    bool is_stop;
+    
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;   // a job arrived (or stop)
+    pthread_cond_t done;        // a batch is complete
+    
+    static void *run(void *arg) {
+        fastdd_block_hasher *p = (fastdd_block_hasher *) arg;
+        
+        // contexts initialized once, copied for each block
+        int tot = p->digest_type.size();
+        vector<fastdd_md_ctx_t> base(tot);
+        fastdd_md_ctx_t work;
+        for (int i=0; i<tot; i++) {
+            fastdd_digest::ctx_init(&base[i]);
+            fastdd_digest::digest_init(&base[i], p->digest_type[i]);
+        }
+        fastdd_digest::ctx_init(&work);
+        
+        while (true) {
+            pthread_mutex_lock(&p->mutex);
+            while (p->todo.empty() && !p->is_stop)
+                pthread_cond_wait(&p->not_empty, &p->mutex);
+            if (p->todo.empty()) {
+                pthread_mutex_unlock(&p->mutex);
+                break;
+            }
+            job_t *job = p->todo.front();
+            p->todo.pop_front();
+            pthread_mutex_unlock(&p->mutex);
+            
+            p->digest(job, &base[0], &work);
+            
+            pthread_mutex_lock(&p->mutex);
+            if (!--job->batch->pending)
+                pthread_cond_broadcast(&p->done);
+            pthread_mutex_unlock(&p->mutex);
+        }
+        
+        return NULL;
+    }
+    
+    void digest(job_t *job, fastdd_md_ctx_t *base, fastdd_md_ctx_t *work) {
+        static const char hex[] = "0123456789abcdef";
+        unsigned char md_value[EVP_MAX_MD_SIZE];
+        unsigned int md_len;
+        buffer_t *buff = job->buff;
+        
+        if (job->algorithm >= 0) {
+            int i1 = job->algorithm;
+            fastdd_digest::ctx_copy(work, &base[i1]);
+            fastdd_digest::digest_update(work, buff->buffer, buff->length);
+            fastdd_digest::digest_final(work, buff->hash[i1], &buff->hash_len[i1]);
+            return;
+        }
+        
+        batch_t *b = job->batch;
+        char line[128];
+        char md_hex[2*EVP_MAX_MD_SIZE+1];
+        
+        // the whole blocks of the range go on the SIMD lanes, if it pays
+        int64_t full = (job->to - job->from) / ibs;
+        vector< vector<unsigned char> > multi(digest_type.size());
+        for (int i1=0; i1<digest_type.size(); i1++) {
+            if (!fastdd_multihash::is_worth(digest_type[i1], full))
+                continue;
+            multi[i1].resize(full * fastdd_digest::md_size(digest_type[i1]));
+            fastdd_multihash::digest(digest_type[i1], buff->buffer+job->from, ibs, full, &multi[i1][0]);
+        }
+        
+        for (int64_t i=job->from; i<job->to; i+=ibs) {
+            int64_t len = (ibs < (int64_t) buff->length-i) ? ibs : (int64_t) buff->length-i;
+            for (int i1=0; i1<digest_type.size(); i1++) {
+                if (multi[i1].size() && (i-job->from)/ibs < full) {
+                    md_len = fastdd_digest::md_size(digest_type[i1]);
+                    memcpy(md_value, &multi[i1][(i-job->from)/ibs * md_len], md_len);
+                }
+                else {
+                    fastdd_digest::ctx_copy(work, &base[i1]);
+                    fastdd_digest::digest_update(work, buff->buffer+i, len);
+                    fastdd_digest::digest_final(work, md_value, &md_len);
+                }
+                for (int i2=0; i2<md_len; i2++) {
+                    md_hex[2*i2] = hex[md_value[i2] >> 4];
+                    md_hex[2*i2+1] = hex[md_value[i2] & 15];
+                }
+                md_hex[2*md_len] = 0;
+                
+                // same format of the single thread: block number, then the buffer range
+                snprintf(line, sizeof(line), "block %8" PRId64 ": %016" PRIx64 "-%016" PRIx64 ": ",
+                    b->first_block+i/ibs, b->position, b->position+len);
+                job->text += line;
+                job->text += names[i1];
+                job->text += " - ";
+                job->text += md_hex;
+                job->text += '\n';
+            }
+        }
+    }
+    
+    // write the lines of the oldest batch, once it is complete. Called with mutex locked
+    bool flush_front(bool block) {
+        batch_t *b = batches.front();
+        while (b->pending && block)
+            pthread_cond_wait(&done, &mutex);
+        if (b->pending)
+            return false;
+        batches.pop_front();
+        
+        pthread_mutex_unlock(&mutex);
+        for (int i=0; i<b->jobs.size(); i++)
+            if (b->jobs[i].text.length())
+                out->write(b->jobs[i].text.data(), b->jobs[i].text.length());
+        delete b;
+        pthread_mutex_lock(&mutex);
+        
+        return true;
+    }
+    
+    public:
+    
+    fastdd_block_hasher() {
+        tot_threads = 0;
+        ibs = 512;
+        out = NULL;
+        is_stop = false;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&not_empty, NULL);
+        pthread_cond_init(&done, NULL);
+    }
+    
+    /** start 'tot' threads digesting blocks of 'block_size' bytes with the
+     *  algorithms in 'algorithms'; the lines of the hash file go in 'hash_file' */
+    bool init(int tot, vector<string> &algorithms, int64_t block_size, ostream *hash_file) {
+        for (int i=0; i<algorithms.size(); i++) {
+            const fastdd_md_t *t = fastdd_digest::get_digestbyname(algorithms[i].c_str());
+            if (!t) return false;
+            digest_type.push_back(t);
+            names.push_back(algorithms[i]);
+        }
+        ibs = block_size;
+        out = hash_file;
+        
+        threads.resize(tot);
+        for (tot_threads=0; tot_threads<tot; tot_threads++) {
+            if (pthread_create(&threads[tot_threads], NULL, run, (void *) this))
+                break;
+        }
+        threads.resize(tot_threads);
+        
+        return tot_threads > 0;
+    }
+    
+    /** queue the digests of buff: the lines of its blocks when 'save', the
+     *  digests of the whole buffer in buff->hash when 'check'. buff must not
+     *  change until wait(buff->seq) */
+    void submit(buffer_t *buff, int64_t first_block, uint64_t position, bool save, bool check) {
+        batch_t *b = new batch_t;
+        b->seq = buff->seq;
+        b->first_block = first_block;
+        b->position = position;
+        
+        int64_t blocks = (buff->length + ibs - 1) / ibs;
+        int ranges = (save && blocks) ? ((blocks < tot_threads) ? blocks : tot_threads) : 0;
+        int checks = check ? digest_type.size() : 0;
+        b->jobs.resize(ranges + checks);
+        for (int i=0; i<ranges; i++) {
+            job_t &job = b->jobs[i];
+            job.batch = b;
+            job.buff = buff;
+            job.from = (blocks*i/ranges) * ibs;
+            job.to = (blocks*(i+1)/ranges) * ibs;
+            if (job.to > (int64_t) buff->length) job.to = buff->length;
+            job.algorithm = -1;
+        }
+        for (int i=0; i<checks; i++) {
+            job_t &job = b->jobs[ranges+i];
+            job.batch = b;
+            job.buff = buff;
+            job.from = job.to = 0;
+            job.algorithm = i;
+        }
+        b->pending = b->jobs.size();
+        
+        pthread_mutex_lock(&mutex);
+        while (!batches.empty() && flush_front(false))
+            ;                   // write what is ready
+        batches.push_back(b);
+        for (int i=0; i<b->jobs.size(); i++)
+            todo.push_back(&b->jobs[i]);
+        pthread_cond_broadcast(&not_empty);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** wait for the digests of buffer 'seq' and of the ones before it, and
+     *  write their lines */
+    void wait(uint64_t seq) {
+        pthread_mutex_lock(&mutex);
+        while (!batches.empty() && batches.front()->seq <= seq)
+            flush_front(true);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** write what is left and stop the threads */
+    void finish() {
+        pthread_mutex_lock(&mutex);
+        while (!batches.empty())
+            flush_front(true);
+        is_stop = true;
+        pthread_cond_broadcast(&not_empty);
+        pthread_mutex_unlock(&mutex);
+        
+        for (int i=0; i<threads.size(); i++)
+            pthread_join(threads[i], NULL);
+        threads.clear();
+        if (out) out->flush();
+    }
+    
+    ~fastdd_block_hasher() {
+        if (!is_stop) finish();
+    }
+};
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_MMAP_H
+    #define _FASTDD_MMAP_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <csetjmp>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+/** Input windows of the 'engine=mmap' engine. The input is mapped some
+ *  windows at time; the reader asks views of bs bytes, that always fall in
+ *  one window, and unmaps a window when the last buffer pointing in it has
+ *  been written. Pages that can not be read (truncated file, bad media) raise
+ *  SIGBUS: pin() and copy() catch it so the reader can read them as usual.
+ *  Other threads read a view only while pin() keeps its pages in memory, so
+ *  they do not fault them again; a SIGBUS out of pin() and copy() (the input
+ *  truncated while it is copied) ends fastdd with an error. */
+class fastdd_mmap {
+    private:
+    typedef struct {
+        unsigned char *addr;
+        int64_t start, length;
+        uint64_t last_seq;      // last buffer that has a view in the window
+    } window_t;
+    
+    typedef struct {
+        unsigned char *addr;
+        int64_t length;
+        uint64_t seq;           // buffer that has the view
+    } pinned_t;
+    
+    int fd;
+    int64_t file_size;
+    int64_t window_size;
+    int64_t page_size;
+    vector<window_t> windows;   // oldest first
+    vector<pinned_t> pinned;    // views locked in memory, oldest first
+    
+    string errore;
+    
+    static __thread sigjmp_buf *jump;       // set while pin() or copy() run
+    
+    static void on_sigbus(int sig, siginfo_t *info, void *context) {
+        if (jump)
+            siglongjmp(*jump, 1);
+        
+        // a mapped page gone after pin(): the data of the copy is lost
+        if (info->si_code == BUS_ADRERR) {
+            static const char msg[] = "fastdd: error: engine=mmap: the input can not be read any more (truncated while copying?)\n";
+            if (write(2, msg, sizeof(msg)-1)) { }
+            _exit(1);
+        }
+        
+        signal(SIGBUS, SIG_DFL);            // not ours
+        raise(SIGBUS);
+    }
+    
+    public:
+    
+    fastdd_mmap() {
+        fd = -1;
+        file_size = window_size = 0;
+        page_size = 4096;
+    }
+    
+    /** map the first 'size' bytes of 'fd', 'window' bytes at time (at least
+     *  one buffer of bs bytes) */
+    bool init(int fd, int64_t size, int64_t window, int64_t bs) {
+        file_size = size;
+        page_size = sysconf(_SC_PAGESIZE);
+        window_size = (((window > bs ? window : bs) + page_size - 1) / page_size) * page_size;
+        
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_sigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGBUS, &sa, NULL)) {
+            errore = string("installing SIGBUS handler (") + strerror(errno) + ")";
+            return false;
+        }
+        this->fd = fd;
+        
+        return true;
+    }
+    
+    bool is_ready() { return fd >= 0; }
+    
+    /** the 'len' bytes at 'offset' of the input, seen by buffer 'seq'.
+     *  NULL if they can not be mapped */
+    unsigned char *view(int64_t offset, int64_t len, uint64_t seq) {
+        if (windows.size()) {
+            window_t &w = windows.back();
+            if (w.start <= offset && offset+len <= w.start+w.length) {
+                w.last_seq = seq;
+                return w.addr + (offset-w.start);
+            }
+        }
+        
+        window_t w;
+        w.start = (offset / page_size) * page_size;
+        w.length = (file_size - w.start < window_size) ? file_size - w.start : window_size;
+        if (offset+len > w.start+w.length) {
+            errore = "view beyond the end of the input";
+            return NULL;
+        }
+        
+        w.addr = (unsigned char *) mmap(NULL, w.length, PROT_READ, MAP_SHARED, fd, w.start);
+        if (w.addr == MAP_FAILED) {
+            errore = string("mmap failed (") + strerror(errno) + ")";
+            return NULL;
+        }
+        madvise(w.addr, w.length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise(w.addr, w.length, MADV_HUGEPAGE);     // only a hint, file systems may refuse it
+#endif
+        w.last_seq = seq;
+        windows.push_back(w);
+        
+        return w.addr + (offset-w.start);
+    }
+    
+    /** unlock the views and unmap the windows whose buffers are all before
+     *  'seq' (already written) */
+    void retire(uint64_t seq) {
+        while (pinned.size() && pinned.front().seq < seq) {
+            munlock(pinned.front().addr, pinned.front().length);
+            pinned.erase(pinned.begin());
+        }
+        while (windows.size() > 1 && windows.front().last_seq < seq) {
+            munmap(windows.front().addr, windows.front().length);
+            windows.erase(windows.begin());
+        }
+    }
+    
+    /** fault in the pages of the view of buffer 'seq' and lock them in memory
+     *  until retire(): the buffer can be the view itself. False if a page
+     *  raises SIGBUS or can not be locked (RLIMIT_MEMLOCK): copy() it then.
+     *  The view must start at a page, so no page is shared by two views */
+    bool pin(unsigned char *p, int64_t len, uint64_t seq) {
+        if ((uintptr_t) p % page_size) {
+            errore = "view not aligned to a page";
+            return false;
+        }
+        
+        sigjmp_buf env;
+        if (sigsetjmp(env, 1)) {
+            jump = NULL;
+            errore = "SIGBUS reading the mapped input";
+            return false;
+        }
+        
+        jump = &env;
+        volatile unsigned char sum = 0;
+        for (int64_t i=0; i<len; i+=page_size)
+            sum += p[i];
+        if (len)
+            sum += p[len-1];
+        jump = NULL;
+        
+        if (mlock(p, len)) {
+            errore = string("locking the view (") + strerror(errno) + ")";
+            return false;
+        }
+        pinned_t v;
+        v.addr = p;
+        v.length = len;
+        v.seq = seq;
+        pinned.push_back(v);
+        
+        return true;
+    }
+    
+    /** copy the 'len' bytes of a view in dst; false if a page raises SIGBUS */
+    bool copy(unsigned char *dst, const unsigned char *p, int64_t len) {
+        sigjmp_buf env;
+        if (sigsetjmp(env, 1)) {
+            jump = NULL;
+            errore = "SIGBUS reading the mapped input";
+            return false;
+        }
+        
+        jump = &env;
+        memcpy(dst, p, len);
+        jump = NULL;
+        
+        return true;
+    }
+    
+    string get_error() { return errore; }
+    
+    ~fastdd_mmap() {
+        for (int i=0; i<pinned.size(); i++)
+            munlock(pinned[i].addr, pinned[i].length);
+        for (int i=0; i<windows.size(); i++)
+            munmap(windows[i].addr, windows[i].length);
+    }
+};
+
+__thread sigjmp_buf *fastdd_mmap::jump = NULL;
+
+#endif
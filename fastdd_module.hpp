@@ -27,6 +27,9 @@
 
 using namespace std;
 
+// number with K, M... suffix of a BYTES operand (in fastdd.cpp)
+int64_t init_read_suffixed_number(string number);
+
 class fastdd_module {
     public:
 
@@ -45,6 +48,13 @@ class fastdd_module {
     // set 'operand' equals to value, true on success
     virtual bool set_operand(string operand, string value) { return false; }
 
+    // true if the module only looks at the data, without changing it: then
+    // the buffers it gets can be read-only views of the input (engine=mmap)
+    virtual bool is_inspect_only(void) { return false; }
+    // true if the transformation of a buffer does not depend on the buffers
+    // before it: the module stage can then transform more buffers at the same time
+    virtual bool is_stateless(void) { return false; }
+
     // true if 'flag' is a fastdd command line flag (--flag)
     virtual bool is_flag(string flag) { return false; }
     // set flag=true (--flag), true on success
@@ -54,6 +64,17 @@ class fastdd_module {
     // transform buffer buff, according to the command line flags and operands
     // return true if no error occur
     virtual bool transform(buffer_t *buff) { return false; }
+
+    // API v2: modules that return 2 do not change buff in place, they write
+    // their output (of any size) in a buffer of the pipeline, that takes the
+    // place of the input one. Modules returning 1 use transform()
+    virtual int get_api_version(void) { return 1; }
+    // API v2: the largest output the module can give for the input in
+    virtual uint64_t get_max_output(const buffer_t *in) { return in->length; }
+    // API v2: transform the data of in (read-only) writing it in out, that
+    // can hold capacity bytes (at least get_max_output(in)); *out_length is
+    // set to the bytes written. Return true if no error occur
+    virtual bool transform_to(const buffer_t *in, unsigned char *out, uint64_t capacity, uint64_t *out_length) { return false; }
     // get error occurred after transform
     virtual string get_error(void) { return ""; }
     
@@ -272,6 +272,9 @@ class fastdd_module_conv : public fastdd_module {
         return false;
     }
 
+    // every byte is converted by itself
+    bool is_stateless(void) { return true; }
+
     bool transform(buffer_t *buff) {
         for (uint64_t a=0; a<buff->length; a++) {
             buff->buffer[a] = trans_table[buff->buffer[a]];
@@ -28,25 +28,65 @@
 #include <cstdio>
 #include <stdint.h>
 #include <cstring>
+#include <vector>
+#include <pthread.h>
 #include "fastdd_t.hpp"
 #include "fastdd_module.hpp"
+#include "fastdd_gzip_index.hpp"
 #include <zlib.h>
 
 using namespace std;
 
+#ifndef GZIP_THREAD_BLOCK
+#define GZIP_THREAD_BLOCK (128<<10)     // bytes deflated by a thread at time (compression-threads=N)
+#endif
+#define GZIP_WINDOW 32768
+#ifndef GZIP_INDEX_INTERVAL
+#define GZIP_INDEX_INTERVAL (4<<20)     // default uncompressed bytes of a member with gzip-index
+#endif
+
 class fastdd_module_gzip : public fastdd_module {
     private:
+    // compression-threads=N: a block of the buffer, deflated on its own
+    typedef struct {
+        const unsigned char *in;
+        int64_t in_len;
+        const unsigned char *dict;      // the 32K before 'in'
+        int dict_len;
+        bool is_first;                  // first block of a member
+        bool is_final;                  // last block of a member
+        vector<unsigned char> out;
+        uLong crc;
+    } block_t;
+    
     int compression_level;
     int chunk;
     bool is_std_of;
     bool is_act;
-    buffer_t *buffer_orig;
     settings_t *settings;
-    int64_t buffer_l, buffer_max;
-    unsigned char *local_buffer;
     string errore;
     z_stream strm;
     
+    int tot_threads;
+    vector<pthread_t> threads;
+    vector<block_t> blocks;
+    int next_block, blocks_done;
+    bool is_stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // blocks to deflate (or stop)
+    pthread_cond_t done;        // all the blocks are deflated
+    unsigned char window[GZIP_WINDOW];  // end of the previous buffer
+    int window_len;
+    uLong crc;                  // of the data of the current member
+    uint64_t member_in;         // bytes of the current member
+    uint64_t total_in, total_out;
+    uint64_t tot_members;
+    
+    // gzip-index=FILE: a member every index_interval bytes, listed in the index
+    string index_file_name;
+    uint64_t index_interval;
+    fastdd_gzip_index index;
+    
     ////// SOURCE of the zlib code:
     /*-zpipe.c: example of proper use of zlib's inflate() and deflate()
    Not copyrighted -- provided to the public domain
@@ -75,17 +115,183 @@ class fastdd_module_gzip : public fastdd_module {
         }
     }*/
     
+    static void *run(void *arg) {
+        fastdd_module_gzip *m = (fastdd_module_gzip *) arg;
+        
+        // raw deflate: the gzip header and trailer are made by transform_threads
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        bool ok = deflateInit2(&zs, m->compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        
+        pthread_mutex_lock(&m->mutex);
+        while (true) {
+            while (m->next_block == m->blocks.size() && !m->is_stop)
+                pthread_cond_wait(&m->work, &m->mutex);
+            if (m->is_stop)
+                break;
+            block_t *b = &m->blocks[m->next_block++];
+            pthread_mutex_unlock(&m->mutex);
+            
+            if (ok)
+                ok = m->deflate_block(&zs, b);
+            
+            pthread_mutex_lock(&m->mutex);
+            if (!ok) m->errore = "deflate failed";
+            if (++m->blocks_done == m->blocks.size())
+                pthread_cond_broadcast(&m->done);
+        }
+        pthread_mutex_unlock(&m->mutex);
+        
+        deflateEnd(&zs);
+        return NULL;
+    }
+    
+    /** deflate a block: it ends on a byte boundary (sync flush), so the blocks
+     *  can be put one after the other, unless it is the last one */
+    bool deflate_block(z_stream *zs, block_t *b) {
+        b->crc = crc32(0L, b->in, b->in_len);
+        b->out.resize(deflateBound(zs, b->in_len) + 16);
+        
+        if (deflateReset(zs) != Z_OK)
+            return false;
+        if (b->dict_len && deflateSetDictionary(zs, b->dict, b->dict_len) != Z_OK)
+            return false;
+        zs->next_in = (Bytef *) b->in;
+        zs->avail_in = b->in_len;
+        zs->next_out = &b->out[0];
+        zs->avail_out = b->out.size();
+        int ret = deflate(zs, (b->is_final) ? Z_FINISH : Z_SYNC_FLUSH);
+        if (ret == Z_STREAM_ERROR || zs->avail_in || (b->is_final && ret != Z_STREAM_END))
+            return false;
+        b->out.resize(b->out.size() - zs->avail_out);
+        return true;
+    }
+    
+    /** transform with compression-threads=N or gzip-index: the buffer is cut
+     *  in blocks deflated at the same time, each with the 32K before it in its
+     *  member as dictionary, and joined in gzip members */
+    bool transform_threads(const buffer_t *buff, unsigned char *dest, uint64_t capacity, uint64_t *out_length) {
+        int64_t len = buff->length;
+        
+        pthread_mutex_lock(&mutex);
+        int tot = 0;
+        int64_t pos = 0;
+        uint64_t m_in = member_in;
+        while (pos < len || (!pos && buff->is_last && (m_in || !tot_members))) {
+            int64_t n = (len-pos < GZIP_THREAD_BLOCK) ? len-pos : GZIP_THREAD_BLOCK;
+            if (index_interval && (uint64_t) n > index_interval-m_in)
+                n = index_interval-m_in;
+            
+            if (tot == blocks.size())
+                blocks.resize(tot+1);
+            block_t &b = blocks[tot++];
+            b.in = buff->buffer + pos;
+            b.in_len = n;
+            b.is_first = !m_in;
+            // inside a buffer the dictionary is just before the block, else it is the saved window
+            b.dict_len = (m_in < GZIP_WINDOW) ? m_in : GZIP_WINDOW;
+            b.dict = (pos >= b.dict_len) ? b.in - b.dict_len : window + window_len - b.dict_len;
+            
+            pos += n;
+            m_in += n;
+            b.is_final = (index_interval && m_in == index_interval) || (buff->is_last && pos == len);
+            if (b.is_final) m_in = 0;
+            if (!n) break;              // the end of the stream (or an empty stream)
+        }
+        blocks.resize(tot);
+        next_block = blocks_done = 0;
+        pthread_cond_broadcast(&work);
+        while (blocks_done < blocks.size())
+            pthread_cond_wait(&done, &mutex);
+        pthread_mutex_unlock(&mutex);
+        if (errore.length())
+            return false;
+        
+        // the next buffer starts with the end of this one as dictionary
+        int keep = (len < GZIP_WINDOW) ? len : GZIP_WINDOW;
+        if (keep < GZIP_WINDOW) {
+            int old = (window_len < GZIP_WINDOW-keep) ? window_len : GZIP_WINDOW-keep;
+            memmove(window, window+window_len-old, old);
+            window_len = old;
+        }
+        else
+            window_len = 0;
+        memcpy(window+window_len, buff->buffer+len-keep, keep);
+        window_len += keep;
+        
+        // headers, blocks, trailers
+        uint64_t out = 0;
+        for (int i=0; i<tot; i++) {
+            block_t &b = blocks[i];
+            if (out + b.out.size() + 18 > capacity) {
+                errore = "compressed data does not fit in the buffer";
+                return false;
+            }
+            
+            if (b.is_first) {
+                static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+                if (index_file_name.length())
+                    index.add(total_in, total_out+out);
+                memcpy(dest+out, header, 10);
+                out += 10;
+                crc = crc32(0L, Z_NULL, 0);
+                member_in = 0;
+                tot_members++;
+            }
+            
+            memcpy(dest+out, &b.out[0], b.out.size());
+            out += b.out.size();
+            crc = crc32_combine(crc, b.crc, b.in_len);
+            member_in += b.in_len;
+            total_in += b.in_len;
+            
+            if (b.is_final) {
+                for (int j=0; j<4; j++)
+                    dest[out+j] = (unsigned char) (crc >> (8*j));
+                for (int j=0; j<4; j++)
+                    dest[out+4+j] = (unsigned char) (member_in >> (8*j));
+                out += 8;
+                member_in = 0;
+            }
+        }
+        *out_length = out;
+        total_out += out;
+        
+        if (buff->is_last) {
+            is_act = false;
+            if (index_file_name.length()) {
+                index.set_interval(index_interval);
+                index.set_length(total_in);
+                if (!index.save(index_file_name.c_str())) {
+                    errore = index.get_error();
+                    return false;
+                }
+            }
+        }
+        
+        return true;
+    }
+    
     public:
     
-    fastdd_module_gzip(settings_t *settings_, buffer_t *buffer_) {
+    fastdd_module_gzip(settings_t *settings_) {
         is_std_of = false;
         is_act = false;
         compression_level=6;
         settings = settings_;
-        buffer_l = buffer_max = 0;
         chunk = -1;
-        buffer_orig = buffer_;
-        local_buffer = (unsigned char *) 0;
+        tot_threads = 1;
+        next_block = blocks_done = 0;
+        is_stop = false;
+        window_len = 0;
+        crc = crc32(0L, Z_NULL, 0);
+        member_in = total_in = total_out = tot_members = 0;
+        index_interval = 0;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work, NULL);
+        pthread_cond_init(&done, NULL);
     }
 
     bool validate() {
@@ -114,27 +320,29 @@ class fastdd_module_gzip : public fastdd_module {
             return false;
         }
         
-        buffer_max = settings->bs+262144;
-        local_buffer = (unsigned char *) malloc(buffer_max*sizeof(unsigned char));
+        if (index_file_name.length() && !index_interval)
+            index_interval = GZIP_INDEX_INTERVAL;
         
-        // ingrandisco i buffer originali
-        free(buffer_orig->buffer);
-        free(buffer_orig->the_other_buffer->buffer);
-
-        int t = posix_memalign( (void **) &(buffer_orig->buffer), 512, buffer_max);
-        if (t) {
-            errore = "couldn't reallocate buffers";
-            is_act = false;
-            return false;
-        }
-
-        t = posix_memalign( (void **) &(buffer_orig->the_other_buffer->buffer), 512, buffer_max);
-        if (t) {
-            errore = "couldn't reallocate buffers";
-            is_act = false;
-            return false;
+        if (tot_threads > 1 || index_file_name.length()) {
+            threads.resize(tot_threads);
+            for (int i=0; i<tot_threads; i++) {
+                if (pthread_create(&threads[i], NULL, run, (void *) this)) {
+                    threads.resize(i);
+                    break;
+                }
+            }
+            if (threads.size()) {
+                is_act = true;
+                return true;
+            }
+            if (index_file_name.length()) {
+                errore = "unable to start the compression threads";
+                is_act = false;
+                return false;
+            }
+            tot_threads = 1;        // no threads: the usual single stream
         }
-
+        
     /* allocate deflate state */
         strm.zalloc = Z_NULL;
         strm.zfree = Z_NULL;
@@ -152,9 +360,19 @@ class fastdd_module_gzip : public fastdd_module {
     string get_name() { return "fastdd_module_gzip"; }
 
     bool is_active() { return is_act; }
+    
+    int get_api_version() { return 2; }
+    
+    uint64_t get_max_output(const buffer_t *in) {
+        uint64_t max = in->length + 262144;
+        if (index_interval)         // a header and a trailer for every member
+            max += (in->length/index_interval+2)*18;
+        return max;
+    }
 
     bool is_operand(string operand) {
-        return (!operand.compare("compression") || !operand.compare("chunk"));
+        return (!operand.compare("compression") || !operand.compare("chunk") || !operand.compare("compression-threads") ||
+            !operand.compare("gzip-index") || !operand.compare("gzip-index-interval"));
     }
 
     bool set_operand(string operand, string value) {
@@ -177,6 +395,26 @@ class fastdd_module_gzip : public fastdd_module {
             }
             return true;
         }
+        else if (!operand.compare("compression-threads")) {
+            tot_threads = atoi(value.c_str());
+            if (tot_threads<1 || tot_threads>256) {
+                errore = "invalid compression-threads (must be between 1 and 256)";
+                return false;
+            }
+            return true;
+        }
+        else if (!operand.compare("gzip-index")) {
+            index_file_name = value;
+            return true;
+        }
+        else if (!operand.compare("gzip-index-interval")) {
+            index_interval = init_read_suffixed_number(value);
+            if (index_interval < 65536) {
+                errore = "invalid gzip-index-interval (must be >= 65536)";
+                return false;
+            }
+            return true;
+        }
         
         errore = "invalid operand";
         return false;
@@ -190,27 +428,29 @@ class fastdd_module_gzip : public fastdd_module {
         return false;
     }
 
-    bool transform(buffer_t *buff) {
+    bool transform_to(const buffer_t *buff, unsigned char *out, uint64_t capacity, uint64_t *out_length) {
+        if (threads.size())
+            return transform_threads(buff, out, capacity, out_length);
+        
         int flush = (buff->is_last) ? Z_FINISH : Z_NO_FLUSH;
         strm.next_in = buff->buffer;
         strm.avail_in = buff->length;
 
-        int chunk_offset=0;
+        uint64_t chunk_offset=0;
         
         do {
-            strm.avail_out = chunk;
-            strm.next_out = local_buffer+chunk_offset;
-            int ret = deflate(&strm, flush);
-            int have = chunk - strm.avail_out;
-         //   cerr << chunk_offset << " -" << have << endl;
-            chunk_offset += have;
+            if (chunk_offset == capacity) {
+                errore = "compressed data does not fit in the buffer";
+                return false;
+            }
+            int step = (capacity-chunk_offset < chunk) ? capacity-chunk_offset : chunk;
+            strm.avail_out = step;
+            strm.next_out = out+chunk_offset;
+            deflate(&strm, flush);
+            chunk_offset += step - strm.avail_out;
         } while (strm.avail_out == 0);
         
-  //      cerr << chunk_offset << endl;
-        memcpy(buff->buffer, local_buffer, chunk_offset);
-        buff->length = chunk_offset;
-        
-  //      cerr << buff->length << endl;
+        *out_length = chunk_offset;
         
         if (buff->is_last) {
             (void)deflateEnd(&strm);
@@ -234,6 +474,14 @@ class fastdd_module_gzip : public fastdd_module {
         ss << "      checking among input and output files should not be used.\n";
         ss << "   chunk=BYTES\n";
         ss << "      set the compression window (default: min(16K,bs) )\n";
+        ss << "   compression-threads=N\n";
+        ss << "      deflate blocks of 128K of every buffer on N threads at the same time,\n" <<
+              "      each primed with the 32K before it, in a single gzip member (default: 1)\n";
+        ss << "   gzip-index=FILE\n";
+        ss << "      write independent gzip members and save in FILE where each one starts,\n" <<
+              "      so the image can be read back in part with if-gzip-index=FILE\n";
+        ss << "   gzip-index-interval=BYTES\n";
+        ss << "      uncompressed bytes of every member with gzip-index (default: 4194304)\n";
         
         cerr << ss.str() << endl;
         
@@ -241,8 +489,12 @@ class fastdd_module_gzip : public fastdd_module {
     }
     
     ~fastdd_module_gzip() {
-        if (local_buffer)
-            free(local_buffer);
+        pthread_mutex_lock(&mutex);
+        is_stop = true;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+        for (int i=0; i<threads.size(); i++)
+            pthread_join(threads[i], NULL);
     }
 };
 
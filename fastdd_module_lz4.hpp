@@ -0,0 +1,316 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_MODULE_LZ4_H
+    #define _FASTDD_MODULE_LZ4_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+#include "fastdd_t.hpp"
+#include "fastdd_module.hpp"
+#include <lz4.h>
+#ifndef XXH_INLINE_ALL
+#define XXH_INLINE_ALL
+#endif
+#include <xxhash.h>
+
+using namespace std;
+
+// LZ4 frame format
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50     // the last 4 bits are free
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_INDEPENDENT 0x20
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID 0x01
+#define LZ4_UNCOMPRESSED 0x80000000        // block size flag: the block is stored
+#define LZ4_BLOCK_SIZE(code) (1 << (8+2*(code)))    // code 4-7 of BD: 64K, 256K, 1M, 4M
+
+/** LZ4 compression of the buffers in the LZ4 frame format, with independent
+ *  blocks (lz4-block=BYTES): the blocks of a buffer are compressed at the same
+ *  time by lz4-threads=N threads, and the frame keeps the XXH32 of the data
+ *  (content checksum) to check it when decompressing. It is a v2 module: the
+ *  frame is assembled in a buffer of the pool */
+class fastdd_module_lz4 : public fastdd_module {
+    private:
+    typedef struct {
+        const unsigned char *in;
+        int in_len;
+        vector<unsigned char> out;
+        int out_len;
+    } block_t;
+    
+    int acceleration;
+    int block_code;             // BD of the frame
+    int tot_threads;
+    bool is_act;
+    bool is_header_written;
+    settings_t *settings;
+    string errore;
+    XXH32_state_t checksum;
+    
+    vector<pthread_t> threads;
+    vector<block_t> blocks;
+    int next_block, blocks_done;
+    bool is_stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // blocks to compress (or stop)
+    pthread_cond_t done;        // all the blocks are compressed
+    
+    static void *run(void *arg) {
+        fastdd_module_lz4 *m = (fastdd_module_lz4 *) arg;
+        
+        pthread_mutex_lock(&m->mutex);
+        while (true) {
+            while (m->next_block == m->blocks.size() && !m->is_stop)
+                pthread_cond_wait(&m->work, &m->mutex);
+            if (m->is_stop)
+                break;
+            block_t *b = &m->blocks[m->next_block++];
+            pthread_mutex_unlock(&m->mutex);
+            
+            m->compress_block(b);
+            
+            pthread_mutex_lock(&m->mutex);
+            if (++m->blocks_done == m->blocks.size())
+                pthread_cond_broadcast(&m->done);
+        }
+        pthread_mutex_unlock(&m->mutex);
+        
+        return NULL;
+    }
+    
+    /** out_len 0: the block does not shrink, it is stored as it is */
+    void compress_block(block_t *b) {
+        b->out.resize(LZ4_compressBound(b->in_len));
+        b->out_len = LZ4_compress_fast((const char *) b->in, (char *) &b->out[0], b->in_len, b->in_len-1, acceleration);
+    }
+    
+    static void put32(unsigned char *p, uint32_t v) {
+        for (int i=0; i<4; i++)
+            p[i] = (unsigned char) (v >> (8*i));
+    }
+    
+    public:
+    
+    fastdd_module_lz4(settings_t *settings_) {
+        acceleration = 1;
+        block_code = 6;
+        tot_threads = 1;
+        is_act = false;
+        is_header_written = false;
+        settings = settings_;
+        next_block = blocks_done = 0;
+        is_stop = false;
+        XXH32_reset(&checksum, 0);
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work, NULL);
+        pthread_cond_init(&done, NULL);
+    }
+
+    bool validate() {
+        if (!is_act) return true;
+        
+        if (settings->is_direct_o && settings->seek) {
+            settings->is_direct_o = false;
+            settings->seek=0;
+
+            errore = "compression requires to disable direct I/O in output files (-o) and to not seek output files";
+            is_act = false;
+            return false;
+        }
+        
+        int64_t tot_blocks = settings->bs/LZ4_BLOCK_SIZE(block_code) + 1;
+        if (tot_threads > 1 && tot_blocks > 1) {
+            threads.resize(tot_threads);
+            for (int i=0; i<tot_threads; i++) {
+                if (pthread_create(&threads[i], NULL, run, (void *) this)) {
+                    threads.resize(i);
+                    break;
+                }
+            }
+        }
+        
+        return true;
+    }
+
+    string get_name() { return "fastdd_module_lz4"; }
+
+    bool is_active() { return is_act; }
+    
+    int get_api_version() { return 2; }
+    
+    // 4 bytes more for every block, the frame header and its end
+    uint64_t get_max_output(const buffer_t *in) {
+        return in->length + (in->length/LZ4_BLOCK_SIZE(block_code) + 1)*4 + 15;
+    }
+
+    bool is_operand(string operand) {
+        return (!operand.compare("lz4") || !operand.compare("lz4-threads") || !operand.compare("lz4-block"));
+    }
+
+    bool set_operand(string operand, string value) {
+        if (!operand.compare("lz4")) {
+            acceleration = atoi(value.c_str());
+            if (acceleration<1 || acceleration>65537) {
+                errore = "invalid lz4 acceleration (must be between 1 and 65537)";
+                return false;
+            }
+            is_act = true;
+            return true;
+        }
+        else if (!operand.compare("lz4-threads")) {
+            tot_threads = atoi(value.c_str());
+            if (tot_threads<1 || tot_threads>256) {
+                errore = "invalid lz4-threads (must be between 1 and 256)";
+                return false;
+            }
+            return true;
+        }
+        else if (!operand.compare("lz4-block")) {
+            int64_t size = init_read_suffixed_number(value);
+            for (block_code=4; block_code<=7 && LZ4_BLOCK_SIZE(block_code) != size; block_code++) ;
+            if (block_code > 7) {
+                errore = "invalid lz4-block (must be 65536, 262144, 1048576 or 4194304)";
+                return false;
+            }
+            return true;
+        }
+        
+        errore = "invalid operand";
+        return false;
+    }
+
+    bool is_flag(string flag) {
+        return false;
+    }
+    
+    bool set_flag(string flag) {
+        return false;
+    }
+
+    bool transform_to(const buffer_t *buff, unsigned char *dest, uint64_t capacity, uint64_t *out_length) {
+        int64_t len = buff->length;
+        int block_size = LZ4_BLOCK_SIZE(block_code);
+        int tot = (len + block_size - 1) / block_size;
+        
+        XXH32_update(&checksum, buff->buffer, len);
+        
+        pthread_mutex_lock(&mutex);
+        blocks.resize(tot);
+        for (int i=0; i<tot; i++) {
+            int64_t from = (int64_t) i*block_size;
+            blocks[i].in = buff->buffer + from;
+            blocks[i].in_len = (len-from < block_size) ? len-from : block_size;
+        }
+        if (threads.size() && tot > 1) {
+            next_block = blocks_done = 0;
+            pthread_cond_broadcast(&work);
+            while (blocks_done < blocks.size())
+                pthread_cond_wait(&done, &mutex);
+        }
+        else {
+            for (int i=0; i<tot; i++)
+                compress_block(&blocks[i]);
+        }
+        pthread_mutex_unlock(&mutex);
+        
+        // the stored blocks are copied as they are
+        uint64_t out = (is_header_written) ? 0 : 7;
+        for (int i=0; i<tot; i++)
+            out += 4 + ((blocks[i].out_len > 0) ? blocks[i].out_len : blocks[i].in_len);
+        if (buff->is_last)
+            out += 8;
+        if (out > capacity) {
+            errore = "compressed data does not fit in the buffer";
+            return false;
+        }
+        uint64_t at = (is_header_written) ? 0 : 7;
+        for (int i=0; i<tot; i++) {
+            if (blocks[i].out_len > 0) {
+                put32(dest+at, blocks[i].out_len);
+                memcpy(dest+at+4, &blocks[i].out[0], blocks[i].out_len);
+                at += 4 + blocks[i].out_len;
+            }
+            else {
+                put32(dest+at, blocks[i].in_len | LZ4_UNCOMPRESSED);
+                memcpy(dest+at+4, blocks[i].in, blocks[i].in_len);
+                at += 4 + blocks[i].in_len;
+            }
+        }
+        
+        if (!is_header_written) {
+            unsigned char *h = dest;
+            put32(h, LZ4_FRAME_MAGIC);
+            h[4] = LZ4_FLG_VERSION | LZ4_FLG_INDEPENDENT | LZ4_FLG_CONTENT_CHECKSUM;
+            h[5] = block_code << 4;
+            h[6] = (XXH32(h+4, 2, 0) >> 8) & 0xff;
+            is_header_written = true;
+        }
+        if (buff->is_last) {
+            put32(dest+out-8, 0);       // end mark
+            put32(dest+out-4, XXH32_digest(&checksum));
+            is_act = false;
+        }
+        *out_length = out;
+        
+        return true;
+    }
+
+    string get_error() {
+        return errore;
+    }
+    
+    string get_help() {
+        stringstream ss;
+        ss << "   LZ4 COMPRESSION\n";
+        ss << "   lz4=ACCELERATION\n";
+        ss << "      compress the output in the LZ4 frame format, faster for higher\n" <<
+              "      ACCELERATION (1 gives the best compression). Like compression=, hashes\n" <<
+              "      of the output differ from the input. Restore it with decode=lz4\n";
+        ss << "   lz4-threads=N\n";
+        ss << "      compress the blocks of every buffer on N threads (default: 1)\n";
+        ss << "   lz4-block=BYTES\n";
+        ss << "      size of the independent blocks: 65536, 262144, 1048576 (default) or\n" <<
+              "      4194304. Use a bs of some blocks per thread\n";
+        
+        return ss.str();
+    }
+    
+    ~fastdd_module_lz4() {
+        pthread_mutex_lock(&mutex);
+        is_stop = true;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+        for (int i=0; i<threads.size(); i++)
+            pthread_join(threads[i], NULL);
+    }
+};
+
+#endif
@@ -39,6 +39,8 @@
 
 using namespace std;
 
+#define REGEX_OVERLAP 4096      // default of regex-overlap
+
 class fastdd_module_regex : public fastdd_module {
     private:
     bool is_simple_regex_match;
@@ -58,6 +60,66 @@ class fastdd_module_regex : public fastdd_module {
     settings_t *settings;
     uint64_t ibs;
     
+    // matches across two buffers: the end of the previous one is searched again
+    // together with the begin of the next one
+    uint64_t overlap;           // longest match found across two buffers
+    bool is_overlap_set;
+    vector<unsigned char> tail; // end of the previous buffer
+    uint64_t tail_position;     // position of tail in the input
+    vector<unsigned char> seam; // tail followed by the begin of the current buffer
+    vector<uint64_t> resume;    // for every regex, where the matches not reported yet can start
+    
+    /** print a match of regex j, of length bytes at position of the input */
+    void report(int j, uint64_t position, const unsigned char *data, int64_t length) {
+        ofstream_regex << setbase(10) << j << " " << (position/ibs) << " " << position << " " << length << " ";
+        if (is_human_readable_regex_match) {
+            string word = string((const char *) data, length);
+            ofstream_regex << word;
+        }
+        else {
+            for (int temp=0; temp<length; temp++) {
+                ofstream_regex << setw(2) << setfill('0') << setbase(16) << (data[temp] & 255);
+            }
+        }
+        ofstream_regex << " " << pm.get_partition_at(position) << endl;
+    }
+    
+    /** flags of a search of a window of the input: end anchors ($, \b, ...)
+     *  match only at the end of the input, and a match cut by the end of a
+     *  window that is not the last one comes back as partial */
+    static boost::match_flag_type search_flags(bool from, bool is_end) {
+        boost::match_flag_type flags = (from) ? boost::match_prev_avail : boost::match_default;
+        if (!is_end)
+            flags |= boost::match_not_eob | boost::match_not_eol | boost::match_not_eow | boost::match_partial;
+        return flags;
+    }
+    
+    /** the matches of regex j starting in the tail, that can end in the buffer
+     *  at position; is_end if the seam ends where the input ends */
+    void search_seam(int j, uint64_t position, bool is_end) {
+        const char *begin = (const char *) &seam[0];
+        const char *from = begin + (resume[j] - tail_position);
+        boost::cregex_iterator m1(from, begin + seam.size(), re[j], search_flags(from > begin, is_end));
+        boost::cregex_iterator m2;
+        while (!(m1 == m2)) {
+            const boost::cmatch &m = *m1;
+            uint64_t start = tail_position + (m[0].first - begin);
+            if (start >= position) break;       // the search of the buffer finds it
+            if (!m[0].matched) {        // partial: it goes on after the seam, look past its start
+                const char *next = m[0].first + 1;
+                m1 = boost::cregex_iterator(next, begin + seam.size(), re[j], search_flags(true, is_end));
+                continue;
+            }
+            if (m.length(0)>0) {
+                report(j, start, (const unsigned char *) m[0].first, m.length(0));
+                resume[j] = tail_position + (m[0].second - begin);
+            }
+            m1++;
+        }
+        if (resume[j] < position)
+            resume[j] = position;
+    }
+    
     /** read regexes from file given with option find= */
     bool init_regexes_from_file(const char *file_with_regex) {
         ifstream fi;
@@ -103,6 +165,9 @@ class fastdd_module_regex : public fastdd_module {
         is_human_readable_regex_match = false;
         fi = fi_;
         settings = settings_;
+        overlap = REGEX_OVERLAP;
+        is_overlap_set = false;
+        tail_position = 0;
     }
     
     bool validate() {
@@ -115,6 +180,13 @@ class fastdd_module_regex : public fastdd_module {
         
         pm = partition_manager((*fi)->file_name);
         ibs = settings->ibs;
+        if (overlap >= (uint64_t) settings->bs) {
+            if (is_overlap_set) {
+                error = "regex-overlap must be smaller than bs";
+                return false;
+            }
+            overlap = settings->bs/2;   // the default shrinks with small buffers
+        }
         
         return true;
     }
@@ -128,7 +200,8 @@ class fastdd_module_regex : public fastdd_module {
     }
     
     bool is_operand(string operand) {
-        return (!operand.compare("pattern-file") || !operand.compare("find-regex") || !operand.compare("pattern-matching-results"));
+        return (!operand.compare("pattern-file") || !operand.compare("find-regex") || !operand.compare("pattern-matching-results") ||
+            !operand.compare("regex-overlap"));
     }
     
     bool set_operand(string operand, string value) {
@@ -160,6 +233,15 @@ class fastdd_module_regex : public fastdd_module {
             }
             return true;
         }
+        else if (!operand.compare("regex-overlap")) {
+            overlap = init_read_suffixed_number(value);
+            is_overlap_set = true;
+            if (overlap > (1<<30)) {
+                error = "invalid regex-overlap (must be between 0 and 1073741824)";
+                return false;
+            }
+            return true;
+        }
         
         return false;
     }
@@ -182,72 +264,102 @@ class fastdd_module_regex : public fastdd_module {
         return false;
     }
 
+    // the matches are only reported, the data is left as it is
+    bool is_inspect_only(void) { return true; }
+
     bool transform(buffer_t *buff) {
-        boost::smatch what;
+        boost::cmatch what;
         
         if (is_get_partition) {
             if (is_first_block) {
                 next_needed = pm.update(buff->buffer, 0);
                 is_first_block=false;
             }
-            else if ((*fi)->current_position <= next_needed && next_needed < (*fi)->current_position + buff->length)  {
+            else if (buff->position <= next_needed && next_needed < buff->position + buff->length)  {
                // cout << fi->current_position << " " << next_needed << " " << fi->current_position + buff->length;
-                next_needed = pm.update(buff->buffer+(next_needed - (*fi)->current_position), next_needed);
+                next_needed = pm.update(buff->buffer+(next_needed - buff->position), next_needed);
             }
             if (pm.is_error()) is_get_partition=false;
         }
         
         int j;
-        string search_buffer(buff->buffer, buff->buffer+buff->length);
+        // search the buffer in place, it can be a view of the mapped input
+        const char *search_begin = (const char *) buff->buffer;
+        const char *search_end = search_begin + buff->length;
         int l=re.size();
-        for (j=0; j<l; j++) {
-            if (is_simple_regex_match) {  // write just if there is a match in this block
-                bool result = boost::regex_search(search_buffer , what, re[j]);
+        
+        if (is_simple_regex_match) {
+            for (j=0; j<l; j++) {  // write just if there is a match in this block
+                bool result = boost::regex_search(search_begin, search_end, what, re[j],
+                    (buff->is_last) ? boost::match_default : boost::match_not_eob | boost::match_not_eol | boost::match_not_eow);
                 if (result) {
                     ofstream_regex << "matches found for regex "<<j<<" in input block " << setw(10)
-                        << setfill(' ') <<setbase(10) <<((*fi)->current_position + what.position())
-                        << ": " << setw(16) << setbase(16) << setfill('0') << (*fi)->current_position << "-"
-                        << setw(16) << setbase(16) << setfill('0') << ((*fi)->current_position+buff->length) << endl;
+                        << setfill(' ') <<setbase(10) <<(buff->position + what.position())
+                        << ": " << setw(16) << setbase(16) << setfill('0') << buff->position << "-"
+                        << setw(16) << setbase(16) << setfill('0') << (buff->position+buff->length) << endl;
                 }
             }
-            else { // print in find_file_output all information
-                try {
-                    boost::sregex_iterator m1(search_buffer.begin(), search_buffer.end(), re[j], boost::match_default | boost::match_partial);
-                    boost::sregex_iterator m2;
-
-                    if (m1==m2) continue;
-                    
-                    do {
-                        boost::smatch m = *m1;
-                        
-                        if (m.length(0)>0) {
-                            if (!m[0].matched) ofstream_regex << "? ";
-                            
-                            ofstream_regex << setbase(10) << j << " " << (((*fi)->current_position+m.position())/ibs ) << " " <<
-                                ((*fi)->current_position+m.position()) << " " << m.length(0) << " ";
-                            if (is_human_readable_regex_match) {
-                                string word = string(search_buffer, m.position(), m.length(0));
-                                ofstream_regex << word;
-                            }
-                            else {
-                                for (int temp=0; temp<m.length(0); temp++) {
-                                    ofstream_regex << setw(2) << setfill('0') << setbase(16) << (buff->buffer[m.position()+temp] & 255);
-                                }
-                            }
-                            ofstream_regex << " " << pm.get_partition_at((*fi)->current_position+m.position()) << endl;
-                        }
-                        m1++;
-                    } while ( !(m1 == m2));
-                    
-                }
-                catch (boost::exception_detail::clone_impl<boost::exception_detail::error_info_injector<std::runtime_error> >& e) {
-                    stringstream ss;
-                    ss << "error while parsing data (" << e.what() << ")";
-                    error = ss.str();
-                    return false;
+            return true;
+        }
+        
+        // print in find_file_output all information
+        if (resume.size() != l)
+            resume.assign(l, buff->position);
+        try {
+            // the end of the previous buffer followed by the begin of this one,
+            // and one byte more for $, \b and the like
+            if (tail.size()) {
+                seam = tail;
+                seam.insert(seam.end(), buff->buffer, buff->buffer + ((buff->length < overlap+1) ? buff->length : overlap+1));
+            }
+            
+            for (j=0; j<l; j++) {
+                if (tail.size() && resume[j] < buff->position)
+                    search_seam(j, buff->position, buff->is_last && buff->length <= overlap+1);
+                
+                // the matches that can go on in the next buffer are left to it
+                uint64_t from = resume[j] - buff->position;
+                uint64_t limit = (buff->is_last) ? buff->length : (buff->length > overlap) ? buff->length-overlap : 0;
+                if (from > limit)
+                    from = limit;
+                
+                boost::cregex_iterator m1(search_begin+from, search_end, re[j], search_flags(from, buff->is_last));
+                boost::cregex_iterator m2;
+                while (!(m1 == m2)) {
+                    const boost::cmatch &m = *m1;
+                    uint64_t start = m[0].first - search_begin;
+                    if (start >= limit) break;
+                    if (!m[0].matched) {    // partial: longer than the overlap, look past its start
+                        const char *next = m[0].first + 1;
+                        m1 = boost::cregex_iterator(next, search_end, re[j], search_flags(true, buff->is_last));
+                        continue;
+                    }
+                    if (m.length(0)>0) {
+                        report(j, buff->position+start, (const unsigned char *) m[0].first, m.length(0));
+                        resume[j] = buff->position + (m[0].second - search_begin);
+                    }
+                    m1++;
                 }
+                if (resume[j] < buff->position+limit)
+                    resume[j] = buff->position+limit;
             }
         }
+        catch (boost::exception_detail::clone_impl<boost::exception_detail::error_info_injector<std::runtime_error> >& e) {
+            stringstream ss;
+            ss << "error while parsing data (" << e.what() << ")";
+            error = ss.str();
+            return false;
+        }
+        
+        // the last overlap bytes (and one before them, for \b and the like) go to the next buffer
+        uint64_t keep = (buff->length < overlap+1) ? buff->length : overlap+1;
+        if (keep == overlap+1)
+            tail.clear();
+        tail.insert(tail.end(), buff->buffer+buff->length-keep, buff->buffer+buff->length);
+        if (tail.size() > overlap+1)
+            tail.erase(tail.begin(), tail.end()-(overlap+1));
+        tail_position = buff->position + buff->length - tail.size();
+        
         return true;
     }
     
@@ -274,9 +386,13 @@ class fastdd_module_regex : public fastdd_module {
         ss << "         length           is the length of the match\n";
         ss << "         matching_string  is the string that matched the regex (in hexadecimal)\n";
         ss << "         partition        is the partition where regex has been found\n";
-        ss << "      Partial matches found at the end of blocks are reported with a '?' at the\n";
-        ss << "      begin of the line\n";
+        ss << "      A match across two buffers is reported once, whole, if it is at most\n";
+        ss << "      regex-overlap bytes long\n";
         ss << "      See --simple-regex-match to save matches in less detailed format.\n";
+        ss << "   regex-overlap=BYTES\n";
+        ss << "      longest match that can be found across two buffers: the last BYTES of\n";
+        ss << "      a buffer are searched again with the begin of the next one (default:\n";
+        ss << "      4096, or half bs if it is smaller)\n";
         ss << "   Flags:\n";
         ss << "   --simple-regex-match\n";
         ss << "      for each block just specify which regexes it contains\n";
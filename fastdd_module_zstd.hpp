@@ -0,0 +1,306 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_MODULE_ZSTD_H
+    #define _FASTDD_MODULE_ZSTD_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include "fastdd_t.hpp"
+#include "fastdd_module.hpp"
+#include <zstd.h>
+
+using namespace std;
+
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SEEK_FOOTER 9             // number of frames, descriptor, seekable magic
+
+/** zstd compression of the buffers, with the multithreaded streaming API of
+ *  libzstd (zstd-threads=N workers compress parts of every buffer at the same
+ *  time). It is a v2 module: the compressed data is written in a buffer of
+ *  the pool that takes the place of the original one, never copied back.
+ *
+ *  With zstd-frame=BYTES the data is cut in independent frames followed by a
+ *  seek table in the zstd seekable format (a skippable frame listing the
+ *  compressed and uncompressed size of every frame, no checksums), so the
+ *  image can be decompressed from any frame. */
+class fastdd_module_zstd : public fastdd_module {
+    private:
+    int compression_level;
+    int tot_workers;
+    int window_log;             // zstd-long: long distance matching with this window (0: off)
+    uint64_t frame_size;        // zstd-frame: uncompressed bytes of a frame (0: one frame)
+    bool is_act;
+    settings_t *settings;
+    unsigned char *dest;        // where the current buffer is compressed
+    int64_t dest_max;
+    string errore;
+    ZSTD_CCtx *cctx;
+    
+    uint64_t frame_in, frame_out;   // of the current frame
+    vector<uint32_t> seek_in, seek_out;
+    
+    bool is_error(size_t ret) {
+        if (!ZSTD_isError(ret)) return false;
+        errore = ZSTD_getErrorName(ret);
+        return true;
+    }
+    
+    /** compress len bytes of in in dest+*out; end: ZSTD_e_flush or ZSTD_e_end */
+    bool compress(const unsigned char *in, size_t len, ZSTD_EndDirective end, int64_t *out) {
+        ZSTD_inBuffer zin = { in, len, 0 };
+        size_t left;
+        do {
+            ZSTD_outBuffer zout = { dest + *out, (size_t) (dest_max - *out), 0 };
+            left = ZSTD_compressStream2(cctx, &zout, &zin, end);
+            if (is_error(left))
+                return false;
+            *out += zout.pos;
+            frame_out += zout.pos;
+            if (left && *out == dest_max) {
+                errore = "compressed data does not fit in the buffer";
+                return false;
+            }
+        } while (left);
+        frame_in += len;
+        
+        if (end == ZSTD_e_end) {
+            seek_in.push_back(frame_in);
+            seek_out.push_back(frame_out);
+            frame_in = frame_out = 0;
+        }
+        return true;
+    }
+    
+    static void put32(unsigned char *p, uint32_t v) {
+        for (int i=0; i<4; i++)
+            p[i] = (unsigned char) (v >> (8*i));
+    }
+    
+    /** the seek table goes in dest+*out (get_max_output left room for it) */
+    bool add_seek_table(int64_t *out) {
+        int64_t table = 8 + 8*seek_in.size() + ZSTD_SEEK_FOOTER;
+        if (*out + table > dest_max) {
+            errore = "the seek table does not fit in the buffer";
+            return false;
+        }
+        
+        unsigned char *p = dest + *out;
+        put32(p, ZSTD_SKIPPABLE_MAGIC);
+        put32(p+4, table-8);
+        p += 8;
+        for (size_t i=0; i<seek_in.size(); i++, p+=8) {
+            put32(p, seek_out[i]);
+            put32(p+4, seek_in[i]);
+        }
+        put32(p, seek_in.size());
+        p[4] = 0;                   // no checksums
+        put32(p+5, ZSTD_SEEKABLE_MAGIC);
+        *out += table;
+        
+        return true;
+    }
+    
+    public:
+    
+    fastdd_module_zstd(settings_t *settings_) {
+        compression_level = ZSTD_CLEVEL_DEFAULT;
+        tot_workers = 0;
+        window_log = 0;
+        frame_size = 0;
+        is_act = false;
+        settings = settings_;
+        dest = (unsigned char *) 0;
+        dest_max = 0;
+        cctx = NULL;
+        frame_in = frame_out = 0;
+    }
+
+    bool validate() {
+        if (!is_act) return true;
+        
+        if (settings->is_direct_o && settings->seek) {
+            settings->is_direct_o = false;
+            settings->seek=0;
+
+            errore = "compression requires to disable direct I/O in output files (-o) and to not seek output files";
+            is_act = false;
+            return false;
+        }
+        
+        cctx = ZSTD_createCCtx();
+        if (!cctx) {
+            errore = "unable to create the zstd context";
+            is_act = false;
+            return false;
+        }
+        if (is_error(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, compression_level))) {
+            is_act = false;
+            return false;
+        }
+        if (tot_workers && is_error(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, tot_workers))) {
+            errore = "zstd-threads: " + errore + " (libzstd without threads?)";
+            is_act = false;
+            return false;
+        }
+        if (window_log && (is_error(ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1)) ||
+                is_error(ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log)))) {
+            errore = "zstd-long: " + errore;
+            is_act = false;
+            return false;
+        }
+        
+        return true;
+    }
+
+    string get_name() { return "fastdd_module_zstd"; }
+
+    bool is_active() { return is_act; }
+    
+    int get_api_version() { return 2; }
+    
+    /** the data compressed even when it does not shrink, and at the end the
+     *  seek table with the frames still to come */
+    uint64_t get_max_output(const buffer_t *in) {
+        uint64_t max = ZSTD_compressBound(in->length) + ZSTD_CStreamOutSize();
+        if (in->is_last && frame_size)
+            max += 8 + 8*(seek_in.size() + in->length/frame_size + 2) + ZSTD_SEEK_FOOTER;
+        return max;
+    }
+
+    bool is_operand(string operand) {
+        return (!operand.compare("zstd") || !operand.compare("zstd-threads") ||
+            !operand.compare("zstd-long") || !operand.compare("zstd-frame"));
+    }
+
+    bool set_operand(string operand, string value) {
+        if (!operand.compare("zstd")) {
+            compression_level = atoi(value.c_str());
+            if (compression_level<ZSTD_minCLevel() || compression_level>ZSTD_maxCLevel() || !compression_level) {
+                errore = "invalid zstd compression level";
+                return false;
+            }
+            is_act = true;
+            return true;
+        }
+        else if (!operand.compare("zstd-threads")) {
+            tot_workers = atoi(value.c_str());
+            if (tot_workers<0 || tot_workers>256) {
+                errore = "invalid zstd-threads (must be between 0 and 256)";
+                return false;
+            }
+            return true;
+        }
+        else if (!operand.compare("zstd-long")) {
+            window_log = atoi(value.c_str());
+            if (window_log && (window_log<10 || window_log>31)) {
+                errore = "invalid zstd-long window (log2 of its size, 10-31)";
+                return false;
+            }
+            return true;
+        }
+        else if (!operand.compare("zstd-frame")) {
+            frame_size = init_read_suffixed_number(value);
+            if (frame_size < 65536 || frame_size > (1<<30)) {
+                errore = "invalid zstd-frame (must be between 65536 and 1073741824)";
+                return false;
+            }
+            return true;
+        }
+        
+        errore = "invalid operand";
+        return false;
+    }
+
+    bool is_flag(string flag) {
+        return false;
+    }
+    
+    bool set_flag(string flag) {
+        return false;
+    }
+
+    bool transform_to(const buffer_t *buff, unsigned char *out_buffer, uint64_t capacity, uint64_t *out_length) {
+        int64_t out = 0;
+        dest = out_buffer;
+        dest_max = capacity;
+        int64_t pos = 0, len = buff->length;
+        
+        // seekable: the frames end every frame_size bytes
+        while (frame_size && len-pos >= (int64_t) (frame_size-frame_in)) {
+            int64_t n = frame_size-frame_in;
+            if (!compress(buff->buffer+pos, n, ZSTD_e_end, &out))
+                return false;
+            pos += n;
+        }
+        
+        ZSTD_EndDirective end = ZSTD_e_flush;
+        if (buff->is_last && (frame_in || pos < len || !seek_in.size()))
+            end = ZSTD_e_end;           // the last frame (or an empty one, with nothing else)
+        if ((pos < len || end == ZSTD_e_end) && !compress(buff->buffer+pos, len-pos, end, &out))
+            return false;
+        
+        if (buff->is_last) {
+            if (frame_size && !add_seek_table(&out))
+                return false;
+            is_act = false;
+        }
+        
+        *out_length = out;
+        
+        return true;
+    }
+
+    string get_error() {
+        return errore;
+    }
+    
+    string get_help() {
+        stringstream ss;
+        ss << "   ZSTD COMPRESSION\n";
+        ss << "   zstd=LEVEL\n";
+        ss << "      compress the output with zstd at LEVEL (1-" << ZSTD_maxCLevel() << ", negative for faster\n" <<
+              "      levels). Like compression=, hashes of the output differ from the input\n";
+        ss << "   zstd-threads=N\n";
+        ss << "      N threads compress parts of every buffer at the same time (default: 0,\n" <<
+              "      no threads). Use a bs of a few MB per thread\n";
+        ss << "   zstd-long=WINDOWLOG\n";
+        ss << "      enable long distance matching in a window of 2^WINDOWLOG bytes (10-31)\n";
+        ss << "   zstd-frame=BYTES\n";
+        ss << "      make a frame every BYTES of data and add a seek table (zstd seekable\n" <<
+              "      format) at the end, so the image can be read from any frame\n";
+        
+        return ss.str();
+    }
+    
+    ~fastdd_module_zstd() {
+        if (cctx)
+            ZSTD_freeCCtx(cctx);
+    }
+};
+
+#endif
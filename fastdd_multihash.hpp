@@ -0,0 +1,337 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_MULTIHASH_H
+    #define _FASTDD_MULTIHASH_H
+
+#include <string>
+#include <cstring>
+#include <stdint.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include "fastdd_digest.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+using namespace std;
+
+/** Multi-buffer MD5, SHA-1 and SHA-256: many messages of the same length are
+ *  digested at once, one per SIMD lane (4 with SSE2, 8 with AVX2, 16 with
+ *  AVX-512, chosen at run time). Used for the block digests, where a buffer
+ *  holds many blocks of ibs bytes: a single message is faster with EVP.
+ *  SHA-1 and SHA-256 are left to OpenSSL with 4 lanes, and with 8 lanes on
+ *  CPUs with the SHA extensions. */
+class fastdd_multihash {
+    private:
+    enum { MH_NONE=0, MH_MD5, MH_SHA1, MH_SHA256 };
+    
+    typedef uint32_t v4u __attribute__((vector_size(16)));
+    typedef uint32_t v8u __attribute__((vector_size(32)));
+    typedef uint32_t v16u __attribute__((vector_size(64)));
+    
+    #define MH_ROTL(x, n) (((x) << (n)) | ((x) >> (32-(n))))
+    #define MH_ROTR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+    
+    static uint32_t load_le(const uint8_t *p) {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+    
+    static uint32_t load_be(const uint8_t *p) {
+        return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+    }
+    
+    template <typename V, int lanes>
+    static inline __attribute__((always_inline)) void md5_block(V h[4], const uint8_t *const *p, int64_t off) {
+        static const uint32_t K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+        static const int S[4][4] = { {7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21} };
+        V m[16];
+        for (int i=0; i<16; i++)
+            for (int l=0; l<lanes; l++)
+                m[i][l] = load_le(p[l] + off + 4*i);
+        
+        V a = h[0], b = h[1], c = h[2], d = h[3];
+        #pragma GCC unroll 64
+        for (int i=0; i<64; i++) {
+            V f;
+            int g;
+            if (i < 16) { f = (b & c) | (~b & d); g = i; }
+            else if (i < 32) { f = (d & b) | (~d & c); g = (5*i+1) & 15; }
+            else if (i < 48) { f = b ^ c ^ d; g = (3*i+5) & 15; }
+            else { f = c ^ (b | ~d); g = (7*i) & 15; }
+            V t = a + f + K[i] + m[g];
+            int s = S[i >> 4][i & 3];
+            a = d;
+            d = c;
+            c = b;
+            b = b + MH_ROTL(t, s);
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    }
+    
+    template <typename V, int lanes>
+    static inline __attribute__((always_inline)) void sha1_block(V h[5], const uint8_t *const *p, int64_t off) {
+        V w[16];
+        for (int i=0; i<16; i++)
+            for (int l=0; l<lanes; l++)
+                w[i][l] = load_be(p[l] + off + 4*i);
+        
+        V a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        #pragma GCC unroll 80
+        for (int t=0; t<80; t++) {
+            if (t >= 16) {
+                V x = w[(t-3) & 15] ^ w[(t-8) & 15] ^ w[(t-14) & 15] ^ w[t & 15];
+                w[t & 15] = MH_ROTL(x, 1);
+            }
+            V f;
+            uint32_t k;
+            if (t < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (t < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (t < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            V tmp = MH_ROTL(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = MH_ROTL(b, 30);
+            b = a;
+            a = tmp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    
+    template <typename V, int lanes>
+    static inline __attribute__((always_inline)) void sha256_block(V h[8], const uint8_t *const *p, int64_t off) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+        V w[16];
+        for (int i=0; i<16; i++)
+            for (int l=0; l<lanes; l++)
+                w[i][l] = load_be(p[l] + off + 4*i);
+        
+        V a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        #pragma GCC unroll 64
+        for (int t=0; t<64; t++) {
+            if (t >= 16) {
+                V w15 = w[(t-15) & 15], w2 = w[(t-2) & 15];
+                V s0 = MH_ROTR(w15, 7) ^ MH_ROTR(w15, 18) ^ (w15 >> 3);
+                V s1 = MH_ROTR(w2, 17) ^ MH_ROTR(w2, 19) ^ (w2 >> 10);
+                w[t & 15] = w[t & 15] + s0 + w[(t-7) & 15] + s1;
+            }
+            V S1 = MH_ROTR(e, 6) ^ MH_ROTR(e, 11) ^ MH_ROTR(e, 25);
+            V ch = (e & f) ^ (~e & g);
+            V t1 = hh + S1 + ch + K[t] + w[t & 15];
+            V S0 = MH_ROTR(a, 2) ^ MH_ROTR(a, 13) ^ MH_ROTR(a, 22);
+            V maj = (a & b) ^ (a & c) ^ (b & c);
+            V t2 = S0 + maj;
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+    
+    /** digest 'lanes' messages of len bytes (p[l]) of algorithm alg in out[l] */
+    template <typename V, int lanes>
+    static inline __attribute__((always_inline)) void digest_lanes(int alg, const uint8_t *const *p, int64_t len, uint8_t *const *out) {
+        static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+        static const uint32_t sha1_iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+        static const uint32_t sha256_iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        const uint32_t *iv = (alg == MH_MD5) ? md5_iv : (alg == MH_SHA1) ? sha1_iv : sha256_iv;
+        int words = (alg == MH_MD5) ? 4 : (alg == MH_SHA1) ? 5 : 8;
+        
+        V h[8];
+        for (int i=0; i<words; i++)
+            h[i] = (V) {} + iv[i];
+        
+        int64_t full = len & ~(int64_t) 63;
+        for (int64_t off=0; off<full; off+=64) {
+            if (alg == MH_MD5) md5_block<V, lanes>(h, p, off);
+            else if (alg == MH_SHA1) sha1_block<V, lanes>(h, p, off);
+            else sha256_block<V, lanes>(h, p, off);
+        }
+        
+        // the padding is the same for every lane, only the tail of data changes
+        uint8_t tail[lanes][128];
+        const uint8_t *tp[lanes];
+        int rest = len - full;
+        int tail_len = (rest < 56) ? 64 : 128;
+        uint64_t bits = (uint64_t) len * 8;
+        for (int l=0; l<lanes; l++) {
+            memcpy(tail[l], p[l] + full, rest);
+            tail[l][rest] = 0x80;
+            memset(tail[l] + rest + 1, 0, tail_len - rest - 1);
+            for (int i=0; i<8; i++)
+                tail[l][tail_len-8+i] = (alg == MH_MD5) ? (uint8_t) (bits >> (8*i)) : (uint8_t) (bits >> (56-8*i));
+            tp[l] = tail[l];
+        }
+        for (int off=0; off<tail_len; off+=64) {
+            if (alg == MH_MD5) md5_block<V, lanes>(h, tp, off);
+            else if (alg == MH_SHA1) sha1_block<V, lanes>(h, tp, off);
+            else sha256_block<V, lanes>(h, tp, off);
+        }
+        
+        for (int l=0; l<lanes; l++)
+            for (int i=0; i<words; i++)
+                for (int j=0; j<4; j++)
+                    out[l][4*i+j] = (alg == MH_MD5) ? (uint8_t) (h[i][l] >> (8*j)) : (uint8_t) (h[i][l] >> (24-8*j));
+    }
+    
+    #undef MH_ROTL
+    #undef MH_ROTR
+    
+    typedef void (*lanes_fn)(int, const uint8_t *const *, int64_t, uint8_t *const *);
+    
+    static void digest_4(int alg, const uint8_t *const *p, int64_t len, uint8_t *const *out) {
+        digest_lanes<v4u, 4>(alg, p, len, out);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    static void digest_8(int alg, const uint8_t *const *p, int64_t len, uint8_t *const *out) {
+        digest_lanes<v8u, 8>(alg, p, len, out);
+    }
+    __attribute__((target("avx512f")))
+    static void digest_16(int alg, const uint8_t *const *p, int64_t len, uint8_t *const *out) {
+        digest_lanes<v16u, 16>(alg, p, len, out);
+    }
+#endif
+    
+    static int &lanes() {
+        static int tot_lanes = 0;
+        return tot_lanes;
+    }
+    
+    static lanes_fn &lanes_function() {
+        static lanes_fn fn = digest_4;
+        return fn;
+    }
+    
+    static bool &has_sha_ni() {
+        static bool is_sha_ni = false;
+        return is_sha_ni;
+    }
+    
+    // SHA-1 and SHA-256 are worth only on wide lanes, wider with the SHA extensions
+    static int sha_lanes() {
+        return (has_sha_ni()) ? 16 : 8;
+    }
+    
+    static void init() {
+        if (lanes()) return;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            has_sha_ni() = (ebx >> 29) & 1;
+        if (__builtin_cpu_supports("avx512f")) {
+            lanes_function() = digest_16;
+            lanes() = 16;
+            return;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            lanes_function() = digest_8;
+            lanes() = 8;
+            return;
+        }
+#endif
+        lanes_function() = digest_4;
+        lanes() = 4;
+    }
+    
+    static int algorithm(const fastdd_md_t *type) {
+        if (!type->evp)
+            return MH_NONE;
+        switch (EVP_MD_type(type->evp)) {
+            case NID_md5: return MH_MD5;
+            case NID_sha1: return (lanes() >= sha_lanes()) ? MH_SHA1 : MH_NONE;
+            case NID_sha256: return (lanes() >= sha_lanes()) ? MH_SHA256 : MH_NONE;
+        }
+        return MH_NONE;
+    }
+    
+    public:
+    
+    /** true if tot messages of 'type' are digested faster here than with EVP */
+    static bool is_worth(const fastdd_md_t *type, int64_t tot) {
+        init();
+        return algorithm(type) != MH_NONE && tot >= lanes();
+    }
+    
+    /** digest the tot blocks of len bytes that follow each other at data; out
+     *  gets tot digests of fastdd_digest::md_size(type) bytes. False if the
+     *  algorithm has no multi-buffer code */
+    static bool digest(const fastdd_md_t *type, const unsigned char *data, int64_t len, int64_t tot, unsigned char *out) {
+        init();
+        int alg = algorithm(type);
+        if (alg == MH_NONE)
+            return false;
+        int md_size = fastdd_digest::md_size(type);
+        
+        const uint8_t *p[16];
+        uint8_t *o[16];
+        int64_t i = 0;
+        for (; i+lanes()<=tot; i+=lanes()) {
+            for (int l=0; l<lanes(); l++) {
+                p[l] = data + (i+l)*len;
+                o[l] = out + (i+l)*md_size;
+            }
+            lanes_function()(alg, p, len, o);
+        }
+        for (; i<tot; i++) {        // not enough blocks for the lanes
+            unsigned int md_len;
+            fastdd_digest::digest(data + i*len, len, out + i*md_size, &md_len, type);
+        }
+        
+        return true;
+    }
+    
+    /** what init() chose, for the logs */
+    static string get_features() {
+        init();
+        string ris = (lanes() == 16) ? "16 (AVX-512)" : (lanes() == 8) ? "8 (AVX2)" : "4";
+        ris += " lanes for md5";
+        if (lanes() >= sha_lanes())
+            ris += ", sha1 and sha256";
+        return ris;
+    }
+};
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_RING_H
+    #define _FASTDD_RING_H
+
+#include <cstdlib>
+#include <climits>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace std;
+
+#define RING_SPIN 128           // checks before going to sleep on the futex (multi-core only)
+
+/** Lock-free single producer / multiple consumers handoff of the buffer ring.
+ *  The producer numbers the buffers it fills (0, 1, 2, ...): buffer 'seq' lives
+ *  in slot seq%slots. Every consumer has its own cursor, the number of buffers
+ *  it has released; a slot can be refilled when all the active consumers have
+ *  released the buffer that was in it. Nobody takes a lock: the two sides only
+ *  go to sleep on a futex when they really have to wait, and the other side
+ *  makes the wake up system call only if someone is sleeping. */
+class fastdd_ring {
+    private:
+    // one per consumer, on its own cache line
+    struct cursor_t {
+        uint64_t released;
+        bool active;
+        char pad[64-sizeof(uint64_t)-sizeof(bool)];
+    };
+
+    unsigned slots;
+    int consumers;
+    int max_spin;
+    cursor_t *cursor;
+
+    uint64_t published __attribute__ ((aligned (64)));     // buffers filled by the producer
+    uint32_t published_word;    // futex the consumers sleep on
+    int published_waiters;      // someone may sleep on it (cleared by who wakes them)
+
+    uint32_t released_word __attribute__ ((aligned (64)));  // futex the producer sleeps on
+    int released_waiters;
+    uint64_t wanted;            // the buffer the producer is waiting to fill
+
+    static void futex_wait(uint32_t *word, uint32_t val) {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+    }
+
+    static void futex_wake(uint32_t *word) {
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+
+    // 1 = the slot of seq is free, 0 = not yet, -1 = no consumer left
+    int slot_state(uint64_t seq) {
+        bool someone = false;
+        for (int j=0; j<consumers; j++) {
+            if (!__atomic_load_n(&cursor[j].active, __ATOMIC_ACQUIRE)) continue;
+            someone = true;
+            if (__atomic_load_n(&cursor[j].released, __ATOMIC_ACQUIRE) + slots <= seq)
+                return 0;
+        }
+        return (someone) ? 1 : -1;
+    }
+
+    public:
+
+    fastdd_ring() {
+        slots = 0;
+        consumers = 0;
+        max_spin = 0;
+        cursor = NULL;
+        published = 0;
+        published_word = released_word = 0;
+        published_waiters = released_waiters = 0;
+        wanted = 0;
+    }
+
+    /** a ring of 'n_slots' buffers shared by 'n_consumers' consumers */
+    bool init(unsigned n_slots, int n_consumers) {
+        if (posix_memalign((void **) &cursor, 64, ((n_consumers > 0) ? n_consumers : 1)*sizeof(cursor_t)))
+            return false;
+        for (int j=0; j<n_consumers; j++) {
+            cursor[j].released = 0;
+            cursor[j].active = true;
+        }
+        slots = n_slots;
+        consumers = n_consumers;
+        published = 0;
+        // on a single core spinning only steals time to the other side
+        max_spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? RING_SPIN : 0;
+
+        return true;
+    }
+
+    bool is_ready() { return cursor != NULL; }
+
+    // ------------------------------------------------ producer side
+    /** wait until buffer 'seq' can be filled. False if every consumer has left */
+    bool wait_free(uint64_t seq) {
+        for (int spin=0; true; spin++) {
+            int state = slot_state(seq);
+            if (state) return state > 0;
+            if (spin < max_spin) continue;
+            if (spin == max_spin) {     // let the other side run a bit before sleeping
+                sched_yield();
+                continue;
+            }
+
+            uint32_t val = __atomic_load_n(&released_word, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&wanted, seq, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&released_waiters, 1, __ATOMIC_SEQ_CST);
+            if (!slot_state(seq))
+                futex_wait(&released_word, val);
+        }
+    }
+
+    /** buffer 'seq' is ready for the consumers */
+    void publish(uint64_t seq) {
+        __atomic_store_n(&published, seq+1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&published_word, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&published_waiters, 0, __ATOMIC_SEQ_CST))
+            futex_wake(&published_word);
+    }
+
+    // ------------------------------------------------ consumer side
+    /** wait until buffer 'seq' has been published */
+    void wait_published(uint64_t seq) {
+        for (int spin=0; __atomic_load_n(&published, __ATOMIC_ACQUIRE) <= seq; spin++) {
+            if (spin < max_spin) continue;
+            if (spin == max_spin) {     // let the other side run a bit before sleeping
+                sched_yield();
+                continue;
+            }
+
+            uint32_t val = __atomic_load_n(&published_word, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&published_waiters, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&published, __ATOMIC_SEQ_CST) <= seq)
+                futex_wait(&published_word, val);
+        }
+    }
+
+    /** consumer 'id' is done with buffer 'seq' */
+    void release(int id, uint64_t seq) {
+        __atomic_store_n(&cursor[id].released, seq+1, __ATOMIC_SEQ_CST);
+        // no need to wake the producer if it waits for a slot this does not free
+        if (seq+1+slots > __atomic_load_n(&wanted, __ATOMIC_SEQ_CST))
+            wake_producer();
+    }
+
+    /** consumer 'id' will not take any other buffer */
+    void leave(int id) {
+        __atomic_store_n(&cursor[id].active, false, __ATOMIC_RELEASE);
+        wake_producer();
+    }
+
+    void wake_producer() {
+        __atomic_add_fetch(&released_word, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&released_waiters, 0, __ATOMIC_SEQ_CST))
+            futex_wake(&released_word);
+    }
+
+    ~fastdd_ring() {
+        free(cursor);
+    }
+};
+
+#endif
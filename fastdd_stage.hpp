@@ -0,0 +1,270 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_STAGE_H
+    #define _FASTDD_STAGE_H
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+#include "fastdd_t.hpp"
+
+using namespace std;
+
+/** The modules between the reader and the writers, on their own threads: the
+ *  reader submits the buffers it has filled and goes on reading, the stage
+ *  runs the steps (one per module) on them and gives them to the writers in
+ *  the order they were read.
+ *  An ordered step (a module with a state, like the compressions) sees the
+ *  buffers one at time and in order, the other steps run on any number of
+ *  buffers at the same time. Different steps work on different buffers at the
+ *  same time too.
+ *  The side steps, at the end, only read the data: they run once the buffer
+ *  has been given to the writers, at the same time as them, on a view of it
+ *  (the writers empty it when they are done). A buffer leaves
+ *  the stage when all its steps are done, wait() tells the reader when it can
+ *  fill it again. */
+class fastdd_stage {
+    public:
+    // run step 'step' on buff, false to stop the copy
+    typedef bool (*run_t)(buffer_t *buff, int step);
+    // buff is ready for the writers
+    typedef void (*publish_t)(buffer_t *buff);
+    
+    private:
+    typedef struct {
+        buffer_t *buff;
+        uint64_t seq;
+        int step;               // next step to run (steps.size(): done)
+        bool is_busy;
+        bool is_published;      // the writers have it
+        buffer_t view;          // what the side steps see of it
+    } item_t;
+    
+    typedef struct {
+        bool is_ordered;
+        uint64_t next_seq;      // ordered steps: the buffer they are waiting for
+    } step_t;
+    
+    vector<step_t> steps;
+    int chain_steps;            // the steps before the writers, then the side ones
+    vector<pthread_t> threads;
+    deque<item_t> items;        // buffers in the stage, in reading order
+    run_t run_step;
+    publish_t publish;
+    bool is_stop;
+    bool is_stopped;            // a step stopped the copy at stop_seq
+    bool is_end_published;      // after the stop, the writers got an empty last buffer
+    uint64_t stop_seq;
+    
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // a step can run (or stop)
+    pthread_cond_t done;        // a buffer left the stage
+    
+    // first item a step can run on, -1 if none. Called with mutex locked
+    int next_item() {
+        for (int i=0; i<items.size(); i++) {
+            item_t &it = items[i];
+            if (it.is_busy || it.step == steps.size() || (it.step >= chain_steps && !it.is_published))
+                continue;
+            if (!steps[it.step].is_ordered || steps[it.step].next_seq == it.seq)
+                return i;
+        }
+        return -1;
+    }
+    
+    // give the writers the buffers through the chain, in order, and let go the
+    // ones done. Called with mutex locked
+    void publish_done() {
+        for (int i=0; i<items.size() && items[i].step >= chain_steps; i++) {
+            item_t &it = items[i];
+            if (it.is_published)
+                continue;
+            it.is_published = true;
+            it.view = *it.buff;
+            if (is_stopped && it.seq > stop_seq) {
+                // a side step can stop the copy after later buffers have been
+                // written: the first one still here ends it, empty
+                if (!is_end_published) {
+                    it.buff->length = 0;
+                    it.buff->is_last = true;
+                    publish(it.buff);
+                }
+                is_end_published = true;
+            }
+            else
+                publish(it.buff);
+        }
+        
+        bool gone = false;
+        while (!items.empty() && items.front().is_published && items.front().step == steps.size()) {
+            items.pop_front();
+            gone = true;
+        }
+        if (gone)
+            pthread_cond_broadcast(&done);
+    }
+    
+    static void *run(void *arg) {
+        fastdd_stage *s = (fastdd_stage *) arg;
+        
+        pthread_mutex_lock(&s->mutex);
+        while (true) {
+            int i;
+            while ((i = s->next_item()) < 0 && !s->is_stop)
+                pthread_cond_wait(&s->work, &s->mutex);
+            if (i < 0)
+                break;
+            
+            // items only leave from the front once done: todo stays where it is
+            item_t &todo = s->items[i];
+            todo.is_busy = true;
+            buffer_t *buff = (todo.step < s->chain_steps) ? todo.buff : &todo.view;
+            int step = todo.step;
+            uint64_t seq = todo.seq;
+            pthread_mutex_unlock(&s->mutex);
+            
+            bool ok = s->run_step(buff, step);
+            
+            pthread_mutex_lock(&s->mutex);
+            item_t &cur = todo;
+            cur.is_busy = false;
+            if (s->steps[step].is_ordered)
+                s->steps[step].next_seq++;
+            cur.step++;
+            
+            if (!ok) {
+                // before the writers the buffer is the last one, after them the next
+                if (step < s->chain_steps)
+                    cur.buff->is_last = true;
+                if (!s->is_stopped || seq < s->stop_seq) {
+                    s->is_stopped = true;
+                    s->stop_seq = seq;
+                }
+                cur.step = s->steps.size();
+            }
+            // nothing else to do on the buffers after the stop
+            for (i=0; s->is_stopped && i<s->items.size(); i++)
+                if (s->items[i].seq > s->stop_seq && !s->items[i].is_busy)
+                    s->items[i].step = s->steps.size();
+            
+            s->publish_done();
+            pthread_cond_broadcast(&s->work);
+        }
+        pthread_mutex_unlock(&s->mutex);
+        
+        return NULL;
+    }
+    
+    public:
+    
+    fastdd_stage() {
+        chain_steps = 0;
+        run_step = NULL;
+        publish = NULL;
+        is_stop = is_stopped = is_end_published = false;
+        stop_seq = 0;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work, NULL);
+        pthread_cond_init(&done, NULL);
+    }
+    
+    /** start 'tot' threads running the steps; ordered[i] tells if step i
+     *  must see the buffers in order, the last 'side' steps run next to the
+     *  writers. False if no thread can be started */
+    bool init(vector<bool> &ordered, int side, int tot, run_t run_step_, publish_t publish_) {
+        run_step = run_step_;
+        publish = publish_;
+        steps.resize(ordered.size());
+        for (int i=0; i<ordered.size(); i++) {
+            steps[i].is_ordered = ordered[i];
+            steps[i].next_seq = 0;
+        }
+        chain_steps = steps.size() - side;
+        
+        threads.resize(tot);
+        int started;
+        for (started=0; started<tot; started++) {
+            if (pthread_create(&threads[started], NULL, run, (void *) this))
+                break;
+        }
+        threads.resize(started);
+        
+        return started > 0;
+    }
+    
+    bool is_ready() { return threads.size() > 0; }
+    
+    /** the steps run on buff, that goes to the writers when the ones of the
+     *  chain are done. The buffers must be submitted in reading order */
+    void submit(buffer_t *buff) {
+        item_t it;
+        it.buff = buff;
+        it.seq = buff->seq;
+        it.step = 0;
+        it.is_busy = false;
+        it.is_published = false;
+        
+        pthread_mutex_lock(&mutex);
+        if (is_stopped && it.seq > stop_seq)
+            it.step = steps.size();
+        items.push_back(it);
+        publish_done();
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** wait until buffer 'seq' and the ones before it have left the stage */
+    void wait(uint64_t seq) {
+        pthread_mutex_lock(&mutex);
+        while (!items.empty() && items.front().seq <= seq)
+            pthread_cond_wait(&done, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** true if a step has stopped the copy: the reader can stop too, after
+     *  submitting one more buffer (that ends the copy, if needed) */
+    bool is_stopping() {
+        pthread_mutex_lock(&mutex);
+        bool ris = is_stopped;
+        pthread_mutex_unlock(&mutex);
+        return ris;
+    }
+    
+    /** stop the threads, once the writers have taken every buffer */
+    void finish() {
+        pthread_mutex_lock(&mutex);
+        is_stop = true;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+        
+        for (int i=0; i<threads.size(); i++)
+            pthread_join(threads[i], NULL);
+        threads.clear();
+    }
+    
+    ~fastdd_stage() {
+        if (!is_stop) finish();
+    }
+};
+
+#endif
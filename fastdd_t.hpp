@@ -25,22 +25,35 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <openssl/evp.h>
+#include "fastdd_digest.hpp"
 #include <stdint.h>
 
 using namespace std;
 
+// how the data is moved: read() or io_uring reads through the buffers, views
+// of the mapped input (mmap) or in the kernel (zero-copy); auto picks
+// zero-copy when nothing needs the data
+enum engine_t { ENGINE_READ=0, ENGINE_URING=1, ENGINE_ZERO_COPY=2, ENGINE_AUTO=3, ENGINE_MMAP=4 };
+
+// how the buffers pass from the reader to the writers
+enum handoff_t { HANDOFF_LOCKFREE=0, HANDOFF_MUTEX=1 };
+
 struct _buffer_t;
+class fastdd_hash_pool;
 
 typedef struct _buffer_t buffer_t;
 
 struct _buffer_t {
     unsigned char *buffer;
+    unsigned char *own_buffer;  // memory of the buffer (buffer can be a view of the mapped input)
+    uint64_t capacity;          // bytes of own_buffer
     uint64_t length;
+    uint64_t seq;               // sequence number of the data, given by the reader
+    uint64_t position;          // position of the data in the input
     
     int tot_digests;
-    EVP_MD_CTX *ctx;
-    const EVP_MD **digest_type;
+    fastdd_md_ctx_t *ctx;
+    const fastdd_md_t **digest_type;
     unsigned char **hash;
     unsigned int *hash_len;
     
@@ -57,9 +70,37 @@ struct _buffer_t {
     bool *already_write;
     bool *active;
     
-    buffer_t *the_other_buffer;
+    buffer_t *next_buffer;      // next buffer of the ring
 };
 
+// a buffer an output could not take from the ring in time (fan-out mode)
+typedef struct _spill_t {
+    uint64_t seq;
+    uint64_t offset;            // position in the spill file
+    uint64_t length;
+    bool is_last;
+    unsigned char **hash;       // block digests of the buffer
+    unsigned int *hash_len;
+    struct _spill_t *next;
+} spill_t;
+
+// a written range waiting to be re-read by the verifier of its output
+typedef struct _verify_range_t {
+    int64_t offset;             // position in the output
+    int64_t length;
+    uint64_t seq;               // buffer the data came from
+    unsigned char **hash;       // block digests of the input
+} verify_range_t;
+
+// what the reader carries from one buffer to the next
+typedef struct _reader_state_t {
+    int64_t last_update;        // last progress bar update
+    int64_t next_needed;        // next position needed by the partition manager
+    int64_t current_blocks;     // input blocks read before the current buffer
+    uint64_t seq;               // sequence number of the next buffer
+    int continue_on_error;      // on module errors: -1=ask, 0=stop, 1=ignore
+} reader_state_t;
+
 typedef struct _fastdd_file_t {
     int idx;
     const char *file_name;
@@ -75,14 +116,56 @@ typedef struct _fastdd_file_t {
     int64_t b_part;
     
     int tot_digests;
-    const EVP_MD **digest_type;
-    EVP_MD_CTX *ctx;
+    const fastdd_md_t **digest_type;
+    fastdd_md_ctx_t *ctx;
     unsigned char **hash;
     unsigned int *hash_len;
+    fastdd_hash_pool *hash_pool;    // threads updating ctx (NULL: updated inline)
+    
+    // input only: data extents of a sparse regular file
+    bool has_holes;
+    int tot_extents;
+    int cur_extent;             // first extent not yet passed by the reader
+    int64_t *extent_start, *extent_end;
+    
+    // output only
+    uint64_t next_seq;          // sequence number of the next buffer to write
+    int64_t ring_seq;           // buffer of the ring being written (-1 if none)
+    uint64_t byte_written;
+    bool is_sparse;             // zero blocks become holes (--sparse)
+    uint64_t byte_elided;       // zeros not written because of it
+    int clone_of;               // --clone: CLONE_NONE, CLONE_INPUT or the output it is reflinked from
+    int64_t t_end;              // when the writer finished (microseconds)
+    
+    int spill_fd;               // scratch file of the fan-out mode (-1 if disabled)
+    pthread_mutex_t spill_mutex;
+    spill_t *spill_head, *spill_tail;
+    int64_t spill_bytes;        // bytes waiting in the spill file
+    int64_t spill_max;          // peak of spill_bytes
+    uint64_t spill_end;         // where the next spilled buffer will be written
+    unsigned char *spill_buffer;
+    uint64_t spill_capacity;    // bytes of spill_buffer
+    
+    // re-reading of the written data (--hash-blocks-check, --hash-file-out),
+    // done by a thread a few ranges behind the writer
+    pthread_t verify_thread;
+    int verify_fd;              // the output opened again, with O_DIRECT if possible (-1 if none)
+    pthread_mutex_t verify_mutex;
+    pthread_cond_t verify_not_empty, verify_not_full;
+    verify_range_t *verify_ranges;  // VERIFY_RANGES slots
+    uint64_t verify_head, verify_tail;  // next range to check, next free slot
+    bool verify_end;            // the writer has finished
+    bool verify_failed;         // a range could not be read or did not match (exit status 1)
 } fastdd_file_t;
 
+// where an output gets its data from in --clone mode
+enum { CLONE_NONE=-1, CLONE_INPUT=-2 };
+
 typedef struct _settings_t {
     string input_file_name;
+    string input_index_file_name;   // if-gzip-index: if= is an indexed gzip image
+    string decode;              // decode=FORMAT: if= is compressed ("" = not)
+    int decode_threads;
     vector<string> output_file_name;
     int64_t bs;
     int64_t ibs;
@@ -103,13 +186,30 @@ typedef struct _settings_t {
     bool is_md_blocks_save;
     string md_file_name;
     ofstream ofstream_md;
+    string md_tree;             // hash-tree algorithm ("" = no tree)
+    int64_t tree_leaf;
+    string tree_file_name;      // hash-tree-save
+    string tree_verify_file_name;   // hash-tree-verify
     
     bool full_block;
+    bool is_sparse;
+    bool is_clone;
     int is_direct_i;
     int is_direct_o;
     int is_o_trunc;
     bool is_parallel;
+    int64_t parallel_threshold;
+    int tot_buffers;
+    string spill_dir;
+    int64_t max_lag;
+    engine_t engine;
+    int queue_depth;
+    int block_hash_threads;
+    int module_threads;         // threads of the module stage (0: one per CPU)
+    handoff_t handoff;
     bool is_progress_bar;
+    bool is_benchmark_handoff;
+    bool is_benchmark_digests;
     bool is_verbose;
     bool is_debug;
     bool ignore_module_error;
@@ -0,0 +1,415 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_TREE_H
+    #define _FASTDD_TREE_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+#include "fastdd_digest.hpp"
+
+using namespace std;
+
+#define TREE_MAGIC "FDDTREE1"
+
+/** Tree (Merkle) digest of a stream, for hash-tree=ALGO[,leaf=SIZE].
+ *  The stream is cut in leaves of leaf_size bytes (the last one can be
+ *  shorter); leaf digest = H(0x00 || data), parent = H(0x01 || left || right),
+ *  an odd node at the end of a level goes up as it is. The leaves are spread
+ *  on the threads by index, so every leaf is digested in order by one thread
+ *  and different leaves at the same time.
+ *
+ *  The sidecar file keeps what is needed to check any range again:
+ *      "FDDTREE1", algorithm name (uint32 length + chars), leaf size, stream
+ *      length, number of leaves (uint64), digest length (uint32), the leaf
+ *      digests and the root digest; integers in the byte order of the host. */
+class fastdd_tree {
+    private:
+    typedef struct {
+        uint64_t leaf;
+        const unsigned char *data;
+        int64_t length;
+        bool is_end;            // last data of the leaf
+        uint64_t seq;           // buffer the data comes from
+    } job_t;
+    
+    typedef struct {
+        fastdd_tree *tree;
+        deque<job_t> todo;
+        bool is_busy;
+        uint64_t busy_seq;      // seq of the job being digested
+        map<uint64_t, fastdd_md_ctx_t *> open;   // leaves not finished yet
+        pthread_t thread;
+    } worker_t;
+    
+    string algorithm;
+    const fastdd_md_t *type;
+    int64_t leaf_size;
+    unsigned int digest_len;
+    uint64_t length;            // bytes of the stream given so far
+    map<uint64_t, string> leaves;   // finished leaves
+    string root;
+    
+    vector<worker_t *> workers;
+    bool is_stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // a job arrived (or stop)
+    pthread_cond_t progress;    // a job is done
+    string errore;
+    
+    static void *run(void *arg) {
+        worker_t *w = (worker_t *) arg;
+        fastdd_tree *t = w->tree;
+        
+        while (true) {
+            pthread_mutex_lock(&t->mutex);
+            while (w->todo.empty() && !t->is_stop)
+                pthread_cond_wait(&t->work, &t->mutex);
+            if (w->todo.empty()) {
+                pthread_mutex_unlock(&t->mutex);
+                break;
+            }
+            job_t job = w->todo.front();
+            w->todo.pop_front();
+            w->is_busy = true;
+            w->busy_seq = job.seq;
+            pthread_mutex_unlock(&t->mutex);
+            
+            // only this thread touches the contexts of its leaves
+            fastdd_md_ctx_t *ctx = w->open[job.leaf];
+            if (!ctx) {
+                ctx = new fastdd_md_ctx_t;
+                fastdd_digest::ctx_init(ctx);
+                fastdd_digest::digest_init(ctx, t->type);
+                unsigned char prefix = 0;
+                fastdd_digest::digest_update(ctx, &prefix, 1);
+                w->open[job.leaf] = ctx;
+            }
+            fastdd_digest::digest_update(ctx, job.data, job.length);
+            
+            string digest;
+            if (job.is_end) {
+                digest = t->final(ctx);
+                delete ctx;
+                w->open.erase(job.leaf);
+            }
+            
+            pthread_mutex_lock(&t->mutex);
+            if (job.is_end)
+                t->leaves[job.leaf] = digest;
+            w->is_busy = false;
+            pthread_cond_broadcast(&t->progress);
+            pthread_mutex_unlock(&t->mutex);
+        }
+        
+        return NULL;
+    }
+    
+    string final(fastdd_md_ctx_t *ctx) {
+        unsigned char md_value[EVP_MAX_MD_SIZE];
+        unsigned int md_len;
+        fastdd_digest::digest_final(ctx, md_value, &md_len);
+        return string((char *) md_value, md_len);
+    }
+    
+    string parent(const string &left, const string &right) {
+        fastdd_md_ctx_t ctx;
+        fastdd_digest::ctx_init(&ctx);
+        fastdd_digest::digest_init(&ctx, type);
+        unsigned char prefix = 1;
+        fastdd_digest::digest_update(&ctx, &prefix, 1);
+        fastdd_digest::digest_update(&ctx, left.data(), left.length());
+        fastdd_digest::digest_update(&ctx, right.data(), right.length());
+        return final(&ctx);
+    }
+    
+    // called with mutex locked
+    void push(uint64_t leaf, const unsigned char *data, int64_t len, bool is_end, uint64_t seq) {
+        job_t job;
+        job.leaf = leaf;
+        job.data = data;
+        job.length = len;
+        job.is_end = is_end;
+        job.seq = seq;
+        workers[leaf % workers.size()]->todo.push_back(job);
+    }
+    
+    // true if a job of buffer seq (or before) is still to be done. Called with mutex locked
+    bool is_pending(uint64_t seq) {
+        for (int i=0; i<workers.size(); i++) {
+            if (workers[i]->is_busy && workers[i]->busy_seq <= seq) return true;
+            if (!workers[i]->todo.empty() && workers[i]->todo.front().seq <= seq) return true;
+        }
+        return false;
+    }
+    
+    public:
+    
+    fastdd_tree() {
+        type = NULL;
+        leaf_size = 1<<20;
+        digest_len = 0;
+        length = 0;
+        is_stop = true;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work, NULL);
+        pthread_cond_init(&progress, NULL);
+    }
+    
+    /** digest with 'algo' leaves of 'leaf' bytes, on 'threads' threads */
+    bool init(string algo, int64_t leaf, int threads) {
+        algorithm = algo;
+        leaf_size = leaf;
+        type = fastdd_digest::get_digestbyname(algo.c_str());
+        if (!type) {
+            errore = "unknown message digest " + algo;
+            return false;
+        }
+        if (leaf_size <= 0) {
+            errore = "leaf size must be positive";
+            return false;
+        }
+        digest_len = fastdd_digest::md_size(type);
+        
+        is_stop = false;
+        for (int i=0; i<threads; i++) {
+            worker_t *w = new worker_t;
+            w->tree = this;
+            w->is_busy = false;
+            w->busy_seq = 0;
+            if (pthread_create(&w->thread, NULL, run, (void *) w)) {
+                delete w;
+                break;
+            }
+            workers.push_back(w);
+        }
+        if (!workers.size()) {
+            errore = "unable to start the tree hash threads";
+            is_stop = true;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    /** the next 'len' bytes of the stream, from buffer 'seq'; 'is_last' at the
+     *  end of the stream. data must not change until wait(seq) */
+    void submit(const unsigned char *data, int64_t len, uint64_t seq, bool is_last) {
+        pthread_mutex_lock(&mutex);
+        bool empty = !length;
+        for (int64_t done=0; done<len; ) {
+            int64_t n = leaf_size - (int64_t) (length % leaf_size);
+            if (n > len-done) n = len-done;
+            uint64_t leaf = length / leaf_size;
+            length += n;
+            done += n;
+            push(leaf, data+done-n, n, !(length % leaf_size) || (is_last && done == len), seq);
+        }
+        // close a leaf left open, or make the only leaf of an empty stream
+        if (is_last && !len && (length % leaf_size || empty))
+            push(length / leaf_size, data, 0, true, seq);
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** digest a whole leaf (to check it again) */
+    void submit_leaf(uint64_t leaf, const unsigned char *data, int64_t len, uint64_t seq) {
+        pthread_mutex_lock(&mutex);
+        push(leaf, data, len, true, seq);
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** wait until the data of buffer 'seq' and of the ones before it has been digested */
+    void wait(uint64_t seq) {
+        pthread_mutex_lock(&mutex);
+        while (is_pending(seq))
+            pthread_cond_wait(&progress, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    /** digest what is left, stop the threads and compute the root */
+    void finish() {
+        if (is_stop) return;
+        
+        pthread_mutex_lock(&mutex);
+        is_stop = true;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&mutex);
+        
+        for (int i=0; i<workers.size(); i++) {
+            pthread_join(workers[i]->thread, NULL);
+            // leaves of an interrupted stream
+            for (map<uint64_t, fastdd_md_ctx_t *>::iterator it=workers[i]->open.begin(); it!=workers[i]->open.end(); it++) {
+                leaves[it->first] = final(it->second);
+                delete it->second;
+            }
+            delete workers[i];
+        }
+        workers.clear();
+        
+        root = compute_root();
+    }
+    
+    /** root of the leaves 0..n-1 (they must all be there) */
+    string compute_root() {
+        vector<string> level;
+        for (uint64_t i=0; leaves.count(i); i++)
+            level.push_back(leaves[i]);
+        if (!level.size())
+            return "";
+        
+        while (level.size() > 1) {
+            vector<string> up;
+            for (int i=0; i<level.size(); i+=2)
+                up.push_back( (i+1 < level.size()) ? parent(level[i], level[i+1]) : level[i] );
+            level.swap(up);
+        }
+        return level[0];
+    }
+    
+    static string to_hex(const string &digest) {
+        static const char hex[] = "0123456789abcdef";
+        string ris;
+        for (int i=0; i<digest.length(); i++) {
+            ris += hex[(unsigned char) digest[i] >> 4];
+            ris += hex[(unsigned char) digest[i] & 15];
+        }
+        return ris;
+    }
+    
+    string get_root() { return root; }
+    string get_algorithm() { return algorithm; }
+    int64_t get_leaf_size() { return leaf_size; }
+    uint64_t get_length() { return length; }
+    uint64_t get_tot_leaves() { return leaves.size(); }
+    bool has_leaf(uint64_t leaf) { return leaves.count(leaf) > 0; }
+    string get_leaf(uint64_t leaf) { return leaves[leaf]; }
+    string get_error() { return errore; }
+    
+    /** write the sidecar file */
+    bool save(const char *file_name) {
+        ofstream f(file_name, ios_base::out | ios_base::binary);
+        if (!f.is_open()) {
+            errore = string("opening ") + file_name;
+            return false;
+        }
+        
+        uint32_t name_len = algorithm.length();
+        uint64_t leaf = leaf_size, tot = leaves.size();
+        f.write(TREE_MAGIC, 8);
+        f.write((char *) &name_len, sizeof(name_len));
+        f.write(algorithm.data(), name_len);
+        f.write((char *) &leaf, sizeof(leaf));
+        f.write((char *) &length, sizeof(length));
+        f.write((char *) &tot, sizeof(tot));
+        f.write((char *) &digest_len, sizeof(digest_len));
+        for (uint64_t i=0; i<tot; i++)
+            f.write(leaves[i].data(), digest_len);
+        f.write(root.data(), root.length());
+        
+        f.close();
+        if (f.fail()) {
+            errore = string("writing ") + file_name;
+            return false;
+        }
+        return true;
+    }
+    
+    /** read a sidecar file; the stored root is checked against the leaves */
+    bool load(const char *file_name) {
+        ifstream f(file_name, ios_base::in | ios_base::binary);
+        if (!f.is_open()) {
+            errore = string("opening ") + file_name;
+            return false;
+        }
+        
+        char magic[8];
+        uint32_t name_len = 0;
+        uint64_t leaf = 0, tot = 0;
+        f.read(magic, 8);
+        f.read((char *) &name_len, sizeof(name_len));
+        if (!f || memcmp(magic, TREE_MAGIC, 8) || name_len > 64) {
+            errore = string(file_name) + " is not a hash tree file";
+            return false;
+        }
+        vector<char> name(name_len);
+        f.read(&name[0], name_len);
+        f.read((char *) &leaf, sizeof(leaf));
+        f.read((char *) &length, sizeof(length));
+        f.read((char *) &tot, sizeof(tot));
+        f.read((char *) &digest_len, sizeof(digest_len));
+        algorithm = string(&name[0], name_len);
+        leaf_size = leaf;
+        type = fastdd_digest::get_digestbyname(algorithm.c_str());
+        if (!f || !type || (unsigned) fastdd_digest::md_size(type) != digest_len) {
+            errore = string(file_name) + " is damaged or uses an unknown digest";
+            return false;
+        }
+        if (leaf_size <= 0 || tot != length/leaf + (length%leaf != 0)) {
+            errore = string(file_name) + " is damaged (its leaves do not cover its length)";
+            return false;
+        }
+        
+        // the leaves must all be in the file, before making room for them
+        streampos here = f.tellg();
+        f.seekg(0, ios_base::end);
+        uint64_t left = f.tellg() - here;
+        f.seekg(here);
+        if (!f || tot > left/digest_len || (tot ? tot+1 : 0) * digest_len > left) {
+            errore = string(file_name) + " is truncated";
+            return false;
+        }
+        
+        vector<char> digest(digest_len);
+        for (uint64_t i=0; i<tot; i++) {
+            f.read(&digest[0], digest_len);
+            leaves[i] = string(&digest[0], digest_len);
+        }
+        if (tot) {      // an empty stream has no root
+            f.read(&digest[0], digest_len);
+            root = string(&digest[0], digest_len);
+        }
+        if (!f) {
+            errore = string(file_name) + " is truncated";
+            return false;
+        }
+        if (compute_root() != root) {
+            errore = string(file_name) + " is damaged (its leaves do not give its root)";
+            return false;
+        }
+        
+        return true;
+    }
+    
+    ~fastdd_tree() {
+        finish();
+    }
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_URING_H
+    #define _FASTDD_URING_H
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+using namespace std;
+
+/** Minimal io_uring wrapper used by the 'engine=uring' input engine.
+ *  It only knows how to queue positioned reads and collect their completions,
+ *  talking to the kernel through the raw system calls (no liburing needed). */
+class fastdd_uring {
+    private:
+    int ring_fd;
+    unsigned entries;
+    unsigned in_flight;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+
+    string errore;
+
+    void set_error(const char *what) {
+        errore = string(what) + " (" + strerror(errno) + ")";
+    }
+
+    /** ask the kernel whether IORING_OP_READ is supported (it came with 5.6,
+     *  some years after the ring itself) */
+    bool probe_read() {
+        size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, len);
+        if (!probe) {
+            set_error("allocating io_uring probe");
+            return false;
+        }
+        bool ok = false;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            set_error("io_uring probe failed");
+        else if (probe->last_op < IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+            errore = "IORING_OP_READ not supported by this kernel";
+        else
+            ok = true;
+        free(probe);
+        return ok;
+    }
+
+    public:
+
+    fastdd_uring() {
+        ring_fd = -1;
+        entries = in_flight = to_submit = 0;
+        sq_ptr = cq_ptr = MAP_FAILED;
+        sqes = (struct io_uring_sqe *) MAP_FAILED;
+        sq_size = cq_size = sqes_size = 0;
+    }
+
+    /** create a ring able to keep 'depth' reads in flight */
+    bool init(unsigned depth) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+        if (ring_fd < 0) {
+            set_error("io_uring_setup failed");
+            ring_fd = -1;
+            return false;
+        }
+        entries = p.sq_entries;
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+        sq_ptr = mmap(0, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            set_error("mapping io_uring submission queue");
+            return false;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else {
+            cq_ptr = mmap(0, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                set_error("mapping io_uring completion queue");
+                return false;
+            }
+        }
+
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *) mmap(0, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            set_error("mapping io_uring submission entries");
+            return false;
+        }
+
+        sq_head = (unsigned *) ((char *) sq_ptr + p.sq_off.head);
+        sq_tail = (unsigned *) ((char *) sq_ptr + p.sq_off.tail);
+        sq_mask = (unsigned *) ((char *) sq_ptr + p.sq_off.ring_mask);
+        sq_array = (unsigned *) ((char *) sq_ptr + p.sq_off.array);
+        cq_head = (unsigned *) ((char *) cq_ptr + p.cq_off.head);
+        cq_tail = (unsigned *) ((char *) cq_ptr + p.cq_off.tail);
+        cq_mask = (unsigned *) ((char *) cq_ptr + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *) ((char *) cq_ptr + p.cq_off.cqes);
+
+        return probe_read();
+    }
+
+    bool is_ready() { return ring_fd >= 0; }
+
+    // number of entries the ring can keep in flight
+    unsigned get_depth() { return entries; }
+
+    unsigned get_in_flight() { return in_flight; }
+
+    /** queue a read of 'len' bytes at 'offset' of 'fd' into 'buf'; it is sent
+     *  to the kernel with the next wait() */
+    bool queue_read(int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data) {
+        if (in_flight + to_submit >= entries)
+            return false;
+
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail+1, __ATOMIC_RELEASE);
+        to_submit++;
+
+        return true;
+    }
+
+    /** submit the queued reads and wait for (at least) one completion.
+     *  Returns false on ring error */
+    bool wait(uint64_t *user_data, int *res) {
+        while (true) {
+            unsigned head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                *user_data = cqe->user_data;
+                *res = cqe->res;
+                __atomic_store_n(cq_head, head+1, __ATOMIC_RELEASE);
+                in_flight--;
+                return true;
+            }
+
+            if (!in_flight && !to_submit) {
+                errore = "no reads in flight";
+                return false;
+            }
+
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                set_error("io_uring_enter failed");
+                return false;
+            }
+            in_flight += ret;
+            to_submit -= ret;
+        }
+    }
+
+    string get_error() { return errore; }
+
+    ~fastdd_uring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * fastdd, v. 1.0.0, an open-ended forensic imaging tool
+ * Copyright (C) 2013, Free Software Foundation, Inc.
+ * written by Paolo Bertasi and Nicola Zago
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#ifndef _FASTDD_ZERO_H
+    #define _FASTDD_ZERO_H
+
+#include <cstring>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/** Detection of all-zero blocks, used by --sparse. The SIMD version is chosen
+ *  at runtime from the features of the CPU (AVX2, then SSE2, else plain C) */
+
+// plain C: 8 bytes at time
+static bool is_zero_generic(const unsigned char *p, uint64_t n) {
+    uint64_t i = 0, acc = 0;
+    for (; i+8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p+i, 8);
+        acc |= v;
+        if (acc) return false;
+    }
+    for (; i < n; i++)
+        if (p[i]) return false;
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__ ((target ("sse2")))
+static bool is_zero_sse2(const unsigned char *p, uint64_t n) {
+    uint64_t i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    for (; i+64 <= n; i += 64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) (p+i)), _mm_loadu_si128((const __m128i *) (p+i+16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *) (p+i+32)), _mm_loadu_si128((const __m128i *) (p+i+48)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), zero)) != 0xFFFF)
+            return false;
+    }
+    return is_zero_generic(p+i, n-i);
+}
+
+__attribute__ ((target ("avx2")))
+static bool is_zero_avx2(const unsigned char *p, uint64_t n) {
+    uint64_t i = 0;
+    for (; i+128 <= n; i += 128) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p+i)), _mm256_loadu_si256((const __m256i *) (p+i+32)));
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p+i+64)), _mm256_loadu_si256((const __m256i *) (p+i+96)));
+        a = _mm256_or_si256(a, b);
+        if (!_mm256_testz_si256(a, a))
+            return false;
+    }
+    return is_zero_generic(p+i, n-i);
+}
+#endif
+
+/** true if the n bytes at p are all zero */
+static bool is_zero_block(const unsigned char *p, uint64_t n) {
+    static bool (*is_zero)(const unsigned char *, uint64_t) = NULL;
+    
+    if (!is_zero) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            is_zero = is_zero_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            is_zero = is_zero_sse2;
+        else
+#endif
+            is_zero = is_zero_generic;
+    }
+    
+    // most data blocks are not zero since their first bytes
+    if (n >= 16 && !is_zero_generic(p, 16))
+        return false;
+    
+    return is_zero(p, n);
+}
+
+#endif